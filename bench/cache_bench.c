@@ -0,0 +1,196 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2010 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * ファイルキャッシュの取得のマイクロベンチマーク
+ *
+ * 多数のワーカースレッドが同時に bc_get() と bc_release() を呼び出します。
+ * ロックしない読み込み(body_cache.c)と、すべての取得を１つの mutex で
+ * 直列化した場合(以前の bc_get() の方式)を同じ条件で比較します。
+ * ボディをアリーナ(arena.c)に格納した場合も計測します。
+ * キャッシュサイズをキーの総量より小さくするとミスによる設定と追い出しが混在します。
+ *
+ * build:
+ *   cc -O2 -I. -I/usr/local/include/nestalib -o cache_bench \
+ *      bench/cache_bench.c src/body_cache.c src/arena.c -lnesta -lpthread
+ *
+ * usage:
+ *   ./cache_bench [threads] [keys] [gets per thread] [cache kbytes]
+ */
+#include "src/http_server.h"
+
+#define DEFAULT_THREADS 64
+#define DEFAULT_KEYS 1000
+#define DEFAULT_GETS 1000000
+#define OBJECT_SIZE 4096
+
+static int threads = DEFAULT_THREADS;
+static int keys = DEFAULT_KEYS;
+static long gets = DEFAULT_GETS;
+static long cache_size = DEFAULT_KEYS * (OBJECT_SIZE / 1024) * 2;
+
+static struct body_cache_t* bc;
+static char** key_table;
+static char* body;
+
+/* mutex で直列化する場合 */
+static int serialize;
+static int arena;
+static pthread_mutex_t get_mutex;
+
+static char* get_body(const char* key, int n, void** ref)
+{
+    char* data;
+
+    if (serialize)
+        pthread_mutex_lock(&get_mutex);
+    data = bc_get(bc, key, (time_t)n, OBJECT_SIZE, ref);
+    if (serialize)
+        pthread_mutex_unlock(&get_mutex);
+    return data;
+}
+
+static void* worker(void* argv)
+{
+    unsigned int x;
+    long i;
+    long hits = 0;
+
+    x = (unsigned int)*(long*)argv * 2654435761U + 1;
+    for (i = 0; i < gets; i++) {
+        void* ref;
+        char* data;
+        int n;
+
+        /* xorshift */
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        n = (int)(x % keys);
+
+        data = get_body(key_table[n], n, &ref);
+        if (data != NULL) {
+            if (data[0] != (char)n)
+                fprintf(stderr, "broken data: %s\n", key_table[n]);
+            bc_release(bc, ref);
+            hits++;
+        } else {
+            char buf[OBJECT_SIZE];
+
+            memcpy(buf, body, sizeof(buf));
+            buf[0] = (char)n;
+            bc_set(bc, key_table[n], (time_t)n, OBJECT_SIZE, buf);
+        }
+    }
+    *(long*)argv = hits;
+    return NULL;
+}
+
+static void run(const char* name)
+{
+    pthread_t* t_tbl;
+    long* counts;
+    long total = 0;
+    struct bc_stats_t st;
+    int64 start_time;
+    int64 elap;
+    int i;
+
+    bc = bc_initialize(cache_size * 1024L, OBJECT_SIZE, "tinylfu", "", "", arena, 0);
+    if (bc == NULL)
+        return;
+    t_tbl = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+    counts = (long*)calloc(threads, sizeof(long));
+
+    start_time = system_time();
+    for (i = 0; i < threads; i++) {
+        counts[i] = i;
+        pthread_create(&t_tbl[i], NULL, worker, &counts[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(t_tbl[i], NULL);
+        total += counts[i];
+    }
+    elap = system_time() - start_time;
+
+    bc_stats(bc, &st);
+    fprintf(stdout, "%-9s %ld gets %lld us  %.0f gets/sec  hits %lld  evictions %lld\n",
+            name, gets * threads, elap, (double)(gets * threads) * 1000000.0 / (double)elap,
+            st.hits, st.evictions);
+    bc_finalize(bc);
+
+    free(counts);
+    free(t_tbl);
+}
+
+int main(int argc, char* argv[])
+{
+    int i;
+
+    if (argc > 1)
+        threads = atoi(argv[1]);
+    if (argc > 2)
+        keys = atoi(argv[2]);
+    if (argc > 3)
+        gets = atol(argv[3]);
+    if (argc > 4)
+        cache_size = atol(argv[4]);
+    else
+        cache_size = (long)keys * (OBJECT_SIZE / 1024) * 2;
+    if (threads < 1 || keys < 1 || gets < 1 || cache_size < OBJECT_SIZE / 1024) {
+        fprintf(stdout, "usage: %s [threads] [keys] [gets per thread] [cache kbytes]\n", argv[0]);
+        return 1;
+    }
+    fprintf(stdout, "threads=%d keys=%d gets=%ld cache=%ldKB\n",
+            threads, keys, gets * threads, cache_size);
+
+    mt_initialize();
+
+    key_table = (char**)malloc(sizeof(char*) * keys);
+    for (i = 0; i < keys; i++) {
+        char key[64];
+
+        snprintf(key, sizeof(key), "/var/www/html/doc%d.html", i);
+        key_table[i] = strdup(key);
+    }
+    body = (char*)calloc(1, OBJECT_SIZE);
+
+    pthread_mutex_init(&get_mutex, NULL);
+    serialize = 1;
+    run("mutex");
+    serialize = 0;
+    run("lockfree");
+    arena = 1;
+    run("arena");
+    pthread_mutex_destroy(&get_mutex);
+
+    for (i = 0; i < keys; i++)
+        free(key_table[i]);
+    free(key_table);
+    free(body);
+
+    mt_finalize();
+    return 0;
+}
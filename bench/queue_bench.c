@@ -0,0 +1,213 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2010 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * リクエストキューのマイクロベンチマーク
+ *
+ * nestalib の que_*() + mutex/cond (以前の g_queue の方式)と
+ * wqueue.c のロックフリーキューを同じ条件で比較します。
+ *
+ * build:
+ *   cc -O2 -I. -I/usr/local/include/nestalib -o queue_bench \
+ *      bench/queue_bench.c src/wqueue.c -lnesta -lpthread
+ *
+ * usage:
+ *   ./queue_bench [producers] [consumers] [items per producer]
+ */
+#include "src/http_server.h"
+
+#define DEFAULT_PRODUCERS 1          /* acceptor */
+#define DEFAULT_CONSUMERS 20         /* worker threads */
+#define DEFAULT_ITEMS 1000000
+
+#define BENCH_END_MARK ((void*)-1)
+
+static int producers = DEFAULT_PRODUCERS;
+static int consumers = DEFAULT_CONSUMERS;
+static long items = DEFAULT_ITEMS;
+
+/* que_*() */
+static struct queue_t* que;
+static pthread_mutex_t que_mutex;
+static pthread_cond_t que_cond;
+
+/* wq_*() */
+static struct wqueue_t* wq;
+
+static long item_data = 1;  /* dummy */
+
+static void* que_producer(void* argv)
+{
+    long i;
+
+    for (i = 0; i < items; i++) {
+        que_push(que, &item_data);
+        pthread_mutex_lock(&que_mutex);
+        pthread_cond_signal(&que_cond);
+        pthread_mutex_unlock(&que_mutex);
+    }
+    return NULL;
+}
+
+static void* que_consumer(void* argv)
+{
+    long n = 0;
+
+    for (;;) {
+        void* data;
+
+        pthread_mutex_lock(&que_mutex);
+        while (que_empty(que))
+            pthread_cond_wait(&que_cond, &que_mutex);
+        pthread_mutex_unlock(&que_mutex);
+
+        data = que_pop(que);
+        if (data == NULL)
+            continue;
+        if (data == BENCH_END_MARK)
+            break;
+        n++;
+    }
+    *(long*)argv = n;
+    return NULL;
+}
+
+static void* wq_producer(void* argv)
+{
+    long i;
+
+    for (i = 0; i < items; i++) {
+        while (wq_push(wq, &item_data) < 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void* wq_consumer(void* argv)
+{
+    long n = 0;
+
+    for (;;) {
+        void* data;
+
+        data = wq_wait_pop(wq, -1);
+        if (data == NULL)
+            continue;
+        if (data == BENCH_END_MARK)
+            break;
+        n++;
+    }
+    *(long*)argv = n;
+    return NULL;
+}
+
+static void run(const char* name,
+                void* (*producer)(void*),
+                void* (*consumer)(void*),
+                int (*push)(void*))
+{
+    pthread_t* p_tbl;
+    pthread_t* c_tbl;
+    long* counts;
+    long total = 0;
+    int64 start_time;
+    int64 elap;
+    int i;
+
+    p_tbl = (pthread_t*)malloc(sizeof(pthread_t) * producers);
+    c_tbl = (pthread_t*)malloc(sizeof(pthread_t) * consumers);
+    counts = (long*)calloc(consumers, sizeof(long));
+
+    start_time = system_time();
+    for (i = 0; i < consumers; i++)
+        pthread_create(&c_tbl[i], NULL, consumer, &counts[i]);
+    for (i = 0; i < producers; i++)
+        pthread_create(&p_tbl[i], NULL, producer, NULL);
+    for (i = 0; i < producers; i++)
+        pthread_join(p_tbl[i], NULL);
+    for (i = 0; i < consumers; i++)
+        (*push)(BENCH_END_MARK);
+    for (i = 0; i < consumers; i++) {
+        pthread_join(c_tbl[i], NULL);
+        total += counts[i];
+    }
+    elap = system_time() - start_time;
+
+    fprintf(stdout, "%-8s %ld items %lld us  %.0f items/sec\n",
+            name, total, elap, (double)total * 1000000.0 / (double)elap);
+
+    free(counts);
+    free(c_tbl);
+    free(p_tbl);
+}
+
+static int que_end_push(void* data)
+{
+    que_push(que, data);
+    pthread_mutex_lock(&que_mutex);
+    pthread_cond_signal(&que_cond);
+    pthread_mutex_unlock(&que_mutex);
+    return 0;
+}
+
+static int wq_end_push(void* data)
+{
+    while (wq_push(wq, data) < 0)
+        sched_yield();
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1)
+        producers = atoi(argv[1]);
+    if (argc > 2)
+        consumers = atoi(argv[2]);
+    if (argc > 3)
+        items = atol(argv[3]);
+    if (producers < 1 || consumers < 1 || items < 1) {
+        fprintf(stdout, "usage: %s [producers] [consumers] [items per producer]\n", argv[0]);
+        return 1;
+    }
+    fprintf(stdout, "producers=%d consumers=%d items=%ld\n",
+            producers, consumers, items * producers);
+
+    mt_initialize();
+
+    que = que_initialize();
+    pthread_mutex_init(&que_mutex, NULL);
+    pthread_cond_init(&que_cond, NULL);
+    run("que", que_producer, que_consumer, que_end_push);
+    pthread_cond_destroy(&que_cond);
+    pthread_mutex_destroy(&que_mutex);
+    que_finalize(que);
+
+    wq = wq_initialize(REQUEST_QUEUE_SIZE);
+    run("wqueue", wq_producer, wq_consumer, wq_end_push);
+    wq_finalize(wq);
+
+    mt_finalize();
+    return 0;
+}
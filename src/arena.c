@@ -0,0 +1,413 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2010 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "http_server.h"
+#include <stdint.h>
+#include <limits.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+/*
+ * ファイルキャッシュのボディを格納する固定サイズの領域(アリーナ)です。
+ *
+ * 起動時に領域全体を確保してスラブ(既定は 2MB)に分割します。
+ * スラブは格納する最大サイズ以上にするため、キャッシュできる最大サイズが大きい場合は大きくします。
+ * スラブはサイズクラス(約 12.5% 刻み)ごとに割り当て、同じサイズのチャンクに分けます。
+ * ボディを個別に malloc() しないためヒープが断片化せず、
+ * キャッシュが使用するメモリは設定したキャッシュサイズを超えません。
+ * すべてのチャンクが解放されたスラブは他のサイズクラスで再利用します。
+ *
+ * ヒュージページを指定した場合は MAP_HUGETLB で確保し、
+ * 確保できない場合や指定しない場合は透過的ヒュージページ(THP)を要求します。
+ */
+#define ARENA_SLAB_SIZE     (2*1024*1024)   /* slab size(huge page size) */
+#define ARENA_MIN_SLAB_SIZE (64*1024)       /* min slab size(small cache) */
+#define ARENA_MIN_SLABS     16              /* slabs at least(shrink slab size) */
+#define ARENA_MIN_CHUNK     64              /* min chunk size(cache line) */
+#define ARENA_MAX_CLASSES   128
+
+struct arena_slab_t {
+    int cls;                            /* size class(-1 is free slab) */
+    int used;                           /* allocated chunks */
+    int carved;                         /* chunks cut from slab */
+    void* free_chunk;                   /* freed chunks(next is in chunk) */
+    struct arena_slab_t* prev;          /* free or partial slab list */
+    struct arena_slab_t* next;
+};
+
+struct arena_class_t {
+    int chunk_size;
+    int chunks;                         /* chunks per slab */
+    struct arena_slab_t* partial;       /* slabs having free chunks */
+};
+
+struct arena_t {
+    char* mem;                          /* mapped memory */
+    int64 mem_size;
+    char* base;                         /* first slab */
+    int64 size;                         /* slabs total size */
+    int slab_size;
+    int slab_count;
+    int hugepage;                       /* MAP_HUGETLB */
+    int64 used_bytes;                   /* allocated chunks total size */
+    struct arena_slab_t* slabs;
+    struct arena_slab_t* free_slab;
+    int class_count;
+    struct arena_class_t classes[ARENA_MAX_CLASSES];
+    CS_DEF(lock);
+};
+
+static void slab_unlink(struct arena_slab_t** head, struct arena_slab_t* s)
+{
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        *head = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    s->prev = s->next = NULL;
+}
+
+static void slab_push(struct arena_slab_t** head, struct arena_slab_t* s)
+{
+    s->prev = NULL;
+    s->next = *head;
+    if (*head)
+        (*head)->prev = s;
+    *head = s;
+}
+
+/* サイズクラスを作成します(チャンクサイズは ARENA_MIN_CHUNK の倍数)。*/
+static void init_classes(struct arena_t* ar)
+{
+    int size = ARENA_MIN_CHUNK;
+
+    while (ar->class_count < ARENA_MAX_CLASSES) {
+        struct arena_class_t* c;
+
+        if (size > ar->slab_size || ar->class_count == ARENA_MAX_CLASSES - 1)
+            size = ar->slab_size;
+        c = &ar->classes[ar->class_count++];
+        c->chunk_size = size;
+        c->chunks = ar->slab_size / size;
+        if (size == ar->slab_size)
+            break;
+        size += size / 8;
+        size = (size + ARENA_MIN_CHUNK - 1) & ~(ARENA_MIN_CHUNK - 1);
+    }
+}
+
+/* サイズに合うサイズクラスを求めます。*/
+static int size_class(struct arena_t* ar, int size)
+{
+    int lo = 0;
+    int hi = ar->class_count - 1;
+
+    if (size <= 0 || size > ar->slab_size)
+        return -1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (ar->classes[mid].chunk_size < size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+#ifdef _WIN32
+static char* map_memory(int64 size, int hugepage)
+{
+    return (char*)VirtualAlloc(NULL, (SIZE_T)size, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+}
+
+static void unmap_memory(char* mem, int64 size)
+{
+    VirtualFree(mem, 0, MEM_RELEASE);
+}
+#else
+static char* map_memory(int64 size, int hugepage)
+{
+    void* mem;
+    int flags = MAP_PRIVATE|MAP_ANONYMOUS;
+
+    if (hugepage) {
+#ifdef MAP_HUGETLB
+        flags |= MAP_HUGETLB;
+#else
+        return NULL;
+#endif
+    }
+    mem = mmap(NULL, (size_t)size, PROT_READ|PROT_WRITE, flags, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (! hugepage)
+        madvise(mem, (size_t)size, MADV_HUGEPAGE);
+#endif
+    return (char*)mem;
+}
+
+static void unmap_memory(char* mem, int64 size)
+{
+    munmap(mem, (size_t)size);
+}
+#endif
+
+/*
+ * アリーナを初期化します。
+ * 格納する最大サイズが大きい場合はスラブのサイズを大きくします。
+ * キャッシュが小さい場合はスラブのサイズを小さくします。
+ * どちらもスラブの数が ARENA_MIN_SLABS 以上になる範囲で変更します。
+ *
+ * size: アリーナのサイズ(バイト)
+ * max_chunk: 格納する最大サイズ(バイト)
+ * hugepage: ヒュージページ(MAP_HUGETLB)を使用する場合は 1
+ *
+ * 戻り値
+ *  アリーナ構造体のポインタを返します。
+ *  エラーの場合は NULL を返します。
+ */
+struct arena_t* arena_initialize(int64 size, int max_chunk, int hugepage)
+{
+    struct arena_t* ar;
+    int64 align;
+    int i;
+
+    ar = (struct arena_t*)calloc(1, sizeof(struct arena_t));
+    if (ar == NULL) {
+        err_write("arena_initialize: no memory.");
+        return NULL;
+    }
+    ar->slab_size = ARENA_SLAB_SIZE;
+    while (ar->slab_size < max_chunk && ar->slab_size <= INT_MAX / 2 &&
+           size / (ar->slab_size * 2) >= ARENA_MIN_SLABS)
+        ar->slab_size *= 2;
+    while (ar->slab_size > ARENA_MIN_SLAB_SIZE && size / ar->slab_size < ARENA_MIN_SLABS)
+        ar->slab_size /= 2;
+    ar->slab_count = (int)((size + ar->slab_size - 1) / ar->slab_size);
+    ar->size = (int64)ar->slab_count * ar->slab_size;
+
+    /* ヒュージページの境界に揃えます。*/
+    align = ARENA_SLAB_SIZE;
+    ar->mem_size = (ar->size + align - 1) / align * align;
+    if (hugepage) {
+        ar->mem = map_memory(ar->mem_size, 1);
+        if (ar->mem != NULL)
+            ar->hugepage = 1;
+        else
+            err_write("arena_initialize: huge pages not available(%s), use normal pages.", strerror(errno));
+    }
+    if (ar->mem == NULL) {
+        /* 先頭を揃えるために余分に確保します(THP)。*/
+        ar->mem_size += align;
+        ar->mem = map_memory(ar->mem_size, 0);
+    }
+    if (ar->mem == NULL) {
+        err_write("arena_initialize: can't map memory(%lld bytes): %s", ar->mem_size, strerror(errno));
+        free(ar);
+        return NULL;
+    }
+    ar->base = (char*)(((uintptr_t)ar->mem + align - 1) & ~(uintptr_t)(align - 1));
+    if (ar->base + ar->size > ar->mem + ar->mem_size)
+        ar->base = ar->mem;
+
+    ar->slabs = (struct arena_slab_t*)calloc(ar->slab_count, sizeof(struct arena_slab_t));
+    if (ar->slabs == NULL) {
+        err_write("arena_initialize: no memory.");
+        unmap_memory(ar->mem, ar->mem_size);
+        free(ar);
+        return NULL;
+    }
+    for (i = ar->slab_count - 1; i >= 0; i--) {
+        ar->slabs[i].cls = -1;
+        slab_push(&ar->free_slab, &ar->slabs[i]);
+    }
+    init_classes(ar);
+    CS_INIT(&ar->lock);
+    return ar;
+}
+
+/*
+ * アリーナを終了します。
+ */
+void arena_finalize(struct arena_t* ar)
+{
+    if (ar == NULL)
+        return;
+    unmap_memory(ar->mem, ar->mem_size);
+    free(ar->slabs);
+    CS_DELETE(&ar->lock);
+    free(ar);
+}
+
+/*
+ * サイズに割り当てられるチャンクのサイズを求めます。
+ *
+ * 戻り値
+ *  チャンクのサイズを返します。
+ *  アリーナに格納できないサイズの場合はゼロを返します。
+ */
+int arena_chunk_size(struct arena_t* ar, int size)
+{
+    int cls;
+
+    cls = size_class(ar, size);
+    if (cls < 0)
+        return 0;
+    return ar->classes[cls].chunk_size;
+}
+
+/*
+ * アリーナに格納できる最大サイズ(スラブのサイズ)を取得します。
+ */
+int arena_max_size(struct arena_t* ar)
+{
+    return ar->slab_size;
+}
+
+/*
+ * アリーナからメモリを割り当てます。
+ *
+ * 戻り値
+ *  割り当てたメモリのポインタを返します。
+ *  空きがない場合や格納できないサイズの場合は NULL を返します。
+ */
+void* arena_alloc(struct arena_t* ar, int size)
+{
+    struct arena_class_t* c;
+    struct arena_slab_t* s;
+    char* p;
+    int cls;
+
+    cls = size_class(ar, size);
+    if (cls < 0)
+        return NULL;
+    c = &ar->classes[cls];
+
+    CS_START(&ar->lock);
+    s = c->partial;
+    if (s == NULL) {
+        /* 空いているスラブをこのサイズクラスに割り当てます。*/
+        s = ar->free_slab;
+        if (s == NULL) {
+            CS_END(&ar->lock);
+            return NULL;
+        }
+        slab_unlink(&ar->free_slab, s);
+        s->cls = cls;
+        s->used = 0;
+        s->carved = 0;
+        s->free_chunk = NULL;
+        slab_push(&c->partial, s);
+    }
+    if (s->free_chunk != NULL) {
+        p = (char*)s->free_chunk;
+        s->free_chunk = *(void**)p;
+    } else {
+        p = ar->base + (int64)(s - ar->slabs) * ar->slab_size + (int64)s->carved * c->chunk_size;
+        s->carved++;
+    }
+    s->used++;
+    if (s->free_chunk == NULL && s->carved == c->chunks)
+        slab_unlink(&c->partial, s);
+    ar->used_bytes += c->chunk_size;
+    CS_END(&ar->lock);
+    return p;
+}
+
+/*
+ * アリーナのメモリか調べます。
+ */
+int arena_contains(struct arena_t* ar, const void* p)
+{
+    return (ar != NULL && (const char*)p >= ar->base && (const char*)p < ar->base + ar->size);
+}
+
+/*
+ * メモリが属するスラブの番号を取得します。
+ * 同じスラブのチャンクをすべて解放すると他のサイズクラスでスラブを使用できます。
+ *
+ * 戻り値
+ *  スラブの番号を返します。
+ *  アリーナのメモリでない場合は -1 を返します。
+ */
+int arena_slab(struct arena_t* ar, const void* p)
+{
+    if (! arena_contains(ar, p))
+        return -1;
+    return (int)(((const char*)p - ar->base) / ar->slab_size);
+}
+
+/*
+ * arena_alloc() で割り当てたメモリを解放します。
+ */
+void arena_free(struct arena_t* ar, void* p)
+{
+    struct arena_class_t* c;
+    struct arena_slab_t* s;
+
+    s = &ar->slabs[((char*)p - ar->base) / ar->slab_size];
+
+    CS_START(&ar->lock);
+    c = &ar->classes[s->cls];
+    if (s->free_chunk == NULL && s->carved == c->chunks)
+        slab_push(&c->partial, s);
+    *(void**)p = s->free_chunk;
+    s->free_chunk = p;
+    s->used--;
+    ar->used_bytes -= c->chunk_size;
+    if (s->used == 0) {
+        /* 他のサイズクラスで使用できるようにします。*/
+        slab_unlink(&c->partial, s);
+        s->cls = -1;
+        slab_push(&ar->free_slab, s);
+    }
+    CS_END(&ar->lock);
+}
+
+/*
+ * アリーナの使用状況を取得します。
+ *
+ * size: アリーナのサイズを設定する領域
+ * used: 割り当てているチャンクの合計サイズを設定する領域
+ *
+ * 戻り値
+ *  ヒュージページ(MAP_HUGETLB)の場合は 1 を返します。
+ */
+int arena_stats(struct arena_t* ar, int64* size, int64* used)
+{
+    CS_START(&ar->lock);
+    *size = ar->size;
+    *used = ar->used_bytes;
+    CS_END(&ar->lock);
+    return ar->hugepage;
+}
@@ -0,0 +1,1603 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2010 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "http_server.h"
+#include <limits.h>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+/*
+ * 静的ドキュメントのボディ(ファイル内容)をメモリに保持するキャッシュです。
+ *
+ * キー(ファイルのフルパス、gzip は "gzip:フルパス")とファイル更新日時、
+ * サイズが一致する場合にキャッシュの内容を使用します。
+ * キャッシュ全体のバイト数を上限として、置き換えのポリシーを選択できます。
+ *
+ *   tinylfu: W-TinyLFU
+ *            新しいエントリーは小さなウィンドウ(LRU)に入り、
+ *            ウィンドウから溢れたものは参照頻度(count-min sketch)が
+ *            メイン領域の追い出し候補よりも高い場合だけ追加します。
+ *            メイン領域は試用(probation)と保護(protected)の Segmented LRU です。
+ *            クローラーのような一度しか参照されないアクセスで
+ *            参照頻度の高いものが追い出されることを防ぎます。
+ *   lru:     参照されていない時間が最も長いものから追い出します。
+ *
+ * 固定(pin)に指定されたファイルは追い出しません。
+ * 取得したボディは bc_release() まで解放しません。
+ *
+ * bc_set_map() で設定したエントリーはメモリマップしたファイルを参照します。
+ * ボディをヒープにコピーしないため、ページキャッシュと二重に保持しません。
+ * マップは追い出されて参照がなくなった時点でアンマップします。
+ *
+ * bc_get_single() はキャッシュにないキーの読み込みを１つのスレッドにまとめます。
+ * 最初のスレッドが読み込み(bc_load_end() で設定)、同じキーで取得しようとした
+ * 他のスレッドはその完了を待ってから同じデータを参照します。
+ *
+ * キャッシュにある場合の取得(ヒット)はロックしません。
+ * 読み込み側はエポックを通知してからハッシュ表をたどり、参照カウントを加算します。
+ * 追加や追い出しはロックした状態で行ない、外したエントリーは
+ * 外す前のエポックを通知している読み込み側がなくなるまで解放しません。
+ * ヒットはスレッドごとのバッファに記録して、次にロックした時に
+ * ポリシー(LRU の順序と参照頻度)に反映します。バッファが一杯の場合は記録しません。
+ *
+ * アリーナ(arena.c)を指定した場合、コピーしたボディはアリーナに格納して
+ * チャンクのサイズをキャッシュサイズとして計上します。
+ * アリーナに空きがない場合は同じチャンクサイズの追い出し候補を優先して追い出します。
+ */
+#define BC_WINDOW       0       /* window LRU(W-TinyLFU) or LRU */
+#define BC_PROBATION    1       /* main SLRU probation segment */
+#define BC_PROTECTED    2       /* main SLRU protected segment */
+#define BC_PINNED       3       /* never evicted */
+#define BC_REGIONS      4
+
+#define BC_WINDOW_PERCENT       1   /* window size(% of cache size) */
+#define BC_PROTECTED_PERCENT    80  /* protected size(% of main) */
+#define BC_SKETCH_DEPTH         4   /* count-min sketch rows */
+#define BC_SKETCH_MAX           15  /* max frequency counter */
+#define BC_AVERAGE_SIZE         4096 /* estimated average object size */
+#define BC_LOAD_WAIT_MS         3000 /* max wait for other thread's load */
+#define BC_CACHE_LINE           64
+#define BC_READER_SLOTS         256 /* concurrent lock-free readers(power of 2) */
+#define BC_READ_BUFFERS         16  /* hit record stripes(power of 2) */
+#define BC_READ_BUFFER_SIZE     64  /* hit records per stripe(power of 2) */
+#define BC_ARENA_EVICT_TRIES    4   /* evictions for arena allocation */
+#define BC_ARENA_RESERVE_PERCENT 3  /* arena for removed but referenced bodies */
+#define BC_ARENA_SCAN           32  /* arena victim search */
+
+#ifdef _WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+struct bc_entry_t {
+    char* key;                          /* cache key */
+    unsigned int hash;                  /* hash value of key */
+    time_t mtime;                       /* file modified time */
+    int size;                           /* data size */
+    int charge;                         /* charged bytes(arena chunk size) */
+    char* data;                         /* cached contents */
+    struct mmap_t* map;                 /* mapped file(NULL is heap copy) */
+    int region;                         /* BC_XXX */
+    int refcount;                       /* cache(1) + references by bc_get() */
+    int64 retire_epoch;                 /* removed epoch */
+    struct bc_entry_t* retire_next;     /* waiting for readers */
+    struct bc_entry_t* next;            /* hash chain */
+    struct bc_entry_t* lru_prev;        /* region list(head is most recently used) */
+    struct bc_entry_t* lru_next;
+};
+
+/* 読み込み中のキー(bc_get_single) */
+struct bc_flight_t {
+    char* key;
+    unsigned int hash;
+    time_t mtime;
+    int size;
+    int64 start_time;                   /* load start time(usec) */
+    int waiters;                        /* waiting threads(entry references) */
+    int refs;                           /* threads referencing this flight */
+    int stale;                          /* removed by bc_remove() while loading */
+    volatile int done;                  /* loaded(futex word) */
+    struct bc_entry_t* entry;           /* loaded entry(NULL is failed) */
+    struct bc_flight_t* next;
+#ifdef _WIN32
+    SRWLOCK wait_lock;
+    CONDITION_VARIABLE wait_cond;
+#elif !defined(__linux__)
+    pthread_mutex_t wait_mutex;
+    pthread_cond_t wait_cond;
+#endif
+};
+
+/* ロックせずに読み込み中のスレッド */
+struct bc_reader_t {
+    volatile int64 epoch;               /* announced epoch(0 is not reading) */
+    char pad[BC_CACHE_LINE - sizeof(int64)];
+};
+
+/* ポリシーに反映していないヒット */
+struct bc_read_buffer_t {
+    volatile unsigned int pos;          /* next record position */
+    volatile int pending;               /* recorded since last drain */
+    volatile int64 hits;
+    volatile unsigned int hashes[BC_READ_BUFFER_SIZE]; /* hash of key(0 is empty) */
+    char pad[BC_CACHE_LINE];
+};
+
+struct bc_list_t {
+    struct bc_entry_t* head;
+    struct bc_entry_t* tail;
+    int64 bytes;
+};
+
+struct bc_policy_t {
+    char* name;
+    void (*on_hit)(struct body_cache_t* bc, struct bc_entry_t* e);
+    void (*on_insert)(struct body_cache_t* bc, struct bc_entry_t* e);
+};
+
+struct body_cache_t {
+    struct bc_policy_t* policy;
+    int64 max_size;                     /* cache size(bytes) */
+    int64 max_object_size;              /* max cacheable data size */
+    int64 window_size;                  /* window region size(W-TinyLFU) */
+    int64 protected_size;               /* protected region size(W-TinyLFU) */
+    int64 total_bytes;                  /* cached bytes */
+    struct bc_entry_t** bucket;
+    unsigned int bucket_mask;
+    int entry_count;
+    struct bc_list_t list[BC_REGIONS];
+
+    /* 参照頻度(count-min sketch) */
+    unsigned char* sketch;
+    unsigned int sketch_mask;
+    int sample_count;
+    int sample_limit;                   /* aging(halve counters) */
+
+    /* 固定するファイル(ドキュメントルートからのパスの前方一致) */
+    char root[MAX_PATH+1];
+    int root_len;
+    int pin_count;
+    char** pins;
+
+    int64 hits;
+    int64 misses;
+    int64 inserts;
+    int64 evictions;
+    int64 rejects;
+    int64 coalesced;
+    int64 wait_timeouts;
+    int64 mapped_bytes;                 /* bytes of bc_set_map() entries */
+
+    struct bc_flight_t* flights;        /* loading keys */
+
+    /* ロックしない読み込み */
+    volatile int64 epoch;               /* incremented by removal */
+    void* reader_mem;
+    struct bc_reader_t* readers;        /* BC_READER_SLOTS(cache line aligned) */
+    struct bc_read_buffer_t* read_buffers; /* BC_READ_BUFFERS */
+    struct bc_entry_t* retired;         /* removed entries */
+
+    struct arena_t* arena;              /* body storage(NULL is malloc) */
+
+    CS_DEF(lock);
+};
+
+static THREAD_LOCAL int reader_slot = -1;
+static int reader_slot_seq;
+
+static unsigned int sketch_seeds[BC_SKETCH_DEPTH] = {
+    0x9E3779B1U, 0x85EBCA77U, 0xC2B2AE3DU, 0x27D4EB2FU
+};
+
+/* FNV-1a */
+static unsigned int bc_hash(const char* key)
+{
+    unsigned int h = 2166136261U;
+
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static unsigned int sketch_index(struct body_cache_t* bc, unsigned int hash, int row)
+{
+    unsigned int x;
+
+    x = hash * sketch_seeds[row];
+    x ^= x >> 15;
+    return (unsigned int)row * (bc->sketch_mask + 1) + (x & bc->sketch_mask);
+}
+
+/* 参照頻度を加算します。一定回数ごとにすべてのカウンタを半分にします。*/
+static void sketch_increment(struct body_cache_t* bc, unsigned int hash)
+{
+    int i;
+
+    for (i = 0; i < BC_SKETCH_DEPTH; i++) {
+        unsigned char* c;
+
+        c = &bc->sketch[sketch_index(bc, hash, i)];
+        if (*c < BC_SKETCH_MAX)
+            (*c)++;
+    }
+    if (++bc->sample_count >= bc->sample_limit) {
+        unsigned int n;
+
+        n = (bc->sketch_mask + 1) * BC_SKETCH_DEPTH;
+        while (n-- > 0)
+            bc->sketch[n] >>= 1;
+        bc->sample_count /= 2;
+    }
+}
+
+static int sketch_frequency(struct body_cache_t* bc, unsigned int hash)
+{
+    int i;
+    int freq = BC_SKETCH_MAX;
+
+    for (i = 0; i < BC_SKETCH_DEPTH; i++) {
+        int c;
+
+        c = bc->sketch[sketch_index(bc, hash, i)];
+        if (c < freq)
+            freq = c;
+    }
+    return freq;
+}
+
+static void list_unlink(struct body_cache_t* bc, struct bc_entry_t* e)
+{
+    struct bc_list_t* l;
+
+    l = &bc->list[e->region];
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        l->head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        l->tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+    l->bytes -= e->charge;
+}
+
+static void list_push_head(struct body_cache_t* bc, struct bc_entry_t* e, int region)
+{
+    struct bc_list_t* l;
+
+    e->region = region;
+    l = &bc->list[region];
+    e->lru_prev = NULL;
+    e->lru_next = l->head;
+    if (l->head)
+        l->head->lru_prev = e;
+    else
+        l->tail = e;
+    l->head = e;
+    l->bytes += e->charge;
+}
+
+static void list_move_head(struct body_cache_t* bc, struct bc_entry_t* e, int region)
+{
+    list_unlink(bc, e);
+    list_push_head(bc, e, region);
+}
+
+static struct bc_entry_t* bc_lookup(struct body_cache_t* bc, const char* key, unsigned int hash)
+{
+    struct bc_entry_t* e;
+
+    e = bc->bucket[hash & bc->bucket_mask];
+    while (e != NULL) {
+        if (e->hash == hash && strcmp(e->key, key) == 0)
+            return e;
+        e = e->next;
+    }
+    return NULL;
+}
+
+/* ハッシュ値だけで検索します(ヒットの記録をポリシーに反映する場合)。*/
+static struct bc_entry_t* bc_lookup_hash(struct body_cache_t* bc, unsigned int hash)
+{
+    struct bc_entry_t* e;
+
+    e = bc->bucket[hash & bc->bucket_mask];
+    while (e != NULL) {
+        if (e->hash == hash)
+            return e;
+        e = e->next;
+    }
+    return NULL;
+}
+
+/* ロックせずに検索します(エポックを通知した状態で呼び出します)。*/
+static struct bc_entry_t* read_lookup(struct body_cache_t* bc, const char* key, unsigned int hash)
+{
+    struct bc_entry_t* e;
+
+    e = ATOMIC_LOAD_PTR(&bc->bucket[hash & bc->bucket_mask]);
+    while (e != NULL) {
+        if (e->hash == hash && strcmp(e->key, key) == 0)
+            return e;
+        e = ATOMIC_LOAD_PTR(&e->next);
+    }
+    return NULL;
+}
+
+static void body_free(struct body_cache_t* bc, char* data)
+{
+    if (arena_contains(bc->arena, data))
+        arena_free(bc->arena, data);
+    else
+        free(data);
+}
+
+static void entry_free(struct body_cache_t* bc, struct bc_entry_t* e)
+{
+    if (e->map != NULL)
+        mmap_close(e->map);
+    else
+        body_free(bc, e->data);
+    free(e->key);
+    free(e);
+}
+
+static void flight_free(struct bc_flight_t* f)
+{
+#if !defined(_WIN32) && !defined(__linux__)
+    pthread_cond_destroy(&f->wait_cond);
+    pthread_mutex_destroy(&f->wait_mutex);
+#endif
+    free(f->key);
+    free(f);
+}
+
+/* 参照を解放します。最後の参照の場合はエントリーを解放します。*/
+static void entry_put(struct body_cache_t* bc, struct bc_entry_t* e)
+{
+    if (ATOMIC_SUB(&e->refcount, 1) == 0)
+        entry_free(bc, e);
+}
+
+/* エントリーをキャッシュから外します。参照中の場合は解放を遅らせます。*/
+static void entry_remove(struct body_cache_t* bc, struct bc_entry_t* e)
+{
+    struct bc_entry_t** pp;
+
+    pp = &bc->bucket[e->hash & bc->bucket_mask];
+    while (*pp != NULL) {
+        if (*pp == e) {
+            /* 読み込み中のスレッドは外したエントリーの next をたどれます。*/
+            ATOMIC_STORE_PTR(pp, e->next);
+            break;
+        }
+        pp = &(*pp)->next;
+    }
+    list_unlink(bc, e);
+    bc->total_bytes -= e->charge;
+    if (e->map != NULL)
+        bc->mapped_bytes -= e->charge;
+    bc->entry_count--;
+
+    /* 外す前のエポックで読み込み中のスレッドがなくなるまで解放しません。*/
+    e->retire_epoch = ATOMIC_ADD(&bc->epoch, 1);
+    e->retire_next = bc->retired;
+    bc->retired = e;
+}
+
+/*
+ * 外したエントリーのうち、読み込み中のスレッドが参照していないものの
+ * キャッシュの参照を解放します(ロックした状態で呼び出します)。
+ * 外した後に通知されたエポックのスレッドはそのエントリーをたどれません。
+ */
+static void reclaim(struct body_cache_t* bc)
+{
+    struct bc_entry_t** pp;
+    int64 min_epoch;
+    int i;
+
+    if (bc->retired == NULL)
+        return;
+    min_epoch = ATOMIC_LOAD(&bc->epoch) + 1;
+    ATOMIC_FENCE();
+    for (i = 0; i < BC_READER_SLOTS; i++) {
+        int64 epoch;
+
+        epoch = ATOMIC_LOAD(&bc->readers[i].epoch);
+        if (epoch != 0 && epoch < min_epoch)
+            min_epoch = epoch;
+    }
+
+    pp = &bc->retired;
+    while (*pp != NULL) {
+        struct bc_entry_t* e = *pp;
+
+        if (e->retire_epoch <= min_epoch) {
+            *pp = e->retire_next;
+            entry_put(bc, e);
+        } else {
+            pp = &e->retire_next;
+        }
+    }
+}
+
+/* スレッドごとに読み込みのスロットを割り当てます。*/
+static int thread_slot(void)
+{
+    if (reader_slot < 0)
+        reader_slot = ATOMIC_FETCH_ADD(&reader_slot_seq, 1) & (BC_READER_SLOTS - 1);
+    return reader_slot;
+}
+
+/*
+ * 読み込みを開始するエポックを通知します。
+ * スロットを共有しているスレッドが使用中の場合は次のスロットを使用します。
+ *
+ * 戻り値
+ *  通知したスロットを返します。
+ *  空いているスロットがない場合は NULL を返します(ロックして取得します)。
+ */
+static struct bc_reader_t* reader_enter(struct body_cache_t* bc, int slot)
+{
+    int i;
+
+    for (i = 0; i < BC_READER_SLOTS; i++) {
+        struct bc_reader_t* r;
+        int64 expected = 0;
+        int64 epoch;
+
+        r = &bc->readers[(slot + i) & (BC_READER_SLOTS - 1)];
+        epoch = ATOMIC_LOAD(&bc->epoch);
+        if (ATOMIC_CAS(&r->epoch, &expected, epoch)) {
+            /* 通知してからハッシュ表をたどります。*/
+            ATOMIC_FENCE();
+            return r;
+        }
+    }
+    return NULL;
+}
+
+static void reader_exit(struct bc_reader_t* r)
+{
+    ATOMIC_STORE(&r->epoch, 0);
+}
+
+/* ヒットを記録します。バッファが一杯の場合は記録しません。*/
+static void record_hit(struct body_cache_t* bc, int slot, unsigned int hash)
+{
+    struct bc_read_buffer_t* b;
+    unsigned int pos;
+    unsigned int expected = 0;
+
+    b = &bc->read_buffers[slot & (BC_READ_BUFFERS - 1)];
+    ATOMIC_ADD(&b->hits, 1);
+    if (hash == 0)
+        return;
+    pos = (unsigned int)ATOMIC_FETCH_ADD(&b->pos, 1);
+    if (ATOMIC_CAS(&b->hashes[pos & (BC_READ_BUFFER_SIZE - 1)], &expected, hash))
+        ATOMIC_STORE(&b->pending, 1);
+}
+
+static void entry_evict(struct body_cache_t* bc, struct bc_entry_t* e)
+{
+    entry_remove(bc, e);
+    bc->evictions++;
+}
+
+/* 固定しない領域から追い出し候補を選びます。*/
+static struct bc_entry_t* evict_candidate(struct body_cache_t* bc)
+{
+    if (bc->list[BC_PROBATION].tail)
+        return bc->list[BC_PROBATION].tail;
+    if (bc->list[BC_PROTECTED].tail)
+        return bc->list[BC_PROTECTED].tail;
+    return bc->list[BC_WINDOW].tail;
+}
+
+/* キャッシュサイズに収まるまで追い出します。*/
+static void evict_overflow(struct body_cache_t* bc)
+{
+    while (bc->total_bytes > bc->max_size) {
+        struct bc_entry_t* victim;
+
+        victim = evict_candidate(bc);
+        if (victim == NULL)
+            break;
+        entry_evict(bc, victim);
+    }
+}
+
+/*
+ * LRU
+ */
+static void lru_on_hit(struct body_cache_t* bc, struct bc_entry_t* e)
+{
+    if (e->region != BC_PINNED)
+        list_move_head(bc, e, BC_WINDOW);
+}
+
+static void lru_on_insert(struct body_cache_t* bc, struct bc_entry_t* e)
+{
+    list_push_head(bc, e, BC_WINDOW);
+    evict_overflow(bc);
+}
+
+/*
+ * W-TinyLFU
+ */
+static void tinylfu_on_hit(struct body_cache_t* bc, struct bc_entry_t* e)
+{
+    if (e->region == BC_WINDOW) {
+        list_move_head(bc, e, BC_WINDOW);
+    } else if (e->region == BC_PROBATION) {
+        /* 試用領域で再度参照されたものは保護領域に昇格します。*/
+        list_move_head(bc, e, BC_PROTECTED);
+        while (bc->list[BC_PROTECTED].bytes > bc->protected_size) {
+            struct bc_entry_t* demote;
+
+            demote = bc->list[BC_PROTECTED].tail;
+            if (demote == e)
+                break;
+            list_move_head(bc, demote, BC_PROBATION);
+        }
+    } else if (e->region == BC_PROTECTED) {
+        list_move_head(bc, e, BC_PROTECTED);
+    }
+}
+
+/*
+ * ウィンドウから溢れた候補をメイン領域に追加するか判定します。
+ * 空きがない場合は追い出し候補よりも参照頻度が高い場合だけ追加し、
+ * 候補のサイズ分の空きができるまで追い出し候補を順に比較します。
+ */
+static void tinylfu_admit(struct body_cache_t* bc, struct bc_entry_t* candidate)
+{
+    int freq;
+
+    list_unlink(bc, candidate);
+    freq = sketch_frequency(bc, candidate->hash);
+    while (bc->total_bytes > bc->max_size) {
+        struct bc_entry_t* victim;
+
+        victim = bc->list[BC_PROBATION].tail;
+        if (victim == NULL)
+            victim = bc->list[BC_PROTECTED].tail;
+        if (victim == NULL || sketch_frequency(bc, victim->hash) >= freq) {
+            /* 候補を追加しません。*/
+            list_push_head(bc, candidate, BC_WINDOW);
+            entry_remove(bc, candidate);
+            bc->rejects++;
+            return;
+        }
+        entry_evict(bc, victim);
+    }
+    list_push_head(bc, candidate, BC_PROBATION);
+}
+
+static void tinylfu_on_insert(struct body_cache_t* bc, struct bc_entry_t* e)
+{
+    list_push_head(bc, e, BC_WINDOW);
+    while (bc->list[BC_WINDOW].bytes > bc->window_size && bc->list[BC_WINDOW].tail != NULL)
+        tinylfu_admit(bc, bc->list[BC_WINDOW].tail);
+    evict_overflow(bc);
+}
+
+static struct bc_policy_t policy_table[] = {
+    { "tinylfu", tinylfu_on_hit, tinylfu_on_insert },
+    { "lru", lru_on_hit, lru_on_insert },
+    { NULL, NULL, NULL }
+};
+
+/* 記録したヒットをポリシーに反映します(ロックした状態で呼び出します)。*/
+static void drain_reads(struct body_cache_t* bc)
+{
+    int i;
+
+    for (i = 0; i < BC_READ_BUFFERS; i++) {
+        struct bc_read_buffer_t* b;
+        int j;
+
+        b = &bc->read_buffers[i];
+        if (ATOMIC_EXCHANGE(&b->pending, 0) == 0)
+            continue;
+        for (j = 0; j < BC_READ_BUFFER_SIZE; j++) {
+            unsigned int hash;
+            struct bc_entry_t* e;
+
+            hash = (unsigned int)ATOMIC_EXCHANGE(&b->hashes[j], 0);
+            if (hash == 0)
+                continue;
+            sketch_increment(bc, hash);
+            e = bc_lookup_hash(bc, hash);
+            if (e != NULL)
+                bc->policy->on_hit(bc, e);
+        }
+    }
+}
+
+/* 固定するファイルのパスをカンマで区切った文字列から設定します。*/
+static int set_pins(struct body_cache_t* bc, const char* root, const char* pins)
+{
+    const char* p;
+
+    snprintf(bc->root, sizeof(bc->root), "%s", root);
+    bc->root_len = strlen(bc->root);
+    while (bc->root_len > 0 && bc->root[bc->root_len-1] == '/')
+        bc->root[--bc->root_len] = '\0';
+
+    if (pins == NULL || *pins == '\0')
+        return 0;
+    p = pins;
+    while (*p) {
+        const char* end;
+        int len;
+
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        end = p;
+        while (*end && *end != ',')
+            end++;
+        len = (int)(end - p);
+        while (len > 0 && (p[len-1] == ' ' || p[len-1] == '\t'))
+            len--;
+        if (len > 0) {
+            char** pp;
+            char* pin;
+
+            pp = (char**)realloc(bc->pins, sizeof(char*) * (bc->pin_count + 1));
+            if (pp == NULL) {
+                err_write("bc_initialize: no memory.");
+                return -1;
+            }
+            bc->pins = pp;
+            pin = (char*)malloc(len + 2);
+            if (pin == NULL) {
+                err_write("bc_initialize: no memory.");
+                return -1;
+            }
+            /* ドキュメントルートからのパスは '/' で始めます。*/
+            if (*p == '/') {
+                memcpy(pin, p, len);
+                pin[len] = '\0';
+            } else {
+                pin[0] = '/';
+                memcpy(pin + 1, p, len);
+                pin[len+1] = '\0';
+            }
+            bc->pins[bc->pin_count++] = pin;
+        }
+        p = end;
+    }
+    return 0;
+}
+
+static int is_pinned(struct body_cache_t* bc, const char* key)
+{
+    int i;
+
+    if (bc->pin_count == 0)
+        return 0;
+    if (strncmp(key, "gzip:", 5) == 0)
+        key += 5;
+    if (bc->root_len > 0) {
+        if (strncmp(key, bc->root, bc->root_len) != 0)
+            return 0;
+        key += bc->root_len;
+    }
+    for (i = 0; i < bc->pin_count; i++) {
+        if (strncmp(key, bc->pins[i], strlen(bc->pins[i])) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * ファイルキャッシュを初期化します。
+ *
+ * max_size: キャッシュサイズ(バイト)
+ * max_object_size: キャッシュするファイルの最大サイズ(バイト)
+ * policy: 置き換えのポリシー("tinylfu" または "lru")
+ * root: ドキュメントルート
+ * pins: 固定するファイル(ドキュメントルートからのパスをカンマで区切ったもの)
+ * arena: ボディをアリーナに格納する場合は 1
+ * hugepage: アリーナをヒュージページ(MAP_HUGETLB)で確保する場合は 1
+ *
+ * 戻り値
+ *  ファイルキャッシュ構造体のポインタを返します。
+ *  エラーの場合は NULL を返します。
+ */
+struct body_cache_t* bc_initialize(int64 max_size,
+                                   int64 max_object_size,
+                                   const char* policy,
+                                   const char* root,
+                                   const char* pins,
+                                   int arena,
+                                   int hugepage)
+{
+    struct body_cache_t* bc;
+    struct bc_policy_t* pt;
+    unsigned int size = 256;
+    int64 entries;
+
+    for (pt = policy_table; pt->name != NULL; pt++) {
+        if (stricmp(pt->name, policy) == 0)
+            break;
+    }
+    if (pt->name == NULL) {
+        err_write("bc_initialize: unknown policy(%s).", policy);
+        return NULL;
+    }
+
+    bc = (struct body_cache_t*)calloc(1, sizeof(struct body_cache_t));
+    if (bc == NULL) {
+        err_write("bc_initialize: no memory.");
+        return NULL;
+    }
+    CS_INIT(&bc->lock);
+    bc->policy = pt;
+    bc->max_size = max_size;
+    bc->max_object_size = (max_object_size < max_size)? max_object_size : max_size;
+    bc->window_size = max_size * BC_WINDOW_PERCENT / 100;
+    bc->protected_size = (max_size - bc->window_size) * BC_PROTECTED_PERCENT / 100;
+
+    /* ハッシュ表とスケッチは平均的なファイルサイズから見積もった件数にします。*/
+    entries = max_size / BC_AVERAGE_SIZE;
+    while (size < entries && size < (1U << 24))
+        size <<= 1;
+    bc->bucket = (struct bc_entry_t**)calloc(size, sizeof(struct bc_entry_t*));
+    bc->sketch = (unsigned char*)calloc(size, BC_SKETCH_DEPTH);
+    /* 読み込みのスロットはキャッシュラインに揃えます。*/
+    bc->reader_mem = calloc(BC_READER_SLOTS + 1, sizeof(struct bc_reader_t));
+    bc->read_buffers = (struct bc_read_buffer_t*)calloc(BC_READ_BUFFERS, sizeof(struct bc_read_buffer_t));
+    if (bc->bucket == NULL || bc->sketch == NULL ||
+        bc->reader_mem == NULL || bc->read_buffers == NULL) {
+        err_write("bc_initialize: no memory.");
+        bc_finalize(bc);
+        return NULL;
+    }
+    bc->readers = (struct bc_reader_t*)(((uintptr_t)bc->reader_mem + BC_CACHE_LINE - 1) &
+                                        ~(uintptr_t)(BC_CACHE_LINE - 1));
+    bc->epoch = 1;
+    bc->bucket_mask = size - 1;
+    bc->sketch_mask = size - 1;
+    bc->sample_limit = size * 10;
+
+    if (set_pins(bc, root, pins) < 0) {
+        bc_finalize(bc);
+        return NULL;
+    }
+    if (arena) {
+        /* 確保できない場合は malloc() を使用します。*/
+        bc->arena = arena_initialize(max_size,
+                                     (bc->max_object_size < INT_MAX)? (int)bc->max_object_size : INT_MAX,
+                                     hugepage);
+        if (bc->arena != NULL) {
+            /* アリーナ以外のメモリを使用しないようにスラブより大きいものはキャッシュしません。*/
+            if (bc->max_object_size > arena_max_size(bc->arena))
+                bc->max_object_size = arena_max_size(bc->arena);
+            /* 外した後も参照されているボディの分をアリーナに残しておきます。*/
+            bc->max_size = max_size - max_size * BC_ARENA_RESERVE_PERCENT / 100;
+            bc->window_size = bc->max_size * BC_WINDOW_PERCENT / 100;
+            bc->protected_size = (bc->max_size - bc->window_size) * BC_PROTECTED_PERCENT / 100;
+        }
+    }
+    return bc;
+}
+
+/*
+ * ファイルキャッシュを終了します。
+ */
+void bc_finalize(struct body_cache_t* bc)
+{
+    int i;
+
+    if (bc == NULL)
+        return;
+    if (bc->bucket != NULL) {
+        for (i = 0; i < BC_REGIONS; i++) {
+            while (bc->list[i].head != NULL)
+                entry_remove(bc, bc->list[i].head);
+        }
+        free(bc->bucket);
+    }
+    while (bc->retired != NULL) {
+        struct bc_entry_t* e = bc->retired;
+
+        bc->retired = e->retire_next;
+        entry_put(bc, e);
+    }
+    if (bc->arena != NULL)
+        arena_finalize(bc->arena);
+    if (bc->reader_mem != NULL)
+        free(bc->reader_mem);
+    if (bc->read_buffers != NULL)
+        free(bc->read_buffers);
+    if (bc->sketch != NULL)
+        free(bc->sketch);
+    for (i = 0; i < bc->pin_count; i++)
+        free(bc->pins[i]);
+    if (bc->pins != NULL)
+        free(bc->pins);
+    while (bc->flights != NULL) {
+        struct bc_flight_t* f = bc->flights;
+
+        bc->flights = f->next;
+        flight_free(f);
+    }
+    CS_DELETE(&bc->lock);
+    free(bc);
+}
+
+/*
+ * キャッシュできるサイズか調べます。
+ */
+int bc_cacheable(struct body_cache_t* bc, int64 size)
+{
+    return (bc != NULL && size <= bc->max_object_size);
+}
+
+/*
+ * ロックせずにキャッシュを検索して参照カウントを加算します。
+ *
+ * 戻り値
+ *  一致するエントリーのポインタを返します。
+ *  ない場合やファイルが更新されている場合は NULL を返します(ロックして取得します)。
+ */
+static struct bc_entry_t* read_get(struct body_cache_t* bc, const char* key, unsigned int hash,
+                                   time_t mtime, int size)
+{
+    struct bc_reader_t* r;
+    struct bc_entry_t* e;
+    int slot;
+
+    slot = thread_slot();
+    r = reader_enter(bc, slot);
+    if (r == NULL)
+        return NULL;
+    e = read_lookup(bc, key, hash);
+    if (e != NULL && e->mtime == mtime && e->size == size) {
+        /* 外されていてもエポックを通知している間は解放されません。*/
+        ATOMIC_ADD(&e->refcount, 1);
+    } else {
+        e = NULL;
+    }
+    reader_exit(r);
+
+    if (e != NULL)
+        record_hit(bc, slot, hash);
+    return e;
+}
+
+/* ロックした状態でキャッシュから取得します。*/
+static char* locked_get(struct body_cache_t* bc, const char* key, unsigned int hash,
+                        time_t mtime, int size, void** ref)
+{
+    struct bc_entry_t* e;
+    char* data = NULL;
+
+    drain_reads(bc);
+    sketch_increment(bc, hash);
+    e = bc_lookup(bc, key, hash);
+    if (e != NULL) {
+        if (e->mtime == mtime && e->size == size) {
+            ATOMIC_ADD(&e->refcount, 1);
+            bc->policy->on_hit(bc, e);
+            *ref = e;
+            data = e->data;
+        } else {
+            /* ファイルが更新されています。*/
+            entry_remove(bc, e);
+            reclaim(bc);
+        }
+    }
+    if (data != NULL)
+        bc->hits++;
+    else
+        bc->misses++;
+    return data;
+}
+
+/*
+ * キャッシュからデータを取得します。
+ * キー、ファイル更新日時、サイズが一致する必要があります。
+ * 取得したデータは bc_release() で解放します。
+ *
+ * bc: ファイルキャッシュ構造体のポインタ
+ * key: キー
+ * mtime: ファイル更新日時
+ * size: データのサイズ
+ * ref: 解放するための参照を設定する領域
+ *
+ * 戻り値
+ *  データのポインタを返します。
+ *  キャッシュにない場合は NULL を返します。
+ */
+char* bc_get(struct body_cache_t* bc, const char* key, time_t mtime, int size, void** ref)
+{
+    struct bc_entry_t* e;
+    unsigned int hash;
+    char* data;
+
+    *ref = NULL;
+    hash = bc_hash(key);
+    e = read_get(bc, key, hash, mtime, size);
+    if (e != NULL) {
+        *ref = e;
+        return e->data;
+    }
+
+    CS_START(&bc->lock);
+    data = locked_get(bc, key, hash, mtime, size, ref);
+    CS_END(&bc->lock);
+    return data;
+}
+
+/*
+ * bc_get() で取得したデータを解放します。
+ */
+void bc_release(struct body_cache_t* bc, void* ref)
+{
+    struct bc_entry_t* e;
+
+    e = (struct bc_entry_t*)ref;
+    if (e == NULL)
+        return;
+    entry_put(bc, e);
+}
+
+/* 領域の末尾からアリーナのエントリーを探します(charge が 0 の場合はサイズを問いません)。*/
+static struct bc_entry_t* arena_tail(struct body_cache_t* bc, int region, int charge)
+{
+    struct bc_entry_t* e;
+    int n = 0;
+
+    for (e = bc->list[region].tail; e != NULL && n < BC_ARENA_SCAN; e = e->lru_prev, n++) {
+        if ((charge == 0 || e->charge == charge) && e->map == NULL && arena_contains(bc->arena, e->data))
+            return e;
+    }
+    return NULL;
+}
+
+/*
+ * アリーナの空きを作るために追い出すエントリーを選びます。
+ * 同じチャンクサイズのエントリーを追い出すとすぐに割り当てられます。
+ * ない場合は他のサイズのエントリーを選び、そのスラブを空けます(evict_slab)。
+ * ウィンドウとメイン領域の候補は参照頻度の低いほうを選びます(W-TinyLFU の判定と同じ)。
+ */
+static struct bc_entry_t* arena_victim(struct body_cache_t* bc, int charge)
+{
+    struct bc_entry_t* w;
+    struct bc_entry_t* m;
+
+    w = arena_tail(bc, BC_WINDOW, charge);
+    m = arena_tail(bc, BC_PROBATION, charge);
+    if (m == NULL)
+        m = arena_tail(bc, BC_PROTECTED, charge);
+    if (w == NULL && m == NULL) {
+        w = arena_tail(bc, BC_WINDOW, 0);
+        m = arena_tail(bc, BC_PROBATION, 0);
+        if (m == NULL)
+            m = arena_tail(bc, BC_PROTECTED, 0);
+    }
+    if (w == NULL)
+        return m;
+    if (m == NULL)
+        return w;
+    return (sketch_frequency(bc, w->hash) <= sketch_frequency(bc, m->hash))? w : m;
+}
+
+/*
+ * エントリーと同じスラブにあるエントリーをすべて追い出して、
+ * スラブを他のサイズクラスで使用できるようにします(スラブの再割り当て)。
+ * 他のサイズのチャンクを１つ空けても割り当てられないためです。
+ * スラブのエントリーを探すためにキャッシュ全体を調べますが、
+ * 再割り当てしたスラブからはチャンクの数だけ割り当てられます。
+ * 固定したエントリーを含むスラブは空けられません。
+ */
+static void evict_slab(struct body_cache_t* bc, struct bc_entry_t* victim)
+{
+    int slab;
+    int i;
+
+    slab = arena_slab(bc->arena, victim->data);
+    /* 固定したもの(BC_PINNED)以外の領域 */
+    for (i = 0; i < BC_PINNED; i++) {
+        struct bc_entry_t* e;
+
+        e = bc->list[i].tail;
+        while (e != NULL) {
+            struct bc_entry_t* prev;
+
+            prev = e->lru_prev;
+            if (e->map == NULL && arena_slab(bc->arena, e->data) == slab)
+                entry_evict(bc, e);
+            e = prev;
+        }
+    }
+}
+
+/*
+ * ボディの領域を割り当てます。
+ * アリーナを使用しない場合とサイズがゼロの場合は malloc() で割り当てます。
+ * (アリーナに格納できないサイズはキャッシュしません)
+ *
+ * 戻り値
+ *  割り当てた領域のポインタを返します。charge には計上するサイズを設定します。
+ *  割り当てられない場合は NULL を返します。
+ */
+static char* body_alloc(struct body_cache_t* bc, int size, int* charge)
+{
+    char* p;
+    int i;
+
+    if (bc->arena == NULL || (*charge = arena_chunk_size(bc->arena, size)) == 0) {
+        *charge = size;
+        return (char*)malloc(size);
+    }
+    p = (char*)arena_alloc(bc->arena, size);
+    if (p != NULL)
+        return p;
+
+    /* 参照中のエントリーはすぐには解放されないため、回数を制限します。*/
+    CS_START(&bc->lock);
+    reclaim(bc);
+    p = (char*)arena_alloc(bc->arena, size);
+    for (i = 0; i < BC_ARENA_EVICT_TRIES && p == NULL; i++) {
+        struct bc_entry_t* victim;
+
+        victim = arena_victim(bc, *charge);
+        if (victim == NULL)
+            break;
+        if (victim->charge == *charge)
+            entry_evict(bc, victim);
+        else
+            evict_slab(bc, victim);
+        reclaim(bc);
+        p = (char*)arena_alloc(bc->arena, size);
+    }
+    if (p == NULL)
+        bc->rejects++;
+    CS_END(&bc->lock);
+    return p;
+}
+
+/* データをコピーしたエントリーを作成します。*/
+static struct bc_entry_t* entry_new(struct body_cache_t* bc, const char* key, time_t mtime, int size, const char* data)
+{
+    struct bc_entry_t* e;
+
+    e = (struct bc_entry_t*)calloc(1, sizeof(struct bc_entry_t));
+    if (e != NULL) {
+        e->key = strdup(key);
+        if (e->key != NULL)
+            e->data = body_alloc(bc, size, &e->charge);
+    }
+    if (e == NULL || e->key == NULL || e->data == NULL) {
+        if (e == NULL || e->key == NULL || bc->arena == NULL)
+            err_write("bc_set: no memory.");
+        if (e != NULL) {
+            if (e->key)
+                free(e->key);
+            free(e);
+        }
+        return NULL;
+    }
+    e->hash = bc_hash(key);
+    e->mtime = mtime;
+    e->size = size;
+    e->refcount = 1;
+    memcpy(e->data, data, size);
+    return e;
+}
+
+/* メモリマップを参照するエントリーを作成します。*/
+static struct bc_entry_t* entry_new_map(const char* key, time_t mtime, struct mmap_t* map)
+{
+    struct bc_entry_t* e;
+
+    e = (struct bc_entry_t*)calloc(1, sizeof(struct bc_entry_t));
+    if (e != NULL)
+        e->key = strdup(key);
+    if (e == NULL || e->key == NULL) {
+        err_write("bc_set_map: no memory.");
+        if (e != NULL)
+            free(e);
+        return NULL;
+    }
+    e->hash = bc_hash(key);
+    e->mtime = mtime;
+    e->size = (int)map->size;
+    e->charge = e->size;
+    e->data = (char*)map->ptr;
+    e->map = map;
+    e->refcount = 1;
+    return e;
+}
+
+/* エントリーをキャッシュに追加します(ロックした状態で呼び出します)。*/
+static void entry_insert(struct body_cache_t* bc, struct bc_entry_t* e)
+{
+    struct bc_entry_t* old;
+    unsigned int hash;
+
+    drain_reads(bc);
+    hash = e->hash;
+    old = bc_lookup(bc, e->key, hash);
+    if (old != NULL)
+        entry_remove(bc, old);
+
+    /* エントリーの内容を設定してから読み込み側に公開します。*/
+    e->next = bc->bucket[hash & bc->bucket_mask];
+    ATOMIC_STORE_PTR(&bc->bucket[hash & bc->bucket_mask], e);
+    bc->entry_count++;
+    bc->total_bytes += e->charge;
+    if (e->map != NULL)
+        bc->mapped_bytes += e->charge;
+    bc->inserts++;
+
+    if (is_pinned(bc, e->key)) {
+        list_push_head(bc, e, BC_PINNED);
+        evict_overflow(bc);
+        if (bc->total_bytes > bc->max_size) {
+            /* 固定したファイルだけでキャッシュサイズを超えています。*/
+            entry_remove(bc, e);
+            bc->rejects++;
+        }
+    } else {
+        bc->policy->on_insert(bc, e);
+    }
+    reclaim(bc);
+}
+
+/*
+ * データをキャッシュに設定します。データはコピーされます。
+ * ポリシーによっては追加されずに破棄される場合があります。
+ *
+ * 戻り値
+ *  正常に終了した場合はゼロを返します。
+ *  キャッシュできない場合は -1 を返します。
+ */
+int bc_set(struct body_cache_t* bc, const char* key, time_t mtime, int size, const char* data)
+{
+    struct bc_entry_t* e;
+
+    if (size > bc->max_object_size)
+        return -1;
+    e = entry_new(bc, key, mtime, size, data);
+    if (e == NULL)
+        return -1;
+
+    CS_START(&bc->lock);
+    entry_insert(bc, e);
+    CS_END(&bc->lock);
+    return 0;
+}
+
+#ifdef __linux__
+static void flight_wait(struct bc_flight_t* f, int timeout_ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    syscall(SYS_futex, &f->done, FUTEX_WAIT_PRIVATE, 0, &ts, NULL, 0);
+}
+
+static void flight_wakeup(struct bc_flight_t* f)
+{
+    ATOMIC_STORE(&f->done, 1);
+    syscall(SYS_futex, &f->done, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#elif defined(_WIN32)
+static void flight_wait(struct bc_flight_t* f, int timeout_ms)
+{
+    AcquireSRWLockExclusive(&f->wait_lock);
+    if (! ATOMIC_LOAD(&f->done))
+        SleepConditionVariableSRW(&f->wait_cond, &f->wait_lock, (DWORD)timeout_ms, 0);
+    ReleaseSRWLockExclusive(&f->wait_lock);
+}
+
+static void flight_wakeup(struct bc_flight_t* f)
+{
+    AcquireSRWLockExclusive(&f->wait_lock);
+    ATOMIC_STORE(&f->done, 1);
+    WakeAllConditionVariable(&f->wait_cond);
+    ReleaseSRWLockExclusive(&f->wait_lock);
+}
+#else
+static void flight_wait(struct bc_flight_t* f, int timeout_ms)
+{
+    struct timespec ts;
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    ts.tv_sec = tv.tv_sec + timeout_ms / 1000;
+    ts.tv_nsec = tv.tv_usec * 1000 + (timeout_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&f->wait_mutex);
+    if (! f->done)
+        pthread_cond_timedwait(&f->wait_cond, &f->wait_mutex, &ts);
+    pthread_mutex_unlock(&f->wait_mutex);
+}
+
+static void flight_wakeup(struct bc_flight_t* f)
+{
+    pthread_mutex_lock(&f->wait_mutex);
+    ATOMIC_STORE(&f->done, 1);
+    pthread_cond_broadcast(&f->wait_cond);
+    pthread_mutex_unlock(&f->wait_mutex);
+}
+#endif
+
+static struct bc_flight_t* flight_lookup(struct body_cache_t* bc, const char* key, unsigned int hash)
+{
+    struct bc_flight_t* f;
+
+    for (f = bc->flights; f != NULL; f = f->next) {
+        if (f->hash == hash && strcmp(f->key, key) == 0)
+            return f;
+    }
+    return NULL;
+}
+
+static void flight_unlink(struct body_cache_t* bc, struct bc_flight_t* f)
+{
+    struct bc_flight_t** pp;
+
+    for (pp = &bc->flights; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == f) {
+            *pp = f->next;
+            break;
+        }
+    }
+}
+
+/*
+ * 読み込みを完了して待機しているスレッドを起床させます(ロックした状態で呼び出します)。
+ * 待機中のスレッドと呼び出し側(refs)の参照は追加する前に加算しておきます。
+ * ポリシーで追加されなかった場合もそれらが解放するまで保持されます。
+ */
+static void flight_end(struct body_cache_t* bc, struct bc_flight_t* f, struct bc_entry_t* e, int refs)
+{
+    flight_unlink(bc, f);
+    if (e != NULL) {
+        e->refcount += f->waiters + refs;
+        if (f->stale) {
+            /* 読み込み中に削除されたものは追加せずに待機中のスレッドだけで使用します。*/
+            entry_put(bc, e);
+            if (f->waiters + refs == 0)
+                e = NULL;
+        } else {
+            entry_insert(bc, e);
+        }
+        if (f->waiters > 0)
+            f->entry = e;
+    }
+    if (f->refs == 0) {
+        flight_free(f);
+    } else {
+        /* 解放は最後に参照しているスレッドが行ないます。*/
+        flight_wakeup(f);
+    }
+}
+
+/*
+ * bc_get() と同じですが、キャッシュにない場合は読み込みを１つのスレッドにまとめます。
+ *
+ * 他のスレッドが同じキーを読み込み中の場合はその完了を待ち、
+ * 読み込まれたデータを返します(ポリシーで追加されなかった場合も返します)。
+ * 読み込み中のスレッドがない場合は flight に読み込みの権利を設定して NULL を返します。
+ * その場合は読み込みの成否にかかわらず bc_load_end() を呼び出す必要があります。
+ *
+ * bc: ファイルキャッシュ構造体のポインタ
+ * key: キー
+ * mtime: ファイル更新日時
+ * size: データのサイズ
+ * ref: 解放するための参照を設定する領域
+ * flight: 読み込みの権利を設定する領域
+ *
+ * 戻り値
+ *  データのポインタを返します。
+ *  キャッシュにない場合は NULL を返します。
+ */
+char* bc_get_single(struct body_cache_t* bc, const char* key, time_t mtime, int size, void** ref, void** flight)
+{
+    struct bc_flight_t* f;
+    struct bc_entry_t* e;
+    unsigned int hash;
+    char* data = NULL;
+    int64 now;
+    int64 wait_ms;
+
+    *ref = NULL;
+    *flight = NULL;
+    hash = bc_hash(key);
+    e = read_get(bc, key, hash, mtime, size);
+    if (e != NULL) {
+        *ref = e;
+        return e->data;
+    }
+
+    now = system_time();
+    CS_START(&bc->lock);
+    data = locked_get(bc, key, hash, mtime, size, ref);
+    if (data != NULL) {
+        CS_END(&bc->lock);
+        return data;
+    }
+    if (size > bc->max_object_size) {
+        CS_END(&bc->lock);
+        return NULL;
+    }
+
+    f = flight_lookup(bc, key, hash);
+    if (f == NULL) {
+        /* このスレッドが読み込みます。*/
+        f = (struct bc_flight_t*)calloc(1, sizeof(struct bc_flight_t));
+        if (f != NULL && (f->key = strdup(key)) != NULL) {
+            f->hash = hash;
+            f->mtime = mtime;
+            f->size = size;
+            f->start_time = now;
+#ifdef _WIN32
+            InitializeSRWLock(&f->wait_lock);
+            InitializeConditionVariable(&f->wait_cond);
+#elif !defined(__linux__)
+            pthread_mutex_init(&f->wait_mutex, NULL);
+            pthread_cond_init(&f->wait_cond, NULL);
+#endif
+            f->next = bc->flights;
+            bc->flights = f;
+            *flight = f;
+        } else if (f != NULL) {
+            free(f);
+        }
+        CS_END(&bc->lock);
+        return NULL;
+    }
+
+    /* 異なる版の読み込みや完了しない読み込みは待ちません。*/
+    wait_ms = BC_LOAD_WAIT_MS - (now - f->start_time) / 1000;
+    if (f->mtime != mtime || f->size != size || wait_ms <= 0) {
+        CS_END(&bc->lock);
+        return NULL;
+    }
+    f->waiters++;
+    f->refs++;
+    CS_END(&bc->lock);
+
+    while (! ATOMIC_LOAD(&f->done) && wait_ms > 0) {
+        flight_wait(f, (int)wait_ms);
+        wait_ms = BC_LOAD_WAIT_MS - (system_time() - f->start_time) / 1000;
+    }
+
+    CS_START(&bc->lock);
+    if (f->done) {
+        /* 参照カウントは bc_load_end() で加算されています。*/
+        if (f->entry != NULL) {
+            *ref = f->entry;
+            data = f->entry->data;
+            bc->coalesced++;
+        }
+    } else {
+        f->waiters--;
+        bc->wait_timeouts++;
+    }
+    f->refs--;
+    if (f->done && f->refs == 0)
+        flight_free(f);
+    CS_END(&bc->lock);
+    return data;
+}
+
+/*
+ * bc_get_single() で取得した読み込みの権利で、読み込んだデータを設定します。
+ * 待機しているスレッドを起床させます。
+ *
+ * bc: ファイルキャッシュ構造体のポインタ
+ * flight: bc_get_single() で設定された読み込みの権利
+ * data: 読み込んだデータ(NULL は読み込みに失敗)
+ *
+ * 戻り値
+ *  キャッシュに設定した場合はゼロを返します。
+ *  設定できなかった場合は -1 を返します。
+ */
+int bc_load_end(struct body_cache_t* bc, void* flight, const char* data)
+{
+    struct bc_flight_t* f;
+    struct bc_entry_t* e = NULL;
+
+    f = (struct bc_flight_t*)flight;
+    if (f == NULL)
+        return -1;
+    if (data != NULL)
+        e = entry_new(bc, f->key, f->mtime, f->size, data);
+
+    CS_START(&bc->lock);
+    flight_end(bc, f, e, 0);
+    CS_END(&bc->lock);
+    return (e != NULL)? 0 : -1;
+}
+
+/*
+ * メモリマップしたファイルをコピーせずにキャッシュに設定します。
+ * 設定できた場合、マップはキャッシュが管理して参照がなくなった時点でアンマップします。
+ * 呼び出し側には参照が設定されるので、使用後に bc_release() で解放します。
+ *
+ * bc: ファイルキャッシュ構造体のポインタ
+ * key: キー
+ * mtime: ファイル更新日時
+ * map: mmap_open() でマップしたファイル
+ * flight: bc_get_single() で設定された読み込みの権利(NULL は不要)
+ * ref: 解放するための参照を設定する領域
+ *
+ * 読み込みの権利は設定できなかった場合も解放されます。
+ *
+ * 戻り値
+ *  キャッシュに設定した場合はゼロを返します。
+ *  設定できなかった場合は -1 を返します(マップは呼び出し側が解放します)。
+ */
+int bc_set_map(struct body_cache_t* bc, const char* key, time_t mtime, struct mmap_t* map, void* flight, void** ref)
+{
+    struct bc_flight_t* f;
+    struct bc_entry_t* e = NULL;
+
+    *ref = NULL;
+    f = (struct bc_flight_t*)flight;
+    if (map->size <= bc->max_object_size)
+        e = entry_new_map(key, mtime, map);
+
+    CS_START(&bc->lock);
+    if (f != NULL) {
+        flight_end(bc, f, e, 1);
+    } else if (e != NULL) {
+        e->refcount++;
+        entry_insert(bc, e);
+    }
+    CS_END(&bc->lock);
+    *ref = e;
+    return (e != NULL)? 0 : -1;
+}
+
+/* キーが一致するエントリーと読み込み中のキーを削除します(ロックした状態で呼び出します)。*/
+static void remove_key(struct body_cache_t* bc, const char* key)
+{
+    struct bc_entry_t* e;
+    struct bc_flight_t* f;
+    unsigned int hash;
+
+    hash = bc_hash(key);
+    e = bc_lookup(bc, key, hash);
+    if (e != NULL)
+        entry_remove(bc, e);
+    f = flight_lookup(bc, key, hash);
+    if (f != NULL)
+        f->stale = 1;
+}
+
+/*
+ * 指定されたキーのデータをキャッシュから削除します。
+ * 読み込み中のキーは読み込みが完了してもキャッシュに追加しません。
+ * 参照中のデータは bc_release() で解放されるまで保持されます。
+ *
+ * ファイルの更新日時とサイズが同じまま内容が変更された場合に使用します。
+ */
+void bc_remove(struct body_cache_t* bc, const char* key)
+{
+    CS_START(&bc->lock);
+    remove_key(bc, key);
+    reclaim(bc);
+    CS_END(&bc->lock);
+}
+
+/* キーがディレクトリ以下のファイルか調べます(prefix は "gzip:" などのキーの接頭辞)。*/
+static int key_in_dir(const char* key, const char* prefix, const char* dir, int dir_len)
+{
+    int len;
+
+    len = strlen(prefix);
+    if (strncmp(key, prefix, len) != 0)
+        return 0;
+    key += len;
+    return (strncmp(key, dir, dir_len) == 0 && key[dir_len] == '/');
+}
+
+/*
+ * 指定されたディレクトリ以下のファイルのデータをキャッシュからすべて削除します。
+ * 圧縮したボディ("gzip:" で始まるキー)も削除します。
+ */
+void bc_remove_dir(struct body_cache_t* bc, const char* dir)
+{
+    struct bc_flight_t* f;
+    int dir_len;
+    int i;
+
+    dir_len = strlen(dir);
+    CS_START(&bc->lock);
+    for (i = 0; i < BC_REGIONS; i++) {
+        struct bc_entry_t* e;
+
+        e = bc->list[i].head;
+        while (e != NULL) {
+            struct bc_entry_t* next;
+
+            next = e->lru_next;
+            if (key_in_dir(e->key, "", dir, dir_len) || key_in_dir(e->key, "gzip:", dir, dir_len))
+                entry_remove(bc, e);
+            e = next;
+        }
+    }
+    for (f = bc->flights; f != NULL; f = f->next) {
+        if (key_in_dir(f->key, "", dir, dir_len) || key_in_dir(f->key, "gzip:", dir, dir_len))
+            f->stale = 1;
+    }
+    reclaim(bc);
+    CS_END(&bc->lock);
+}
+
+/*
+ * キャッシュの統計情報を取得します。
+ */
+void bc_stats(struct body_cache_t* bc, struct bc_stats_t* st)
+{
+    int i;
+
+    CS_START(&bc->lock);
+    st->policy = bc->policy->name;
+    st->max_size = bc->max_size;
+    st->bytes = bc->total_bytes;
+    st->pinned_bytes = bc->list[BC_PINNED].bytes;
+    st->entries = bc->entry_count;
+    st->hits = bc->hits;
+    st->misses = bc->misses;
+    st->inserts = bc->inserts;
+    st->evictions = bc->evictions;
+    st->rejects = bc->rejects;
+    st->coalesced = bc->coalesced;
+    st->wait_timeouts = bc->wait_timeouts;
+    for (i = 0; i < BC_READ_BUFFERS; i++)
+        st->hits += ATOMIC_LOAD_RELAXED(&bc->read_buffers[i].hits);
+    st->mapped_bytes = bc->mapped_bytes;
+    st->arena_size = 0;
+    st->arena_used = 0;
+    st->arena_hugepage = 0;
+    if (bc->arena != NULL)
+        st->arena_hugepage = arena_stats(bc->arena, &st->arena_size, &st->arena_used);
+    CS_END(&bc->lock);
+}
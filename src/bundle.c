@@ -0,0 +1,286 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2010 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "http_server.h"
+#include <limits.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+/*
+ * ドキュメントバンドル
+ *
+ * nesta_pack で document_root を１つのファイルにまとめたものを
+ * メモリマップしてドキュメントを送信します。
+ * ファイルごとの open() と stat() がなくなり、バンドルファイルを
+ * rename() で置き換えることでドキュメントを一度に入れ替えることができます。
+ *
+ *   bundle_header_t
+ *   ボディ(パスの順、BUNDLE_ALIGN 境界、gzip はその直後)
+ *   bundle_entry_t[count](パスの順)
+ *   文字列テーブル
+ *
+ * レスポンスヘッダーフィールドは最初のリクエストで組み立てて保持します。
+ */
+struct bundle_t {
+    int fd;
+    struct mmap_t* map;
+    const char* base;                   /* top of mapped file */
+    struct bundle_header_t* header;
+    struct bundle_entry_t* entries;
+    const char* strings;
+    struct doc_header_t** headers;      /* [count * 2](identity, gzip) */
+};
+
+static int check_range(int64 offset, int64 size, int64 file_size)
+{
+    return (offset >= 0 && size >= 0 && offset <= file_size && size <= file_size - offset);
+}
+
+/*
+ * バンドルファイルの構造を検査します。
+ * 要求を処理するときに範囲を調べなくて済むように、すべてのエントリを調べます。
+ */
+static int bundle_verify(struct bundle_t* b, int64 file_size, const char* fname)
+{
+    struct bundle_header_t* h;
+    unsigned int i;
+
+    h = b->header;
+    if (file_size < (int64)sizeof(struct bundle_header_t) ||
+        memcmp(h->magic, BUNDLE_MAGIC, sizeof(h->magic)) != 0) {
+        err_write("bundle: not a bundle file (%s)", fname);
+        return -1;
+    }
+    if (h->version != BUNDLE_VERSION) {
+        err_write("bundle: unsupported version %u (%s)", h->version, fname);
+        return -1;
+    }
+    if (h->file_size != file_size ||
+        ! check_range(h->index_offset, (int64)h->count * sizeof(struct bundle_entry_t), file_size) ||
+        ! check_range(h->strings_offset, h->strings_size, file_size) ||
+        h->strings_size < 1 ||
+        (h->index_offset % sizeof(int64)) != 0) {
+        err_write("bundle: broken header (%s)", fname);
+        return -1;
+    }
+    b->entries = (struct bundle_entry_t*)(b->base + h->index_offset);
+    b->strings = b->base + h->strings_offset;
+    if (b->strings[h->strings_size - 1] != '\0') {
+        err_write("bundle: broken string table (%s)", fname);
+        return -1;
+    }
+
+    for (i = 0; i < h->count; i++) {
+        struct bundle_entry_t* e = &b->entries[i];
+
+        if (e->path >= h->strings_size || e->type >= h->strings_size || e->etag >= h->strings_size ||
+            ! check_range(e->offset, e->size, file_size) ||
+            ! check_range(e->gz_offset, e->gz_size, file_size) ||
+            e->size > INT_MAX || e->gz_size > INT_MAX) {
+            err_write("bundle: broken entry #%u (%s)", i, fname);
+            return -1;
+        }
+        /* 二分探索のためにパスの順になっている必要があります。*/
+        if (i > 0 && strcmp(b->strings + b->entries[i-1].path, b->strings + e->path) >= 0) {
+            err_write("bundle: entries are not sorted (%s)", b->strings + e->path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * バンドルファイルをメモリマップしてオープンします。
+ *
+ * fname: バンドルファイル名
+ *
+ * 戻り値
+ *  バンドル構造体のポインタを返します。
+ *  エラーの場合は NULL を返します。
+ */
+struct bundle_t* bundle_open(const char* fname)
+{
+    struct bundle_t* b;
+    struct stat file_stat;
+
+    b = (struct bundle_t*)calloc(1, sizeof(struct bundle_t));
+    if (b == NULL) {
+        err_write("bundle: no memory.");
+        return NULL;
+    }
+    if ((b->fd = FILE_OPEN(fname, O_RDONLY|O_BINARY, S_IREAD)) < 0) {
+        err_write("bundle: can't open (%s): %s", fname, strerror(errno));
+        free(b);
+        return NULL;
+    }
+    if (fstat(b->fd, &file_stat) < 0) {
+        err_write("bundle: fstat error (%s): %s", fname, strerror(errno));
+        bundle_close(b);
+        return NULL;
+    }
+    b->map = mmap_open(b->fd, MMAP_READONLY, MMAP_AUTO_SIZE);
+    if (b->map == NULL) {
+        err_write("bundle: mmap error (%s): %s", fname, strerror(errno));
+        bundle_close(b);
+        return NULL;
+    }
+    b->base = (const char*)b->map->ptr;
+    b->header = (struct bundle_header_t*)b->base;
+    if (bundle_verify(b, (int64)file_stat.st_size, fname) < 0) {
+        bundle_close(b);
+        return NULL;
+    }
+
+    b->headers = (struct doc_header_t**)calloc((size_t)b->header->count * 2 + 1,
+                                               sizeof(struct doc_header_t*));
+    if (b->headers == NULL) {
+        err_write("bundle: no memory.");
+        bundle_close(b);
+        return NULL;
+    }
+#ifdef MADV_WILLNEED
+    /* ボディはパスの順に並んでいるので先読みさせておきます。*/
+    madvise((void*)b->base, (size_t)b->map->size, MADV_WILLNEED);
+#endif
+    return b;
+}
+
+/*
+ * バンドルをクローズします。
+ */
+void bundle_close(struct bundle_t* b)
+{
+    if (b == NULL)
+        return;
+    if (b->headers != NULL) {
+        unsigned int i;
+
+        for (i = 0; i < b->header->count * 2; i++) {
+            if (b->headers[i] != NULL)
+                free(b->headers[i]);
+        }
+        free(b->headers);
+    }
+    if (b->map != NULL)
+        mmap_close(b->map);
+    if (b->fd >= 0)
+        FILE_CLOSE(b->fd);
+    free(b);
+}
+
+/*
+ * バンドルのファイル数を返します。
+ */
+int bundle_count(struct bundle_t* b)
+{
+    return (int)b->header->count;
+}
+
+/*
+ * バンドルからファイルを検索します。
+ * パスは正規化されている必要があります(先頭の '/' は無視します)。
+ *
+ * 戻り値
+ *  見つかった場合はゼロを返します。
+ *  見つからない場合は -1 を返します。
+ */
+int bundle_find(struct bundle_t* b, const char* path, struct bundle_file_t* bf)
+{
+    int low;
+    int high;
+
+    while (*path == '/')
+        path++;
+
+    low = 0;
+    high = (int)b->header->count - 1;
+    while (low <= high) {
+        int mid;
+        int cmp;
+        struct bundle_entry_t* e;
+
+        mid = (low + high) / 2;
+        e = &b->entries[mid];
+        cmp = strcmp(path, b->strings + e->path);
+        if (cmp == 0) {
+            bf->index = mid;
+            bf->path = b->strings + e->path;
+            bf->type = b->strings + e->type;
+            bf->etag = b->strings + e->etag;
+            bf->mtime = (time_t)e->mtime;
+            bf->data = b->base + e->offset;
+            bf->size = e->size;
+            bf->gz_data = (e->gz_size > 0)? b->base + e->gz_offset : NULL;
+            bf->gz_size = e->gz_size;
+            return 0;
+        }
+        if (cmp < 0)
+            high = mid - 1;
+        else
+            low = mid + 1;
+    }
+    return -1;
+}
+
+/*
+ * 組み立て済みのヘッダーフィールドを取得します。
+ *
+ * 戻り値
+ *  まだ組み立てられていない場合は NULL を返します。
+ */
+struct doc_header_t* bundle_get_header(struct bundle_t* b, int index, int encoding)
+{
+    return (struct doc_header_t*)ATOMIC_LOAD_PTR(&b->headers[index * 2 + encoding]);
+}
+
+/*
+ * 組み立てたヘッダーフィールドを保持します。
+ * 他のスレッドが先に設定していた場合はそちらを使用します。
+ * 設定後は変更しないのでロックせずに参照できます。
+ *
+ * 戻り値
+ *  保持したヘッダーフィールドのポインタを返します。
+ *  メモリが確保できない場合は NULL を返します。
+ */
+struct doc_header_t* bundle_set_header(struct bundle_t* b, int index, int encoding, struct doc_header_t* dh)
+{
+    struct doc_header_t* p;
+    struct doc_header_t* expected = NULL;
+
+    p = (struct doc_header_t*)malloc(sizeof(struct doc_header_t));
+    if (p == NULL)
+        return NULL;
+    memcpy(p, dh, sizeof(struct doc_header_t));
+    if (! ATOMIC_CAS_PTR(&b->headers[index * 2 + encoding], &expected, p)) {
+        free(p);
+        return expected;
+    }
+    return p;
+}
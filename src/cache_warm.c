@@ -0,0 +1,415 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2010 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "http_server.h"
+
+#ifndef _WIN32
+#include <glob.h>
+#endif
+
+/*
+ * 起動時にファイルキャッシュを準備します。
+ * リッスンソケットをオープンする前に次の順にファイルを読み込みます。
+ *
+ *   http.cache_warm_manifest  ファイル名のリスト(１行に１ファイル、# はコメント)
+ *   http.cache_warm_log       前日のアクセスログでリクエスト数の多い上位 N 件
+ *   http.cache_warm_glob      ドキュメントルートからのパターン(カンマ区切り)
+ *
+ * 読み込みは http.cache_warm_threads のスレッドで並行して行ない、
+ * 読み込んだバイト数がファイルキャッシュのサイズに達した時点で終了します。
+ */
+struct warm_name_t {
+    char* name;                         /* document_root relative path */
+    int count;                          /* request count(access log) */
+};
+
+struct warm_list_t {
+    struct warm_name_t* names;
+    int count;
+    int capacity;
+    int* slots;                         /* hash index of names(-1 is empty) */
+    unsigned int mask;
+};
+
+/* 読み込みスレッドで共有する状態 */
+static struct warm_list_t* warm_list;
+static int warm_next;                   /* next index of warm_list */
+static int64 warm_budget;               /* file cache size */
+static int64 warm_loaded;               /* loaded bytes */
+static int warm_files;                  /* loaded files */
+
+static CS_DEF(warm_lock);
+
+/* FNV-1a */
+static unsigned int warm_hash(const char* s)
+{
+    unsigned int h = 2166136261U;
+
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static int warm_list_init(struct warm_list_t* wl, int max_names)
+{
+    unsigned int size = 64;
+    unsigned int i;
+
+    while (size < (unsigned int)max_names * 2)
+        size <<= 1;
+    memset(wl, 0, sizeof(struct warm_list_t));
+    wl->slots = (int*)malloc(sizeof(int) * size);
+    if (wl->slots == NULL) {
+        err_write("cache_warm: no memory.");
+        return -1;
+    }
+    for (i = 0; i < size; i++)
+        wl->slots[i] = -1;
+    wl->mask = size - 1;
+    wl->capacity = max_names;
+    return 0;
+}
+
+static void warm_list_free(struct warm_list_t* wl)
+{
+    int i;
+
+    for (i = 0; i < wl->count; i++)
+        free(wl->names[i].name);
+    if (wl->names != NULL)
+        free(wl->names);
+    if (wl->slots != NULL)
+        free(wl->slots);
+}
+
+/*
+ * ファイル名をリストに追加します。
+ * 先頭の '/' は取り除きます。すでにある場合は件数を加算します。
+ */
+static void warm_list_add(struct warm_list_t* wl, const char* name)
+{
+    unsigned int i;
+    struct warm_name_t* wn;
+
+    while (*name == '/')
+        name++;
+    if (*name == '\0')
+        return;
+
+    i = warm_hash(name) & wl->mask;
+    while (wl->slots[i] >= 0) {
+        wn = &wl->names[wl->slots[i]];
+        if (strcmp(wn->name, name) == 0) {
+            wn->count++;
+            return;
+        }
+        i = (i + 1) & wl->mask;
+    }
+    if (wl->count >= wl->capacity)
+        return;
+    if (wl->names == NULL) {
+        wl->names = (struct warm_name_t*)malloc(sizeof(struct warm_name_t) * wl->capacity);
+        if (wl->names == NULL) {
+            err_write("cache_warm: no memory.");
+            return;
+        }
+    }
+    wn = &wl->names[wl->count];
+    wn->name = strdup(name);
+    if (wn->name == NULL)
+        return;
+    wn->count = 1;
+    wl->slots[i] = wl->count++;
+}
+
+/* マニフェストファイルのファイル名を追加します。*/
+static void add_manifest(struct warm_list_t* wl, const char* fname)
+{
+    FILE* fp;
+    char buf[MAX_PATH+1];
+
+    fp = fopen(fname, "r");
+    if (fp == NULL) {
+        err_write("cache_warm: manifest can't open (%s): %s", fname, strerror(errno));
+        return;
+    }
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+        int index;
+
+        index = indexof(buf, '#');
+        if (index >= 0)
+            buf[index] = '\0';
+        trim(buf);
+        if (*buf != '\0')
+            warm_list_add(wl, buf);
+    }
+    fclose(fp);
+}
+
+/*
+ * アクセスログ(log_write() の書式)からリクエスト数の多い URI を追加します。
+ *   ipaddr [DATE TIME] "method uri protocol" "user-agent" status content-length times(us)
+ * GET で 200, 206, 304 のものを数えます。
+ */
+static int compare_count(const void* a, const void* b)
+{
+    return ((const struct warm_name_t*)b)->count - ((const struct warm_name_t*)a)->count;
+}
+
+static void add_access_log(struct warm_list_t* wl, int top_n)
+{
+    char fname[MAX_PATH+1];
+    struct warm_list_t counts;
+    FILE* fp;
+    char buf[2048];
+    int i;
+
+    if (log_previous_fname(fname, sizeof(fname)) < 0)
+        return;
+    fp = fopen(fname, "r");
+    if (fp == NULL) {
+        TRACE("cache_warm: access log not found (%s).\n", fname);
+        return;
+    }
+    if (warm_list_init(&counts, CACHE_WARM_MAX_URIS) < 0) {
+        fclose(fp);
+        return;
+    }
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+        char* request;
+        char* uri;
+        char* end;
+        int status;
+
+        request = strchr(buf, '"');
+        if (request == NULL || strncmp(request + 1, "GET ", 4) != 0)
+            continue;
+        uri = request + 5;
+        end = strchr(uri, ' ');
+        if (end == NULL)
+            continue;
+        *end++ = '\0';
+
+        /* user-agent の後のステータスを取得します。*/
+        end = strchr(end, '"');
+        if (end == NULL || (end = strchr(end + 1, '"')) == NULL ||
+            (end = strchr(end + 1, '"')) == NULL)
+            continue;
+        status = atoi(end + 1);
+        if (status != HTTP_OK && status != HTTP_PARTIAL_CONTENT && status != HTTP_NOT_MODIFIED)
+            continue;
+
+        /* クエリ文字列とエンコードされた URI は対象にしません。*/
+        if (strchr(uri, '?') != NULL)
+            *strchr(uri, '?') = '\0';
+        if (strchr(uri, '%') != NULL)
+            continue;
+        warm_list_add(&counts, uri);
+    }
+    fclose(fp);
+
+    qsort(counts.names, counts.count, sizeof(struct warm_name_t), compare_count);
+    for (i = 0; i < counts.count && i < top_n; i++)
+        warm_list_add(wl, counts.names[i].name);
+    warm_list_free(&counts);
+}
+
+/* ドキュメントルートからのパターンに一致するファイル名を追加します。*/
+static void add_glob(struct warm_list_t* wl, const char* root, const char* patterns)
+{
+#ifdef _WIN32
+    err_write("cache_warm: http.cache_warm_glob is not supported.");
+#else
+    const char* p;
+    int root_len;
+
+    root_len = strlen(root);
+    p = patterns;
+    while (*p) {
+        char pattern[MAX_PATH+1];
+        const char* end;
+        int len;
+        glob_t g;
+
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        end = p;
+        while (*end && *end != ',')
+            end++;
+        len = (int)(end - p);
+        while (len > 0 && (p[len-1] == ' ' || p[len-1] == '\t'))
+            len--;
+        if (len > 0) {
+            snprintf(pattern, sizeof(pattern), "%s/%.*s", root, len, p);
+            if (glob(pattern, 0, NULL, &g) == 0) {
+                size_t i;
+
+                for (i = 0; i < g.gl_pathc; i++) {
+                    if (strncmp(g.gl_pathv[i], root, root_len) == 0)
+                        warm_list_add(wl, g.gl_pathv[i] + root_len);
+                }
+                globfree(&g);
+            }
+        }
+        p = end;
+    }
+#endif
+}
+
+/* リストのファイルを順に読み込みます。*/
+static void warm_load_list()
+{
+    for (;;) {
+        int index;
+        int64 n;
+
+        CS_START(&warm_lock);
+        index = warm_next++;
+        if (warm_loaded >= warm_budget)
+            index = warm_list->count;
+        CS_END(&warm_lock);
+        if (index >= warm_list->count)
+            break;
+
+        n = doc_preload(g_conf->document_root, warm_list->names[index].name);
+        if (n > 0) {
+            CS_START(&warm_lock);
+            warm_loaded += n;
+            warm_files++;
+            CS_END(&warm_lock);
+        }
+    }
+}
+
+#ifdef _WIN32
+static unsigned __stdcall warm_thread(void* argv)
+#else
+static void* warm_thread(void* argv)
+#endif
+{
+    warm_load_list();
+#ifdef _WIN32
+    _endthreadex(0);
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * 設定されたファイルをファイルキャッシュに読み込みます。
+ * すべてのスレッドが終了するまで待機します。
+ *
+ * 戻り値
+ *  読み込んだファイル数を返します。
+ */
+int cache_warm()
+{
+    struct warm_list_t wl;
+    int thread_count;
+    int i;
+#ifdef _WIN32
+    HANDLE* threads;
+#else
+    pthread_t* threads;
+#endif
+
+    if (g_file_cache == NULL || *g_conf->document_root == '\0')
+        return 0;
+    if (*g_conf->cache_warm_manifest == '\0' &&
+        g_conf->cache_warm_log <= 0 &&
+        *g_conf->cache_warm_glob == '\0')
+        return 0;
+
+    if (warm_list_init(&wl, CACHE_WARM_MAX_URIS) < 0)
+        return 0;
+    if (*g_conf->cache_warm_manifest != '\0')
+        add_manifest(&wl, g_conf->cache_warm_manifest);
+    if (g_conf->cache_warm_log > 0)
+        add_access_log(&wl, g_conf->cache_warm_log);
+    if (*g_conf->cache_warm_glob != '\0')
+        add_glob(&wl, g_conf->document_root, g_conf->cache_warm_glob);
+
+    warm_list = &wl;
+    warm_next = 0;
+    warm_budget = g_conf->file_cache_size;
+    warm_loaded = 0;
+    warm_files = 0;
+    CS_INIT(&warm_lock);
+
+    thread_count = g_conf->cache_warm_threads;
+    if (thread_count < 1)
+        thread_count = 1;
+    if (thread_count > wl.count)
+        thread_count = (wl.count > 0)? wl.count : 1;
+#ifdef _WIN32
+    threads = (HANDLE*)calloc(thread_count, sizeof(HANDLE));
+#else
+    threads = (pthread_t*)calloc(thread_count, sizeof(pthread_t));
+#endif
+    if (threads == NULL) {
+        err_write("cache_warm: no memory.");
+        thread_count = 0;
+    }
+    for (i = 0; i < thread_count; i++) {
+#ifdef _WIN32
+        threads[i] = (HANDLE)_beginthreadex(NULL, 0, warm_thread, NULL, 0, NULL);
+        if (threads[i] == 0) {
+            err_write("cache_warm: can't create thread.");
+            break;
+        }
+#else
+        if (pthread_create(&threads[i], NULL, warm_thread, NULL) != 0) {
+            err_write("cache_warm: can't create thread: %s", strerror(errno));
+            break;
+        }
+#endif
+    }
+    thread_count = i;
+    if (thread_count == 0)
+        warm_load_list();  /* スレッドを作成できない場合はここで読み込みます。*/
+
+    for (i = 0; i < thread_count; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+    if (threads != NULL)
+        free(threads);
+
+    TRACE("file cache warmed(%d/%d files, %lld bytes).\n", warm_files, wl.count, warm_loaded);
+    CS_DELETE(&warm_lock);
+    warm_list = NULL;
+    warm_list_free(&wl);
+    return warm_files;
+}
@@ -0,0 +1,148 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2010 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "http_server.h"
+
+/*
+ * レスポンスの Date ヘッダーに使用する現在時刻(GMT)の文字列を
+ * １秒毎に更新するクロックです。
+ *
+ * リクエスト毎に now_gmtstr() を呼び出さずに済むように
+ * クロックスレッドが２つのバッファを交互に更新して公開します。
+ * 参照側はすぐにコピーするため、更新中のバッファを読むことはありません。
+ */
+static char clock_date_buf[2][CLOCK_DATE_SIZE];
+static volatile int clock_index = 0;
+static volatile time_t clock_sec = 0;
+static volatile int clock_shutdown_flag = 0;
+
+static void clock_update()
+{
+    int next;
+
+    next = clock_index ^ 1;
+    clock_sec = time(NULL);
+    now_gmtstr(clock_date_buf[next], CLOCK_DATE_SIZE);
+#ifdef _WIN32
+    MemoryBarrier();
+#else
+    __sync_synchronize();
+#endif
+    clock_index = next;
+}
+
+static void clock_thread(void* argv)
+{
+    while (! clock_shutdown_flag) {
+        int64 usec;
+
+        /* 次の秒の境界まで待機します。*/
+        usec = 1000000L - (system_time() % 1000000L);
+#ifdef _WIN32
+        Sleep((DWORD)(usec / 1000) + 1);
+#else
+        usleep((useconds_t)usec);
+#endif
+        clock_update();
+    }
+#ifdef _WIN32
+    _endthread();
+#endif
+}
+
+/*
+ * クロックを初期化してクロックスレッドを起動します。
+ *
+ * 戻り値
+ *  正常に終了した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int clock_initialize()
+{
+#ifdef _WIN32
+    uintptr_t thread_id;
+#else
+    pthread_t thread_id;
+#endif
+
+    clock_shutdown_flag = 0;
+    clock_update();
+
+#ifdef _WIN32
+    thread_id = _beginthread(clock_thread, 0, NULL);
+    if (thread_id == (uintptr_t)-1) {
+        err_write("clock_initialize: can't create thread.");
+        return -1;
+    }
+#else
+    if (pthread_create(&thread_id, NULL, (void*)clock_thread, NULL) != 0) {
+        err_write("clock_initialize: can't create thread: %s", strerror(errno));
+        return -1;
+    }
+    pthread_detach(thread_id);
+#endif
+    return 0;
+}
+
+/*
+ * クロックスレッドを終了します。
+ * スレッドは次の更新時に終了します。
+ */
+void clock_finalize()
+{
+    clock_shutdown_flag = 1;
+}
+
+/*
+ * 現在時刻(GMT)の文字列をバッファにコピーします。
+ * 文字列は "Sun, 06 Nov 1994 08:49:37 GMT" の形式になります。
+ *
+ * buf: 文字列を設定するバッファ(CLOCK_DATE_SIZE 以上)
+ *
+ * 戻り値
+ *  文字列の長さを返します。
+ */
+int clock_date(char* buf)
+{
+    const char* date;
+    int len;
+
+    date = clock_date_buf[clock_index];
+    len = strlen(date);
+    memcpy(buf, date, len + 1);
+    return len;
+}
+
+/*
+ * クロックスレッドが更新した現在時刻(秒)を返します。
+ * システムコールを発行しないため精度は１秒です。
+ */
+time_t clock_time()
+{
+    return clock_sec;
+}
@@ -141,6 +141,7 @@ static struct appzone_t* get_appzone(const char* name)
  * http.username = string (default none, unix only)
  * http.port_no = number (default is 8080)
  * http.backlog = number (default is 50)
+ * http.acceptor_thread = number (default is 1, Linux only)
  * http.worker_thread = number (default is 10)
  * http.extend_worker_thread = number (default is zero)
  * http.worker_thread_timeout = number (default is 600 seconds)
@@ -148,9 +149,28 @@ static struct appzone_t* get_appzone(const char* name)
  * http.keep_alive_timeout = number (default is 3 seconds)
  * http.keep_alive_requests = number (default is 5)
  * http.document_root = path (default is nothing)
+ * http.document_bundle = path/file (default is nothing, nesta_pack output)
+ * http.mime_types = path/file (default is built-in types only)
  * http.file_cache_size = kbytes (default is not file-cache)
+ * http.file_cache_policy = tinylfu or lru (default is tinylfu)
+ * http.file_cache_max_object = kbytes (default is 1024)
+ * http.file_cache_pin = path[, path ...] (document_root relative, never evicted)
+ * http.file_cache_mmap = 1 or 0 (default is 0, cache mmap instead of copy)
+ * http.file_cache_arena = 1 or 0 (default is 0, preallocated size-class arena)
+ * http.file_cache_hugepage = 1 or 0 (default is 0, arena on MAP_HUGETLB pages)
+ * http.stream_threshold = kbytes (default is 16384, 0 is no streaming)
+ * http.cache_warm_manifest = path/file (default is nothing, one file per line)
+ * http.cache_warm_glob = pattern[, pattern ...] (document_root relative)
+ * http.cache_warm_log = number (default is 0, top-N URIs of previous access log)
+ * http.cache_warm_threads = number (default is 4)
+ * http.doc_cache_entries = number (default is 1000, 0 is no cache)
+ * http.doc_missing_entries = number (default is 1024, 0 is no cache)
+ * http.doc_cache_valid = seconds (default is 60)
+ * http.doc_watch = 1 or 0 (default is 1, Linux only)
+ * http.gzip = 1 or 0 (default is 1, zlib only)
  * http.access_log_fname = path/file (default is nolog)
  * http.daily_log_flag = 1 or 0 (default is 0)
+ * http.access_log_buffer = kbytes (default is 256 per thread, 0 is synchronous write)
  * http.error_file = path/file (default is stderr)
  * http.output_file = path/file (default is stdout)
  * http.trace_flag = 1 or 0 (default is 0)
@@ -226,10 +246,16 @@ int config(const char* conf_fname, int start_mode)
 
         if (stricmp(name, "http.document_root") == 0) {
             get_abspath(g_conf->document_root, value, sizeof(g_conf->document_root)-1);
+        } else if (stricmp(name, "http.document_bundle") == 0) {
+            get_abspath(g_conf->document_bundle, value, sizeof(g_conf->document_bundle)-1);
+        } else if (stricmp(name, "http.mime_types") == 0) {
+            get_abspath(g_conf->mime_types_file, value, sizeof(g_conf->mime_types_file)-1);
         } else if (stricmp(name, "http.port_no") == 0) {
             g_conf->port_no = (ushort)atoi(value);
         } else if (stricmp(name, "http.backlog") == 0) {
             g_conf->backlog = atoi(value);
+        } else if (stricmp(name, "http.acceptor_thread") == 0) {
+            g_conf->acceptor_threads = atoi(value);
         } else if (stricmp(name, "http.worker_thread") == 0) {
             g_conf->worker_threads = atoi(value);
         } else if (stricmp(name, "http.extend_worker_thread") == 0) {
@@ -248,10 +274,44 @@ int config(const char* conf_fname, int start_mode)
             strncpy(g_conf->username, value, sizeof(g_conf->username)-1);
         } else if (stricmp(name, "http.file_cache_size") == 0) {
             g_conf->file_cache_size = atol(value) * 1024L;
+        } else if (stricmp(name, "http.file_cache_policy") == 0) {
+            strncpy(g_conf->file_cache_policy, value, sizeof(g_conf->file_cache_policy)-1);
+        } else if (stricmp(name, "http.file_cache_max_object") == 0) {
+            g_conf->file_cache_max_object = atol(value) * 1024L;
+        } else if (stricmp(name, "http.file_cache_pin") == 0) {
+            strncpy(g_conf->file_cache_pin, value, sizeof(g_conf->file_cache_pin)-1);
+        } else if (stricmp(name, "http.file_cache_mmap") == 0) {
+            g_conf->file_cache_mmap = atoi(value);
+        } else if (stricmp(name, "http.file_cache_arena") == 0) {
+            g_conf->file_cache_arena = atoi(value);
+        } else if (stricmp(name, "http.file_cache_hugepage") == 0) {
+            g_conf->file_cache_hugepage = atoi(value);
+        } else if (stricmp(name, "http.stream_threshold") == 0) {
+            g_conf->stream_threshold = atol(value) * 1024L;
+        } else if (stricmp(name, "http.cache_warm_manifest") == 0) {
+            get_abspath(g_conf->cache_warm_manifest, value, sizeof(g_conf->cache_warm_manifest)-1);
+        } else if (stricmp(name, "http.cache_warm_glob") == 0) {
+            strncpy(g_conf->cache_warm_glob, value, sizeof(g_conf->cache_warm_glob)-1);
+        } else if (stricmp(name, "http.cache_warm_log") == 0) {
+            g_conf->cache_warm_log = atoi(value);
+        } else if (stricmp(name, "http.cache_warm_threads") == 0) {
+            g_conf->cache_warm_threads = atoi(value);
+        } else if (stricmp(name, "http.doc_cache_entries") == 0) {
+            g_conf->doc_cache_entries = atoi(value);
+        } else if (stricmp(name, "http.doc_missing_entries") == 0) {
+            g_conf->doc_missing_entries = atoi(value);
+        } else if (stricmp(name, "http.doc_cache_valid") == 0) {
+            g_conf->doc_cache_valid = atoi(value);
+        } else if (stricmp(name, "http.doc_watch") == 0) {
+            g_conf->doc_watch_flag = atoi(value);
+        } else if (stricmp(name, "http.gzip") == 0) {
+            g_conf->gzip_flag = atoi(value);
         } else if (stricmp(name, "http.access_log_fname") == 0) {
             get_abspath(g_conf->access_log_fname, value, sizeof(g_conf->access_log_fname)-1);
         } else if (stricmp(name, "http.daily_log_flag") == 0) {
             g_conf->daily_log_flag = atoi(value);
+        } else if (stricmp(name, "http.access_log_buffer") == 0) {
+            g_conf->access_log_buffer = atoi(value) * 1024;
         } else if (stricmp(name, "http.error_file") == 0) {
             get_abspath(g_conf->error_file, value, sizeof(g_conf->error_file)-1);
         } else if (stricmp(name, "http.output_file") == 0) {
@@ -0,0 +1,624 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2010 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "http_server.h"
+
+/*
+ * 静的ドキュメントのキャッシュです。
+ *
+ * ファイルのフルパスとコンテンツコーディング(DOC_ENCODING_XXX)をキーにして、
+ * stat() の結果(ファイル更新日時とサイズ)、オープンしたファイルディスクリプタ、
+ * 組み立て済みのレスポンスヘッダー(struct doc_header_t)を保持します。
+ * 同じパスのコーディング違い(gzip)はハッシュ値が同じになるため同じチェインに入ります。
+ *
+ * stat() の結果は valid_time 秒の間は再確認しません。
+ * その間のリクエストはファイルシステムのシステムコールを発行しません。
+ * ドキュメントルートを監視している場合(doc_watch.c)は再確認せずに
+ * 変更の通知でエントリーを削除します。
+ * stat() と設定の間に通知された変更を取りこぼさないように、通知ごとに世代を進めて
+ * stat() の前に取得した世代が古い場合は再確認が必要なエントリーとして設定します。
+ * エントリー数が最大数に達した場合は最も長く参照されていないものを削除します。
+ *
+ * ファイルディスクリプタは複数のワーカースレッドで共有するため、
+ * 参照カウントが０になるまでクローズしません。
+ * 共有しているディスクリプタはファイル位置を変更せずに使用します(pread, sendfile, mmap)。
+ */
+struct doc_entry_t {
+    char* path;                         /* full path(key) */
+    int encoding;                       /* content-coding(key) */
+    unsigned int hash;                  /* hash value of path */
+    struct doc_header_t header;         /* precomposed response header */
+    int fd;                             /* opened file(-1 is not opened) */
+    time_t check_time;                  /* last stat() time(0 is expired) */
+    int refcount;                       /* referenced count by doc_file_t */
+    int removed;                        /* removed from table */
+    struct doc_entry_t* next;           /* hash chain */
+    struct doc_entry_t* lru_prev;       /* LRU list(head is most recently used) */
+    struct doc_entry_t* lru_next;
+};
+
+static struct doc_entry_t** doc_bucket;
+static unsigned int doc_bucket_mask;
+static int doc_max_entries;
+static int doc_valid_time;
+static int doc_entry_count;
+static unsigned int doc_generation;     /* incremented by invalidation */
+static struct doc_entry_t* doc_lru_head;
+static struct doc_entry_t* doc_lru_tail;
+
+static CS_DEF(doc_cache_lock);
+
+/*
+ * 存在しないパスのキャッシュ(ネガティブキャッシュ)です。
+ * スキャナーなどによる存在しないパスへのリクエストで stat() を繰り返さないようにします。
+ * 固定サイズの２ウェイの表で、空きがない場合は古い方を上書きするため
+ * メモリを確保せずに件数が一定に保たれます。
+ * 長すぎるパスはキャッシュしません。
+ */
+struct doc_missing_t {
+    unsigned int hash;                  /* hash value of path(0 is empty) */
+    time_t expire;                      /* expire time */
+    char path[MAX_PATH];                /* full path(key) */
+};
+
+static struct doc_missing_t* doc_missing_tbl;
+static unsigned int doc_missing_mask;
+static int doc_missing_ttl;
+
+static CS_DEF(doc_missing_lock);
+
+/* FNV-1a */
+static unsigned int doc_hash(const char* path)
+{
+    unsigned int h = 2166136261U;
+
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static struct doc_entry_t* doc_lookup(const char* path, int encoding, unsigned int hash)
+{
+    struct doc_entry_t* e;
+
+    e = doc_bucket[hash & doc_bucket_mask];
+    while (e != NULL) {
+        if (e->hash == hash && e->encoding == encoding && strcmp(e->path, path) == 0)
+            return e;
+        e = e->next;
+    }
+    return NULL;
+}
+
+static void lru_unlink(struct doc_entry_t* e)
+{
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        doc_lru_head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        doc_lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_head(struct doc_entry_t* e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = doc_lru_head;
+    if (doc_lru_head)
+        doc_lru_head->lru_prev = e;
+    else
+        doc_lru_tail = e;
+    doc_lru_head = e;
+}
+
+static void entry_free(struct doc_entry_t* e)
+{
+    if (e->fd >= 0)
+        FILE_CLOSE(e->fd);
+    free(e->path);
+    free(e);
+}
+
+/* エントリーをハッシュ表から外します。参照中の場合は解放を遅らせます。*/
+static void entry_remove(struct doc_entry_t* e)
+{
+    struct doc_entry_t** pp;
+
+    pp = &doc_bucket[e->hash & doc_bucket_mask];
+    while (*pp != NULL) {
+        if (*pp == e) {
+            *pp = e->next;
+            break;
+        }
+        pp = &(*pp)->next;
+    }
+    lru_unlink(e);
+    doc_entry_count--;
+
+    e->removed = 1;
+    if (e->refcount == 0)
+        entry_free(e);
+}
+
+/* エントリーの参照を doc_file_t に設定します。*/
+static void entry_ref(struct doc_entry_t* e, struct doc_file_t* df)
+{
+    e->refcount++;
+    if (e != doc_lru_head) {
+        lru_unlink(e);
+        lru_push_head(e);
+    }
+    df->entry = e;
+    df->fd = e->fd;
+    df->fd_owner = 0;
+    memcpy(&df->header, &e->header, sizeof(struct doc_header_t));
+}
+
+/*
+ * ドキュメントキャッシュを初期化します。
+ *
+ * max_entries: キャッシュするファイルの最大数
+ * valid_time: stat() の結果を再確認するまでの秒数
+ * missing_entries: 存在しないパスをキャッシュする最大数(0 はキャッシュしません)
+ *
+ * 戻り値
+ *  正常に終了した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int doc_cache_initialize(int max_entries, int valid_time, int missing_entries)
+{
+    unsigned int size = 16;
+
+    while (size < (unsigned int)max_entries)
+        size <<= 1;
+
+    doc_bucket = (struct doc_entry_t**)calloc(size, sizeof(struct doc_entry_t*));
+    if (doc_bucket == NULL) {
+        err_write("doc_cache_initialize: no memory.");
+        return -1;
+    }
+    doc_bucket_mask = size - 1;
+    doc_max_entries = max_entries;
+    doc_valid_time = valid_time;
+    doc_entry_count = 0;
+    doc_lru_head = doc_lru_tail = NULL;
+    CS_INIT(&doc_cache_lock);
+
+    if (missing_entries > 0 && valid_time > 0) {
+        size = 2;
+        while (size < (unsigned int)missing_entries)
+            size <<= 1;
+        doc_missing_tbl = (struct doc_missing_t*)calloc(size, sizeof(struct doc_missing_t));
+        if (doc_missing_tbl == NULL) {
+            err_write("doc_cache_initialize: no memory.");
+            return -1;
+        }
+        doc_missing_mask = size - 1;
+        doc_missing_ttl = valid_time;
+        CS_INIT(&doc_missing_lock);
+    }
+    return 0;
+}
+
+/*
+ * ドキュメントキャッシュを終了します。
+ */
+void doc_cache_finalize()
+{
+    if (doc_bucket == NULL)
+        return;
+    CS_START(&doc_cache_lock);
+    while (doc_lru_head != NULL)
+        entry_remove(doc_lru_head);
+    free(doc_bucket);
+    doc_bucket = NULL;
+    CS_END(&doc_cache_lock);
+    CS_DELETE(&doc_cache_lock);
+
+    if (doc_missing_tbl != NULL) {
+        free(doc_missing_tbl);
+        doc_missing_tbl = NULL;
+        CS_DELETE(&doc_missing_lock);
+    }
+}
+
+/*
+ * キャッシュからドキュメントを取得します。
+ * stat() の結果が valid_time 秒を経過している場合は取得できません。
+ * 取得したドキュメントは doc_cache_release() で解放します。
+ *
+ * path: ファイルのフルパス
+ * encoding: コンテンツコーディング(DOC_ENCODING_XXX)
+ * df: ドキュメントを設定する領域
+ *
+ * 戻り値
+ *  取得できた場合はゼロを返します。
+ *  キャッシュにない場合は -1 を返します。
+ */
+int doc_cache_get(const char* path, int encoding, struct doc_file_t* df)
+{
+    struct doc_entry_t* e;
+    unsigned int hash;
+    int result = -1;
+
+    if (doc_bucket == NULL)
+        return -1;
+
+    hash = doc_hash(path);
+    CS_START(&doc_cache_lock);
+    e = doc_lookup(path, encoding, hash);
+    if (e != NULL && e->check_time != 0 &&
+        (doc_valid_time < 0 || clock_time() - e->check_time < doc_valid_time)) {
+        entry_ref(e, df);
+        result = 0;
+    }
+    CS_END(&doc_cache_lock);
+    return result;
+}
+
+/*
+ * 変更の通知による無効化の世代を取得します。
+ * stat() の前に取得して doc_cache_revalidate(), doc_cache_set() に渡します。
+ */
+unsigned int doc_cache_generation()
+{
+    return (unsigned int)ATOMIC_LOAD(&doc_generation);
+}
+
+/*
+ * stat() で再確認したファイル更新日時とサイズが同じ場合は
+ * キャッシュのドキュメントを取得して確認日時を更新します。
+ * stat() の後に無効化されている場合(世代が異なる場合)は確認日時を更新しません。
+ *
+ * 戻り値
+ *  取得できた場合はゼロを返します。
+ *  キャッシュにないかファイルが更新されている場合は -1 を返します。
+ */
+int doc_cache_revalidate(const char* path, int encoding, time_t mtime, int64 size, unsigned int generation, struct doc_file_t* df)
+{
+    struct doc_entry_t* e;
+    unsigned int hash;
+    int result = -1;
+
+    if (doc_bucket == NULL)
+        return -1;
+
+    hash = doc_hash(path);
+    CS_START(&doc_cache_lock);
+    e = doc_lookup(path, encoding, hash);
+    if (e != NULL && e->header.mtime == mtime && e->header.size == size) {
+        if (generation == doc_generation)
+            e->check_time = clock_time();
+        entry_ref(e, df);
+        result = 0;
+    }
+    CS_END(&doc_cache_lock);
+    return result;
+}
+
+/*
+ * ドキュメントをキャッシュに設定して取得します。
+ * 同じパスがある場合は置き換えます。
+ * キャッシュが最大数に達している場合は最も長く参照されていないものを削除します。
+ *
+ * 設定できた場合、ファイルディスクリプタはキャッシュが管理します。
+ * (Windows は pread() がないためディスクリプタを共有しません)
+ *
+ * path: ファイルのフルパス
+ * encoding: コンテンツコーディング(DOC_ENCODING_XXX)
+ * dh: ヘッダーフィールド
+ * fd: オープンしたファイルディスクリプタ
+ * generation: stat() の前に doc_cache_generation() で取得した世代
+ *             (世代が進んでいる場合は再確認が必要なエントリーとして設定します)
+ * df: ドキュメントを設定する領域
+ *
+ * 戻り値
+ *  設定した場合はゼロを返します。
+ *  設定できなかった場合は -1 を返します。
+ */
+int doc_cache_set(const char* path, int encoding, const struct doc_header_t* dh, int fd, unsigned int generation, struct doc_file_t* df)
+{
+    struct doc_entry_t* e;
+    struct doc_entry_t* old;
+    unsigned int hash;
+
+    if (doc_bucket == NULL || doc_max_entries <= 0)
+        return -1;
+
+    e = (struct doc_entry_t*)calloc(1, sizeof(struct doc_entry_t));
+    if (e != NULL)
+        e->path = strdup(path);
+    if (e == NULL || e->path == NULL) {
+        err_write("doc_cache_set: no memory.");
+        if (e != NULL)
+            free(e);
+        return -1;
+    }
+    hash = doc_hash(path);
+    e->hash = hash;
+    e->encoding = encoding;
+    memcpy(&e->header, dh, sizeof(struct doc_header_t));
+#ifdef _WIN32
+    e->fd = -1;
+#else
+    e->fd = fd;
+#endif
+    e->check_time = clock_time();
+
+    CS_START(&doc_cache_lock);
+    if (generation != doc_generation)
+        e->check_time = 0;
+    old = doc_lookup(path, encoding, hash);
+    if (old != NULL)
+        entry_remove(old);
+    while (doc_entry_count >= doc_max_entries && doc_lru_tail != NULL)
+        entry_remove(doc_lru_tail);
+
+    e->next = doc_bucket[hash & doc_bucket_mask];
+    doc_bucket[hash & doc_bucket_mask] = e;
+    lru_push_head(e);
+    doc_entry_count++;
+    entry_ref(e, df);
+    CS_END(&doc_cache_lock);
+
+#ifdef _WIN32
+    df->fd = fd;
+    df->fd_owner = 1;
+#endif
+    return 0;
+}
+
+/*
+ * doc_cache_get(), doc_cache_revalidate(), doc_cache_set() で
+ * 取得したドキュメントを解放します。
+ */
+void doc_cache_release(struct doc_file_t* df)
+{
+    struct doc_entry_t* e;
+
+    e = (struct doc_entry_t*)df->entry;
+    if (e == NULL)
+        return;
+    CS_START(&doc_cache_lock);
+    e->refcount--;
+    if (e->removed && e->refcount == 0)
+        entry_free(e);
+    CS_END(&doc_cache_lock);
+    df->entry = NULL;
+}
+
+/*
+ * stat() の結果を再確認するまでの秒数を設定します。
+ * -1 の場合は再確認しません。
+ */
+void doc_cache_set_valid(int valid_time)
+{
+    doc_valid_time = valid_time;
+}
+
+/* ハッシュ値が０のものは空きスロットと区別するため１にします。*/
+static unsigned int missing_hash(const char* path)
+{
+    unsigned int hash;
+
+    hash = doc_hash(path);
+    return (hash == 0)? 1 : hash;
+}
+
+/*
+ * 存在しないことがキャッシュされているパスか調べます。
+ *
+ * 戻り値
+ *  キャッシュされている場合は 1 を返します。
+ */
+int doc_cache_is_missing(const char* path)
+{
+    struct doc_missing_t* m;
+    unsigned int hash;
+    time_t now;
+    int result = 0;
+    int i;
+
+    if (doc_missing_tbl == NULL)
+        return 0;
+
+    hash = missing_hash(path);
+    m = &doc_missing_tbl[hash & doc_missing_mask & ~1U];
+    now = clock_time();
+    CS_START(&doc_missing_lock);
+    for (i = 0; i < 2; i++) {
+        if (m[i].hash == hash && m[i].expire > now && strcmp(m[i].path, path) == 0) {
+            result = 1;
+            break;
+        }
+    }
+    CS_END(&doc_missing_lock);
+    return result;
+}
+
+/*
+ * 存在しないパスをキャッシュに設定します。
+ * valid_time 秒の間は doc_cache_is_missing() で 1 が返されます。
+ */
+void doc_cache_set_missing(const char* path)
+{
+    struct doc_missing_t* m;
+    struct doc_missing_t* slot;
+    unsigned int hash;
+    time_t now;
+
+    if (doc_missing_tbl == NULL || strlen(path) >= sizeof(m->path))
+        return;
+
+    hash = missing_hash(path);
+    m = &doc_missing_tbl[hash & doc_missing_mask & ~1U];
+    now = clock_time();
+    CS_START(&doc_missing_lock);
+    /* 同じパス、期限切れ、期限の早い方の順で使用します。*/
+    if (m[0].hash == hash && strcmp(m[0].path, path) == 0)
+        slot = &m[0];
+    else if (m[1].hash == hash && strcmp(m[1].path, path) == 0)
+        slot = &m[1];
+    else if (m[0].expire <= now)
+        slot = &m[0];
+    else if (m[1].expire <= now)
+        slot = &m[1];
+    else
+        slot = (m[0].expire <= m[1].expire)? &m[0] : &m[1];
+    slot->hash = hash;
+    slot->expire = now + doc_missing_ttl;
+    strcpy(slot->path, path);
+    CS_END(&doc_missing_lock);
+}
+
+/* パスが一致する(dir_flag は前方一致する)存在しないパスを削除します。*/
+static void invalidate_missing(const char* path, int dir_flag)
+{
+    unsigned int i;
+    int len;
+
+    if (doc_missing_tbl == NULL)
+        return;
+
+    len = strlen(path);
+    CS_START(&doc_missing_lock);
+    if (dir_flag) {
+        for (i = 0; i <= doc_missing_mask; i++) {
+            struct doc_missing_t* m = &doc_missing_tbl[i];
+
+            if (m->hash != 0 && strncmp(m->path, path, len) == 0 &&
+                (m->path[len] == '\0' || m->path[len] == '/'))
+                m->hash = 0;
+        }
+    } else {
+        struct doc_missing_t* m;
+        unsigned int hash;
+
+        hash = missing_hash(path);
+        m = &doc_missing_tbl[hash & doc_missing_mask & ~1U];
+        for (i = 0; i < 2; i++) {
+            if (m[i].hash == hash && strcmp(m[i].path, path) == 0)
+                m[i].hash = 0;
+        }
+    }
+    CS_END(&doc_missing_lock);
+}
+
+/* パスが一致するエントリーをコーディングに関係なく削除します。*/
+static void invalidate_path(const char* path, unsigned int hash)
+{
+    struct doc_entry_t* e;
+
+    e = doc_bucket[hash & doc_bucket_mask];
+    while (e != NULL) {
+        struct doc_entry_t* next;
+
+        next = e->next;
+        if (e->hash == hash && strcmp(e->path, path) == 0)
+            entry_remove(e);
+        e = next;
+    }
+}
+
+/*
+ * ファイルキャッシュからパスのボディを削除します。
+ * 更新日時とサイズが同じまま書き換えられた場合に古いボディを使用しないようにします。
+ * 圧縮前のボディ、圧縮したボディ("gzip:"+パス)、圧縮済みファイル(パス+".gz")が対象です。
+ */
+static void invalidate_body(const char* path)
+{
+    char key[MAX_PATH+8];
+
+    if (g_file_cache == NULL)
+        return;
+    bc_remove(g_file_cache, path);
+    snprintf(key, sizeof(key), "gzip:%s", path);
+    bc_remove(g_file_cache, key);
+    snprintf(key, sizeof(key), "%s.gz", path);
+    bc_remove(g_file_cache, key);
+}
+
+/*
+ * 指定されたパスのエントリーを削除します。
+ * パスが ".gz" で終わる場合は圧縮前のパスのエントリーも削除します。
+ * (圧縮済みファイルを gzip のボディとして使用しているためです)
+ * 存在しないパスとしてキャッシュされている場合とファイルキャッシュのボディも削除します。
+ */
+void doc_cache_invalidate(const char* path)
+{
+    char base[MAX_PATH];
+    int len;
+
+    if (doc_bucket == NULL)
+        return;
+    CS_START(&doc_cache_lock);
+    ATOMIC_ADD(&doc_generation, 1);
+    invalidate_path(path, doc_hash(path));
+    len = strlen(path);
+    if (len > 3 && len - 3 < (int)sizeof(base) && strcmp(path + len - 3, ".gz") == 0) {
+        memcpy(base, path, len - 3);
+        base[len - 3] = '\0';
+        invalidate_path(base, doc_hash(base));
+    }
+    CS_END(&doc_cache_lock);
+    invalidate_missing(path, 0);
+    invalidate_body(path);
+}
+
+/*
+ * 指定されたディレクトリ以下のエントリーとファイルキャッシュのボディをすべて削除します。
+ */
+void doc_cache_invalidate_dir(const char* dir)
+{
+    struct doc_entry_t* e;
+    int len;
+
+    if (doc_bucket == NULL)
+        return;
+    len = strlen(dir);
+    CS_START(&doc_cache_lock);
+    ATOMIC_ADD(&doc_generation, 1);
+    e = doc_lru_head;
+    while (e != NULL) {
+        struct doc_entry_t* next;
+
+        next = e->lru_next;
+        if (strncmp(e->path, dir, len) == 0 && e->path[len] == '/')
+            entry_remove(e);
+        e = next;
+    }
+    CS_END(&doc_cache_lock);
+    invalidate_missing(dir, 1);
+    if (g_file_cache != NULL)
+        bc_remove_dir(g_file_cache, dir);
+}
@@ -0,0 +1,306 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2010 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "http_server.h"
+
+/*
+ * ドキュメントルートの変更を監視してドキュメントキャッシュを無効にします。
+ *
+ * Linux の inotify でドキュメントルート以下のディレクトリをすべて監視します。
+ * ファイルが更新・削除された場合はキャッシュのエントリーを削除します。
+ * 監視している間はキャッシュのエントリーを stat() で再確認しません。
+ *
+ * シンボリックリンク先の変更は検知できません。
+ */
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <dirent.h>
+
+#define WATCH_EVENT_BUF_SIZE 16384
+
+#define WATCH_DIR_MASK  (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO| \
+                         IN_CLOSE_WRITE|IN_MODIFY|IN_ATTRIB|IN_DELETE_SELF)
+
+static int watch_fd = -1;
+static char** watch_dir_tbl;                /* watch descriptor -> directory path */
+static int watch_dir_count;
+static char watch_root[MAX_PATH+1];
+static volatile int watch_shutdown_flag = 0;
+static int watch_wake_fd = -1;              /* eventfd to stop watch thread */
+static pthread_t watch_thread_id;
+static int watch_thread_flag = 0;           /* watch thread is running */
+
+static int watch_set_dir(int wd, const char* path)
+{
+    char* p;
+
+    if (wd >= watch_dir_count) {
+        char** tp;
+        int n;
+
+        n = (watch_dir_count > 0)? watch_dir_count : 64;
+        while (n <= wd)
+            n *= 2;
+        tp = (char**)realloc(watch_dir_tbl, sizeof(char*) * n);
+        if (tp == NULL) {
+            err_write("doc_watch: no memory.");
+            return -1;
+        }
+        memset(tp + watch_dir_count, 0, sizeof(char*) * (n - watch_dir_count));
+        watch_dir_tbl = tp;
+        watch_dir_count = n;
+    }
+    p = strdup(path);
+    if (p == NULL) {
+        err_write("doc_watch: no memory.");
+        return -1;
+    }
+    if (watch_dir_tbl[wd] != NULL)
+        free(watch_dir_tbl[wd]);
+    watch_dir_tbl[wd] = p;
+    return 0;
+}
+
+static void watch_remove_dir(int wd)
+{
+    if (wd >= 0 && wd < watch_dir_count && watch_dir_tbl[wd] != NULL) {
+        free(watch_dir_tbl[wd]);
+        watch_dir_tbl[wd] = NULL;
+    }
+}
+
+static void watch_cleanup()
+{
+    int i;
+
+    if (watch_fd >= 0) {
+        close(watch_fd);
+        watch_fd = -1;
+    }
+    for (i = 0; i < watch_dir_count; i++) {
+        if (watch_dir_tbl[i] != NULL)
+            free(watch_dir_tbl[i]);
+    }
+    if (watch_dir_tbl != NULL) {
+        free(watch_dir_tbl);
+        watch_dir_tbl = NULL;
+    }
+    watch_dir_count = 0;
+}
+
+/* ディレクトリとサブディレクトリを監視対象に追加します。*/
+static int watch_add_tree(const char* path)
+{
+    int wd;
+    DIR* dir;
+    struct dirent* ent;
+
+    wd = inotify_add_watch(watch_fd, path, WATCH_DIR_MASK|IN_ONLYDIR);
+    if (wd < 0) {
+        err_write("doc_watch: inotify_add_watch error(%s): %s", path, strerror(errno));
+        return -1;
+    }
+    if (watch_set_dir(wd, path) < 0)
+        return -1;
+
+    if ((dir = opendir(path)) == NULL)
+        return 0;
+    while ((ent = readdir(dir)) != NULL) {
+        char sub_path[MAX_PATH+1];
+        struct stat st;
+
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        snprintf(sub_path, sizeof(sub_path), "%s/%s", path, ent->d_name);
+        /* シンボリックリンクはたどりません。*/
+        if (lstat(sub_path, &st) < 0 || ! S_ISDIR(st.st_mode))
+            continue;
+        if (watch_add_tree(sub_path) < 0) {
+            closedir(dir);
+            return -1;
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+static void watch_event(struct inotify_event* ev)
+{
+    char path[MAX_PATH+1];
+    const char* dir_path;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+        /* イベントを取りこぼしたためすべて無効にします。*/
+        doc_cache_invalidate_dir(watch_root);
+        return;
+    }
+    if (ev->mask & IN_IGNORED) {
+        watch_remove_dir(ev->wd);
+        return;
+    }
+    if (ev->wd < 0 || ev->wd >= watch_dir_count || watch_dir_tbl[ev->wd] == NULL)
+        return;
+    dir_path = watch_dir_tbl[ev->wd];
+    if (ev->len == 0 || ev->name[0] == '\0') {
+        if (ev->mask & IN_DELETE_SELF)
+            doc_cache_invalidate_dir(dir_path);
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir_path, ev->name);
+
+    if (ev->mask & IN_ISDIR) {
+        /* ディレクトリの作成・移動・削除
+           (監視追加前にキャッシュされた分も破棄するため先に監視します) */
+        if (ev->mask & (IN_CREATE|IN_MOVED_TO))
+            watch_add_tree(path);
+        doc_cache_invalidate_dir(path);
+    } else {
+        doc_cache_invalidate(path);
+    }
+}
+
+static void* watch_thread(void* argv)
+{
+    char buf[WATCH_EVENT_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (! ATOMIC_LOAD(&watch_shutdown_flag)) {
+        struct pollfd pfd[2];
+        ssize_t len;
+        char* p;
+
+        /* doc_watch_finalize() は watch_wake_fd で起床させます。*/
+        pfd[0].fd = watch_fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = watch_wake_fd;
+        pfd[1].events = POLLIN;
+        if (poll(pfd, 2, -1) <= 0 || ! (pfd[0].revents & POLLIN))
+            continue;
+
+        len = read(watch_fd, buf, sizeof(buf));
+        if (len <= 0) {
+            if (len < 0 && errno != EINTR && errno != EAGAIN) {
+                err_write("doc_watch: read error: %s", strerror(errno));
+                break;
+            }
+            continue;
+        }
+        for (p = buf; p < buf + len; ) {
+            struct inotify_event* ev;
+
+            ev = (struct inotify_event*)p;
+            watch_event(ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+
+    /* 監視を終了したため stat() による再確認に戻します。*/
+    doc_cache_set_valid(g_conf->doc_cache_valid);
+    watch_cleanup();
+    return NULL;
+}
+
+/*
+ * ドキュメントルートの監視を開始します。
+ *
+ * root: ドキュメントルート
+ *
+ * 戻り値
+ *  正常に終了した場合はゼロを返します。
+ *  監視できない場合は -1 を返します。
+ */
+int doc_watch_initialize(const char* root)
+{
+    int len;
+
+    strncpy(watch_root, root, MAX_PATH);
+    len = strlen(watch_root);
+    while (len > 1 && watch_root[len-1] == '/')
+        watch_root[--len] = '\0';
+
+    watch_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (watch_fd < 0) {
+        err_write("doc_watch: inotify_init error: %s", strerror(errno));
+        return -1;
+    }
+    if (watch_add_tree(watch_root) < 0) {
+        watch_cleanup();
+        return -1;
+    }
+    watch_wake_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (watch_wake_fd < 0) {
+        err_write("doc_watch: eventfd error: %s", strerror(errno));
+        watch_cleanup();
+        return -1;
+    }
+
+    watch_shutdown_flag = 0;
+    if (pthread_create(&watch_thread_id, NULL, watch_thread, NULL) != 0) {
+        err_write("doc_watch: can't create thread: %s", strerror(errno));
+        watch_cleanup();
+        close(watch_wake_fd);
+        watch_wake_fd = -1;
+        return -1;
+    }
+    watch_thread_flag = 1;
+
+    /* 変更は監視スレッドが通知するため stat() で再確認しません。*/
+    doc_cache_set_valid(-1);
+    return 0;
+}
+
+/*
+ * ドキュメントルートの監視を終了します。
+ * 監視スレッドを起床させて終了するまで待機します。
+ * (終了後にドキュメントキャッシュとファイルキャッシュを解放できます)
+ */
+void doc_watch_finalize()
+{
+    uint64_t n = 1;
+
+    if (! watch_thread_flag)
+        return;
+    ATOMIC_STORE(&watch_shutdown_flag, 1);
+    if (write(watch_wake_fd, &n, sizeof(n)) < 0)
+        err_write("doc_watch: eventfd write error: %s", strerror(errno));
+    pthread_join(watch_thread_id, NULL);
+    watch_thread_flag = 0;
+    close(watch_wake_fd);
+    watch_wake_fd = -1;
+}
+#else
+int doc_watch_initialize(const char* root)
+{
+    return -1;  /* not supported */
+}
+
+void doc_watch_finalize()
+{
+}
+#endif
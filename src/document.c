@@ -28,79 +28,84 @@
 
 #include "http_server.h"
 #include <time.h>
+#include <limits.h>
 
-static char* header_template_200 = 
-    "HTTP/1.1 200 OK\r\n"
-    "Date: %s\r\n"
-    "Server: %s\r\n"
-    "Content-Type: %s\r\n"
-    "Content-Length: %d\r\n"
-    "Last-Modified: %s\r\n"
-    "Connection: close\r\n"
-    "\r\n";
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
 
-static char* header_keep_alive_200 = 
-    "HTTP/1.1 200 OK\r\n"
-    "Date: %s\r\n"
+/*
+ * レスポンスヘッダーは次の順に組み立てます。
+ * Date と Keep-Alive 以外はファイル毎にキャッシュしておきます。
+ *
+ *   ステータス行
+ *   Date: (クロックの文字列)
+ *   ヘッダーフィールド(doc_header_t.fields)
+ *   header_keep_alive または header_close
+ *
+ * gzip で圧縮したボディはコーディング別のヘッダーフィールドを
+ * ドキュメントキャッシュに保持します(DOC_ENCODING_GZIP)。
+ */
+static char* status_line_200 = "HTTP/1.1 200 OK\r\n";
+static char* status_line_304 = "HTTP/1.1 304 Not Modified\r\n";
+static char* status_line_206 = "HTTP/1.1 206 Partial Content\r\n";
+static char* status_line_416 = "HTTP/1.1 416 Requested Range Not Satisfiable\r\n";
+
+static char* header_fields_200 =
     "Server: %s\r\n"
     "Content-Type: %s\r\n"
-    "Content-Length: %d\r\n"
+    "Content-Length: %lld\r\n"
     "Last-Modified: %s\r\n"
+    "ETag: %s\r\n";
+
+static char* header_content_encoding = "Content-Encoding: gzip\r\n";
+static char* header_vary = "Vary: Accept-Encoding\r\n";
+static char* header_accept_ranges = "Accept-Ranges: bytes\r\n";
+
+/* multipart/byteranges の境界文字列(doc_initialize()で作成) */
+static char range_boundary[32];
+
+static char* month_names[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+/* Range ヘッダーのバイト範囲(first, last を含む) */
+struct byte_range_t {
+    int64 first;
+    int64 last;
+};
+
+static char* header_keep_alive =
     "Keep-Alive: timeout=%d, max=%d\r\n"
     "Connection: Keep-Alive\r\n"
     "\r\n";
 
-/* MIME type*/
-struct mime_type {
-    char *extension;
-    char *type;
-};
+static char* header_close =
+    "Connection: close\r\n"
+    "\r\n";
 
-static struct mime_type mime_table[] = {
-    { "html", "text/html" },
-    { "htm", "text/html" },
-    { "hdml", "text/x-hdml" },
-    { "css", "text/css" },
-    { "txt", "text/plain" },
-    { "gif", "image/gif" },
-    { "jpe", "image/jpeg" },
-    { "jpeg", "image/jpeg" },
-    { "jpg", "image/jpeg" },
-    { "png", "image/png" },
-    { "xbm", "image/x-bitmap" },
-    { "au", "audio/basic" },
-    { "snd", "audio/basic" },
-    { "wav", "audio/x-wav" },
-    { "aif", "audio/aiff" },
-    { "aiff", "audio/aiff" },
-    { "mp2", "audio/x-mpeg" },
-    { "mp3", "audio/mpeg" },
-    { "ram", "audio/x-pn-realaudio" },
-    { "rm", "audio/x-pn-realaudio" },
-    { "rm", "audio/x-pn-realaudio" },
-    { "ra", "audio/x-pn-realaudio" },
-    { "qt", "video/quicktime" },
-    { "mov", "video/quicktime" },
-    { "mpeg", "video/mpeg" },
-    { "mpg", "video/mpeg" },
-    { "mpe", "video/mpeg" },
-    { "avi", "video/x-msvideo" },
-    { "pdf", "application/vnd.pdf" },
-    { "fdf", "application/vnd.fdf" },
-    { "json", "text/plain" },
-    { NULL, NULL }
-}; 
-
-static char* get_mime_type(char* ext_name)
-{
-    int i;
+/* 組み立て済みのステータスレスポンス */
+struct status_response_t {
+    int status;
+    char* status_line;
+    char* body;
+    int body_size;
+    char fields[256];
+    int fields_size;
+};
 
-    for (i = 0; mime_table[i].extension != NULL; i++) {
-        if (! strcmp(mime_table[i].extension, ext_name))
-            return mime_table[i].type;
-    }
-    return NULL;
-}
+static struct status_response_t status_table[] = {
+    { HTTP_NOT_MODIFIED, "HTTP/1.1 304 Not Modified\r\n", NULL },
+    { HTTP_NOTFOUND, "HTTP/1.1 404 Not Found\r\n",
+      "<html><head><title>404 Not Found</title></head>"
+      "<body><h1>Not Found</h1></body></html>\n" },
+    { 0, NULL, NULL }
+};
 
 /*
  * リクエストされたファイル名をチェックします。
@@ -111,32 +116,1333 @@ static char* get_mime_type(char* ext_name)
  */
 int check_file(const char* request_file)
 {
-    int ret_code = 0;
+    const char* p;
     int base = 0;
-    char uri[MAX_URI_LENGTH];
-    char** list_ptr;
-    char** st;
 
     if (*request_file == '\0')
         return 1;   /* error */
-    strcpy(uri, request_file);
-    st = list_ptr = split(uri, '/');
-    while (*st != NULL) {
-        if (strcmp(*st, "..") == 0) {
+
+    /* split() で分割せずにセグメントを順に調べます。*/
+    p = request_file;
+    for (;;) {
+        const char* end;
+        int len;
+
+        end = strchr(p, '/');
+        len = (end != NULL)? (int)(end - p) : (int)strlen(p);
+        if (len == 2 && p[0] == '.' && p[1] == '.') {
             base--;
-            if (base < 0) {
-                ret_code = 1;
-                break;   /* error */
-            }
-        } else if (**st == '.') {
+            if (base < 0)
+                return 1;   /* error */
+        } else if (len == 0 || *p == '.') {
             /* ignore */
         } else {
             base++;
         }
-        st++;
+        if (end == NULL)
+            break;
+        p = end + 1;
+    }
+    return 0;
+}
+
+/*
+ * ドキュメントルートとファイル名からフルパスを作成します。
+ * "." と ".." と空のセグメントを取り除いた正規化したパスにします。
+ * ドキュメントキャッシュのキーと監視(doc_watch.c)のパスを一致させるためです。
+ * ファイル名は check_file() でチェックされている必要があります。
+ */
+static void doc_path(char* buf, int bufsize, const char* root, const char* file_name)
+{
+    const char* p;
+    int len;
+    int root_len;
+
+    len = snprintf(buf, bufsize, "%s", root);
+    if (len >= bufsize)
+        len = bufsize - 1;
+    while (len > 1 && buf[len-1] == '/')
+        len--;
+    root_len = len;
+
+    p = file_name;
+    for (;;) {
+        const char* end;
+        int seg_len;
+
+        end = strchr(p, '/');
+        seg_len = (end != NULL)? (int)(end - p) : (int)strlen(p);
+        if (seg_len == 0 || (seg_len == 1 && *p == '.')) {
+            /* ignore */
+        } else if (seg_len == 2 && p[0] == '.' && p[1] == '.') {
+            /* ひとつ上のセグメントに戻ります。*/
+            while (len > root_len && buf[len-1] != '/')
+                len--;
+            if (len > root_len)
+                len--;
+        } else if (len + 1 + seg_len < bufsize) {
+            buf[len++] = '/';
+            memcpy(buf + len, p, seg_len);
+            len += seg_len;
+        }
+        if (end == NULL)
+            break;
+        p = end + 1;
+    }
+    buf[len] = '\0';
+}
+
+/*
+ * ファイルの指定位置から読み込みます。
+ * キャッシュのディスクリプタは共有しているためファイル位置を変更しません。
+ *
+ * 戻り値
+ *  読み込んだバイト数を返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int read_file(int fd, char* buf, int size, int64 offset)
+{
+#ifdef _WIN32
+    if (_lseeki64(fd, offset, SEEK_SET) < 0)
+        return -1;
+    return FILE_READ(fd, buf, size);
+#else
+    return (int)pread(fd, buf, size, (off_t)offset);
+#endif
+}
+
+#ifdef __linux__
+/*
+ * sendfile() でファイルの指定位置から内容をソケットへ送信します。
+ * ユーザー空間へのコピーやメモリマップを行いません。
+ * 一部だけ送信された場合は残りを続けて送信します。
+ *
+ * 戻り値
+ *  送信したバイト数を返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int64 send_file(SOCKET socket, int fd, int64 start, int64 size)
+{
+    off_t offset = (off_t)start;
+    off_t end = (off_t)(start + size);
+
+    while (offset < end) {
+        size_t count;
+        ssize_t n;
+
+        /* 一回の sendfile() は DOC_STREAM_CHUNK までにします。*/
+        count = (end - offset > DOC_STREAM_CHUNK)? DOC_STREAM_CHUNK : (size_t)(end - offset);
+        n = sendfile(socket, fd, &offset, count);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;  /* ファイルが途中で切り詰められた */
+    }
+    return (int64)(offset - start);
+}
+#else
+/*
+ * ファイルの指定位置から読み込んでソケットへ送信します。
+ *
+ * 戻り値
+ *  送信したバイト数を返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int64 send_file(SOCKET socket, int fd, int64 start, int64 size)
+{
+    char send_buff[BUF_SIZE];
+    int64 total_size = 0;
+
+    while (total_size < size) {
+        int length;
+
+        if (size - total_size > (int64)sizeof(send_buff))
+            length = sizeof(send_buff);
+        else
+            length = (int)(size - total_size);
+        length = read_file(fd, send_buff, length, start + total_size);
+        if (length <= 0)
+            break;
+        if (send_data(socket, send_buff, length) < 0)
+            return -1;
+        total_size += length;
+    }
+    return total_size;
+}
+#endif
+
+/*
+ * 大きなファイルのボディを一定のメモリで送信します。
+ * ファイルキャッシュとメモリマップを使用せずに DOC_STREAM_CHUNK ごとに送信し、
+ * 順次読み込みを通知して送信済みの範囲はページキャッシュから解放させます。
+ *
+ * 戻り値
+ *  送信したバイト数を返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int64 send_file_stream(SOCKET socket, int fd, int64 size)
+{
+    int64 total_size = 0;
+#ifdef POSIX_FADV_DONTNEED
+    int64 released = 0;
+#endif
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, (off_t)size, POSIX_FADV_SEQUENTIAL);
+#endif
+    while (total_size < size) {
+        int64 length;
+        int64 n;
+
+        length = (size - total_size > DOC_STREAM_CHUNK)? DOC_STREAM_CHUNK : size - total_size;
+        n = send_file(socket, fd, total_size, length);
+        if (n < 0)
+            return (total_size > 0)? total_size : -1;
+        total_size += n;
+        if (n != length)
+            break;  /* ファイルが途中で切り詰められた */
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(fd, (off_t)released, (off_t)(total_size - released), POSIX_FADV_DONTNEED);
+        released = total_size;
+#endif
+    }
+    return total_size;
+}
+
+/*
+ * ステータス行、Date、ヘッダーフィールド、Connection を連結して
+ * レスポンスヘッダーを組み立てます。
+ *
+ * 戻り値
+ *  ヘッダーの長さを返します。
+ */
+static int compose_header(char* buf,
+                          int bufsize,
+                          const char* status_line,
+                          const char* fields,
+                          int fields_size,
+                          int keep_alive_timeout,
+                          int keep_alive_requests)
+{
+    char* p;
+    int len;
+
+    p = buf;
+    len = strlen(status_line);
+    memcpy(p, status_line, len);
+    p += len;
+
+    memcpy(p, "Date: ", 6);
+    p += 6;
+    p += clock_date(p);
+    *p++ = '\r';
+    *p++ = '\n';
+
+    memcpy(p, fields, fields_size);
+    p += fields_size;
+
+    if (keep_alive_requests > 0) {
+        p += snprintf(p, bufsize - (p - buf), header_keep_alive,
+                      keep_alive_timeout, keep_alive_requests);
+    } else {
+        len = strlen(header_close);
+        memcpy(p, header_close, len);
+        p += len;
+    }
+    return (int)(p - buf);
+}
+
+/*
+ * 組み立て済みのステータスレスポンスを作成します。
+ */
+int doc_initialize()
+{
+    struct status_response_t* sr;
+
+    for (sr = status_table; sr->status != 0; sr++) {
+        if (sr->body != NULL) {
+            sr->body_size = strlen(sr->body);
+            snprintf(sr->fields, sizeof(sr->fields),
+                     "Server: %s\r\n"
+                     "Content-Type: text/html\r\n"
+                     "Content-Length: %d\r\n",
+                     SERVER_NAME, sr->body_size);
+        } else {
+            sr->body_size = 0;
+            snprintf(sr->fields, sizeof(sr->fields), "Server: %s\r\n", SERVER_NAME);
+        }
+        sr->fields_size = strlen(sr->fields);
     }
-    list_free(list_ptr);
-    return ret_code;
+    snprintf(range_boundary, sizeof(range_boundary), "%08x%08x",
+             (unsigned int)time(NULL), (unsigned int)getpid());
+    return doc_cache_initialize(g_conf->doc_cache_entries, g_conf->doc_cache_valid,
+                                g_conf->doc_missing_entries);
+}
+
+void doc_finalize()
+{
+    doc_cache_finalize();
+}
+
+/*
+ * 組み立て済みのステータスレスポンス(304, 404)を送信します。
+ * それ以外のステータスは error_handler() で送信します。
+ *
+ * 戻り値
+ *  ステータスを返します。
+ */
+int doc_status_send(SOCKET socket,
+                    int status,
+                    int keep_alive_timeout,
+                    int keep_alive_requests,
+                    int* content_size)
+{
+    struct status_response_t* sr;
+    char header_buff[DOC_HEADER_SIZE];
+    int header_size;
+
+    for (sr = status_table; sr->status != 0; sr++) {
+        if (sr->status == status)
+            break;
+    }
+    if (sr->status == 0)
+        return error_handler(socket, status, content_size);
+
+    header_size = compose_header(header_buff, sizeof(header_buff),
+                                 sr->status_line, sr->fields, sr->fields_size,
+                                 keep_alive_timeout, keep_alive_requests);
+    if (sr->body != NULL) {
+        *content_size = out_send_header_body(socket, header_buff, header_size,
+                                             sr->body, sr->body_size);
+    } else {
+        send_data(socket, header_buff, header_size);
+        *content_size = 0;
+    }
+    return status;
+}
+
+/*
+ * 圧縮の効果があるテキスト系の MIME/type か調べます。
+ */
+static int is_compressible(const char* type)
+{
+    if (strncmp(type, "text/", 5) == 0)
+        return 1;
+    if (strstr(type, "javascript") || strstr(type, "json") || strstr(type, "xml"))
+        return 1;
+    return 0;
+}
+
+/*
+ * i-node、ファイル更新日時、サイズから強い ETag を作成します。
+ * suffix はコンテンツコーディングで ETag を区別するために付加します。
+ */
+static void make_etag(char* buf, int bufsize, struct stat* file_stat, const char* suffix)
+{
+    snprintf(buf, bufsize, "\"%llx-%llx-%llx%s\"",
+             (unsigned long long)file_stat->st_ino,
+             (unsigned long long)file_stat->st_mtime,
+             (unsigned long long)file_stat->st_size,
+             suffix);
+}
+
+/*
+ * ファイル情報からヘッダーフィールドを組み立てます。
+ *
+ * fpath: ファイルのフルパス(MIME/type の決定に使用します)
+ * mtime: ファイル更新日時
+ * size: ファイルサイズ
+ * etag: ETag(make_etag() で作成したもの)
+ * encoding: コンテンツコーディング(DOC_ENCODING_XXX)
+ * content_length: ボディのサイズ(gzip の場合は圧縮後のサイズ)
+ * type: MIME/type(NULL の場合は拡張子から決定します)
+ * dh: ヘッダーフィールドを設定する領域
+ */
+static void build_doc_header(const char* fpath,
+                             time_t mtime,
+                             int64 size,
+                             const char* etag,
+                             int encoding,
+                             int64 content_length,
+                             const char* type,
+                             struct doc_header_t* dh)
+{
+    struct tm modify_gmt;
+    int index;
+    char ext_name[MAX_PATH];
+    char default_mime_type[256];
+    int len;
+
+    dh->mtime = mtime;
+    dh->size = size;
+    dh->content_length = content_length;
+    dh->encoding = encoding;
+    dh->precompressed = 0;
+    dh->last_modified = mtime;
+    snprintf(dh->etag, sizeof(dh->etag), "%s", etag);
+
+    /* ファイル更新日時をヘッダー文字列(GMT)に変換します。*/
+    mt_gmtime(&mtime, &modify_gmt);
+    gmtstr(dh->modify_date, sizeof(dh->modify_date), &modify_gmt);
+
+    /* ファイルの拡張子からMIME/typeを決定
+       結果はヘッダーフィールドと一緒にキャッシュされます。*/
+    if (type == NULL) {
+        ext_name[0] = '\0';
+        index = lastindexof(fpath, '.');
+        if (index > 0) {
+            substr(ext_name, fpath, index+1, -1);
+            type = mime_type(ext_name);
+        }
+        if (type == NULL) {
+            snprintf(default_mime_type, sizeof(default_mime_type), "application/%s", ext_name);
+            type = default_mime_type;
+        }
+    }
+    dh->compressible = is_compressible(type);
+
+    snprintf(dh->fields, sizeof(dh->fields), header_fields_200,
+             SERVER_NAME, type, content_length, dh->modify_date, dh->etag);
+    len = strlen(dh->fields);
+
+    /* 部分レスポンス(206)で置き換える行の位置を保持しておきます。*/
+    dh->type_offset = indexofstr(dh->fields, "\r\nContent-Type: ") + 2;
+    dh->length_offset = indexofstr(dh->fields, "\r\nContent-Length: ") + 2;
+    dh->length_end = dh->length_offset + indexofstr(dh->fields + dh->length_offset, "\r\n") + 2;
+
+    if (encoding == DOC_ENCODING_IDENTITY) {
+        snprintf(dh->fields + len, sizeof(dh->fields) - len, "%s", header_accept_ranges);
+        len += strlen(dh->fields + len);
+    }
+#ifdef HAVE_LIBZ
+    if (encoding == DOC_ENCODING_GZIP) {
+        snprintf(dh->fields + len, sizeof(dh->fields) - len, "%s", header_content_encoding);
+        len += strlen(dh->fields + len);
+    }
+    /* 圧縮の有無がリクエストで変わるものはキャッシュに通知します。*/
+    if (dh->compressible && g_conf->gzip_flag) {
+        snprintf(dh->fields + len, sizeof(dh->fields) - len, "%s", header_vary);
+        len += strlen(dh->fields + len);
+    }
+#endif
+    dh->fields_size = len;
+}
+
+/*
+ * ヘッダーを送信します。
+ * ボディが続く場合はボディと同じTCPセグメントにまとめられるように送信します。
+ */
+static int send_header(SOCKET socket, const char* header, int header_size, int64 body_size)
+{
+    if (body_size > 0)
+        return out_send_more(socket, header, header_size);
+    return send_data(socket, header, header_size);
+}
+
+/*
+ * 存在しないファイルのエラーログを１秒あたり DOC_MISSING_LOG_RATE 件に制限します。
+ * スキャナーなどによる連続した 404 でエラーログのロックが競合しないようにします。
+ * 出力しなかった件数は次の秒の最初に出力します。
+ *
+ * 戻り値
+ *  エラーログを出力する場合は 1 を返します。
+ */
+static volatile time_t missing_log_time;
+static volatile int missing_log_count;
+static volatile int missing_log_suppressed;
+
+static int missing_log_permit()
+{
+    time_t now;
+    time_t last;
+
+    now = clock_time();
+    last = (time_t)ATOMIC_LOAD_RELAXED(&missing_log_time);
+    if (now != last &&
+        ATOMIC_CAS(&missing_log_time, &last, now)) {
+        int suppressed;
+
+        ATOMIC_STORE(&missing_log_count, 0);
+        suppressed = (int)ATOMIC_EXCHANGE(&missing_log_suppressed, 0);
+        if (suppressed > 0)
+            err_write("%d not found errors suppressed.", suppressed);
+    }
+    if (ATOMIC_ADD(&missing_log_count, 1) <= DOC_MISSING_LOG_RATE)
+        return 1;
+    ATOMIC_ADD(&missing_log_suppressed, 1);
+    return 0;
+}
+
+/*
+ * ドキュメントを取得します。
+ * キャッシュにない場合や stat() の再確認が必要な場合は
+ * ファイル情報を取得してキャッシュに設定します。
+ *
+ * 戻り値
+ *  正常に終了した場合はゼロを返します。
+ *  ファイルが存在しない場合は -1 を返します。
+ */
+static int doc_open(const char* fpath, const char* file_name, struct in_addr addr, struct doc_file_t* df)
+{
+    struct stat file_stat;
+    struct doc_header_t dh;
+    char etag[64];
+    int fd;
+
+    /* 変更の通知による無効化を検出するために stat() の前の世代を取得します。*/
+    df->generation = doc_cache_generation();
+
+    /* stat() の再確認が不要なものはシステムコールを発行しません。*/
+    if (doc_cache_get(fpath, DOC_ENCODING_IDENTITY, df) == 0)
+        return 0;
+
+    /* 最近存在しなかったパスは stat() を発行しません。*/
+    if (doc_cache_is_missing(fpath)) {
+        if (missing_log_permit())
+            err_log(addr, "file not found (%s)", file_name);
+        return -1;
+    }
+
+    /* ファイル情報の取得 */
+    if (stat(fpath, &file_stat) < 0) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            doc_cache_set_missing(fpath);
+            if (missing_log_permit())
+                err_log(addr, "fstat error (%s): %s", file_name, strerror(errno));
+        } else {
+            err_log(addr, "fstat error (%s): %s", file_name, strerror(errno));
+        }
+        return -1;
+    }
+
+    /* ディレクトリか調べます。*/
+    if (S_ISDIR(file_stat.st_mode)) {
+        doc_cache_set_missing(fpath);
+        return -1;
+    }
+
+    /* ファイルが更新されていない場合はキャッシュを使用します。*/
+    if (doc_cache_revalidate(fpath, DOC_ENCODING_IDENTITY, file_stat.st_mtime,
+                             (int64)file_stat.st_size, df->generation, df) == 0)
+        return 0;
+
+    /* ファイルをオープンします。*/
+    if ((fd = FILE_OPEN(fpath, O_RDONLY|O_BINARY, S_IREAD)) < 0) {
+        err_log(addr, "request file can't open (%s): %s", file_name, strerror(errno));
+        return -1;
+    }
+
+    /* ヘッダーフィールドと ETag を組み立ててキャッシュに設定します。*/
+    make_etag(etag, sizeof(etag), &file_stat, "");
+    build_doc_header(fpath, file_stat.st_mtime, (int64)file_stat.st_size, etag,
+                     DOC_ENCODING_IDENTITY, (int64)file_stat.st_size, NULL, &dh);
+    if (doc_cache_set(fpath, DOC_ENCODING_IDENTITY, &dh, fd, df->generation, df) < 0) {
+        /* キャッシュに設定できない場合はこのリクエストだけで使用します。*/
+        df->entry = NULL;
+        df->fd = fd;
+        df->fd_owner = 1;
+        memcpy(&df->header, &dh, sizeof(struct doc_header_t));
+    }
+    return 0;
+}
+
+static void doc_close(struct doc_file_t* df)
+{
+    if (df->fd_owner && df->fd >= 0)
+        FILE_CLOSE(df->fd);
+    doc_cache_release(df);
+}
+
+#ifdef HAVE_LIBZ
+/*
+ * Accept-Encoding ヘッダーに gzip が含まれているか調べます。
+ * q=0 が指定されている場合は含まれていないものとします。
+ *
+ * 戻り値
+ *  gzip を受け付ける場合は 1 を返します。
+ */
+static int accept_gzip(struct http_header_t* hdr)
+{
+    const char* p;
+
+    p = get_http_header(hdr, "Accept-Encoding");
+    if (p == NULL)
+        return 0;
+
+    while (*p) {
+        char coding[16];
+        double q = 1.0;
+        int len = 0;
+
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+            if (len < (int)sizeof(coding) - 1)
+                coding[len++] = *p;
+            p++;
+        }
+        coding[len] = '\0';
+
+        /* パラメータ(q値)を調べます。*/
+        while (*p && *p != ',') {
+            if (*p == ';') {
+                p++;
+                while (*p == ' ' || *p == '\t')
+                    p++;
+                if ((*p == 'q' || *p == 'Q') && p[1] == '=')
+                    q = atof(p + 2);
+            } else {
+                p++;
+            }
+        }
+        if (stricmp(coding, "gzip") == 0 || stricmp(coding, "x-gzip") == 0)
+            return (q > 0.0);
+    }
+    return 0;
+}
+
+/*
+ * メモリ上のデータを gzip 形式で圧縮します。
+ * 圧縮したデータの領域は呼び出し側で free() します。
+ *
+ * 戻り値
+ *  圧縮したデータのポインタを返します。
+ *  エラーの場合は NULL を返します。
+ */
+static char* gzip_compress(const char* data, int size, int* out_size)
+{
+    z_stream zs;
+    char* buf;
+    uLong bound;
+
+    memset(&zs, 0, sizeof(zs));
+    /* windowBits に 16 を加えると gzip ヘッダーとトレーラーを付加します。*/
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+    bound = deflateBound(&zs, (uLong)size);
+    buf = (char*)malloc(bound);
+    if (buf == NULL) {
+        err_write("gzip_compress: no memory.");
+        deflateEnd(&zs);
+        return NULL;
+    }
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = (uInt)size;
+    zs.next_out = (Bytef*)buf;
+    zs.avail_out = (uInt)bound;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&zs);
+        free(buf);
+        return NULL;
+    }
+    *out_size = (int)zs.total_out;
+    deflateEnd(&zs);
+    return buf;
+}
+
+/*
+ * ファイルの内容を読み込んで gzip 形式で圧縮します。
+ * fd が -1 の場合はファイルをオープンします。
+ *
+ * 戻り値
+ *  圧縮したデータのポインタを返します。
+ *  エラーの場合は NULL を返します。
+ */
+static char* gzip_file(const char* fpath, int fd, int size, int* out_size)
+{
+    char* data;
+    char* gz = NULL;
+    int open_fd = -1;
+
+    if (fd < 0) {
+        if ((open_fd = FILE_OPEN(fpath, O_RDONLY|O_BINARY, S_IREAD)) < 0)
+            return NULL;
+        fd = open_fd;
+    }
+    data = (char*)malloc(size);
+    if (data != NULL) {
+        if (read_file(fd, data, size, 0) == size)
+            gz = gzip_compress(data, size, out_size);
+        free(data);
+    } else {
+        err_write("gzip_file: no memory.");
+    }
+    if (open_fd >= 0)
+        FILE_CLOSE(open_fd);
+    return gz;
+}
+
+/*
+ * gzip のドキュメントを作成してキャッシュに設定します。
+ *
+ * 同じディレクトリに "ファイル名.gz" があり、元のファイルより新しい場合は
+ * そのファイルをボディにします(圧縮済みファイル)。
+ * ない場合は初回のリクエストで圧縮してファイルキャッシュに
+ * "gzip:フルパス" のキーで設定します。
+ * 圧縮しないファイルは圧縮前のヘッダーを設定しておき、次回からは
+ * stat() を発行せずに圧縮しないことが判定できるようにします。
+ *
+ * 戻り値
+ *  正常に終了した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int doc_load_gzip(const char* fpath,
+                         const char* file_name,
+                         struct in_addr addr,
+                         struct doc_file_t* idf,
+                         struct doc_file_t* df)
+{
+    char gz_path[MAX_PATH+8];
+    struct stat gz_stat;
+    struct doc_header_t dh;
+    char etag[64];
+    int64 size;
+    int fd = -1;
+
+    size = idf->header.size;
+    snprintf(gz_path, sizeof(gz_path), "%s.gz", fpath);
+    if (stat(gz_path, &gz_stat) == 0 && S_ISREG(gz_stat.st_mode) &&
+        gz_stat.st_mtime >= idf->header.mtime) {
+        /* 圧縮済みファイルは stat() の結果で再確認します。*/
+        if (doc_cache_revalidate(fpath, DOC_ENCODING_GZIP, gz_stat.st_mtime,
+                                 (int64)gz_stat.st_size, idf->generation, df) == 0)
+            return 0;
+        if ((fd = FILE_OPEN(gz_path, O_RDONLY|O_BINARY, S_IREAD)) < 0) {
+            err_log(addr, "request file can't open (%s.gz): %s", file_name, strerror(errno));
+            return -1;
+        }
+        /* Content-Type と Last-Modified は元のファイルのものです。*/
+        make_etag(etag, sizeof(etag), &gz_stat, "-gz");
+        build_doc_header(fpath, idf->header.mtime, size, etag,
+                         DOC_ENCODING_GZIP, (int64)gz_stat.st_size, NULL, &dh);
+        dh.mtime = gz_stat.st_mtime;
+        dh.size = (int64)gz_stat.st_size;
+        dh.precompressed = 1;
+    } else {
+        /* 圧縮したボディは元のファイルの更新日時とサイズで再確認します。*/
+        if (doc_cache_revalidate(fpath, DOC_ENCODING_GZIP,
+                                 idf->header.mtime, size, idf->generation, df) == 0)
+            return 0;
+        memcpy(&dh, &idf->header, sizeof(struct doc_header_t));
+
+        if (size >= GZIP_MIN_SIZE && bc_cacheable(g_file_cache, size)) {
+            char* data;
+            int data_size;
+
+            data = gzip_file(fpath, idf->fd, (int)size, &data_size);
+            if (data != NULL) {
+                /* 圧縮しても小さくならないものは圧縮しません。*/
+                if (data_size < size) {
+                    char gz_key[MAX_PATH+8];
+
+                    snprintf(gz_key, sizeof(gz_key), "gzip:%s", fpath);
+                    bc_set(g_file_cache, gz_key, idf->header.mtime, data_size, data);
+                    /* 圧縮前の ETag に "-gz" を付加します。*/
+                    snprintf(etag, sizeof(etag), "%.*s-gz\"",
+                             (int)strlen(idf->header.etag) - 1, idf->header.etag);
+                    build_doc_header(fpath, idf->header.mtime, size, etag,
+                                     DOC_ENCODING_GZIP, (int64)data_size, NULL, &dh);
+                }
+                free(data);
+            }
+        }
+    }
+
+    if (doc_cache_set(fpath, DOC_ENCODING_GZIP, &dh, fd, idf->generation, df) < 0) {
+        /* キャッシュに設定できない場合はこのリクエストだけで使用します。*/
+        df->entry = NULL;
+        df->fd = fd;
+        df->fd_owner = 1;
+        memcpy(&df->header, &dh, sizeof(struct doc_header_t));
+    }
+    return 0;
+}
+
+/*
+ * gzip で圧縮したドキュメントを取得します。
+ * idf は doc_open() で取得した圧縮前のドキュメントです。
+ *
+ * 戻り値
+ *  gzip のドキュメントを取得した場合はゼロを返します。
+ *  圧縮しないドキュメントの場合は -1 を返します。
+ */
+static int doc_open_gzip(const char* fpath,
+                         const char* file_name,
+                         struct in_addr addr,
+                         struct doc_file_t* idf,
+                         struct doc_file_t* df)
+{
+    df->generation = idf->generation;
+    if (doc_cache_get(fpath, DOC_ENCODING_GZIP, df) < 0) {
+        if (doc_load_gzip(fpath, file_name, addr, idf, df) < 0)
+            return -1;
+    }
+    if (df->header.encoding != DOC_ENCODING_GZIP) {
+        doc_close(df);
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Range ヘッダー(bytes=first-last, first-, -suffix をカンマで区切ったもの)を
+ * 解析してファイルサイズの範囲に収めます。
+ *
+ * value: Range ヘッダーの値
+ * size: ファイルサイズ
+ * ranges: バイト範囲を設定する配列
+ * max_ranges: 配列の要素数
+ *
+ * 戻り値
+ *  満たすことができるバイト範囲の数を返します。
+ *  満たすことができるバイト範囲がない場合はゼロを返します(416)。
+ *  書式が正しくないか範囲の数が多すぎる場合は -1 を返します(Range を無視します)。
+ */
+static int parse_range(const char* value,
+                       int64 size,
+                       struct byte_range_t* ranges,
+                       int max_ranges)
+{
+    const char* p;
+    int count = 0;
+
+    p = value;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (strncmp(p, "bytes=", 6) != 0)
+        return -1;
+    p += 6;
+
+    for (;;) {
+        int64 first = -1;
+        int64 last = -1;
+        int digits;
+
+        while (*p == ' ' || *p == '\t')
+            p++;
+        for (digits = 0; *p >= '0' && *p <= '9'; digits++, p++) {
+            if (digits >= 18)
+                return -1;
+            first = ((first < 0)? 0 : first * 10) + (*p - '0');
+        }
+        if (*p++ != '-')
+            return -1;
+        for (digits = 0; *p >= '0' && *p <= '9'; digits++, p++) {
+            if (digits >= 18)
+                return -1;
+            last = ((last < 0)? 0 : last * 10) + (*p - '0');
+        }
+        while (*p == ' ' || *p == '\t')
+            p++;
+
+        if (first < 0) {
+            /* 末尾からのバイト数(-suffix) */
+            if (last < 0)
+                return -1;
+            if (last > 0 && size > 0) {
+                first = (last < size)? size - last : 0;
+                last = size - 1;
+            }
+        } else {
+            if (last >= 0 && last < first)
+                return -1;
+            if (last < 0 || last >= size)
+                last = size - 1;
+        }
+        if (first >= 0 && first < size) {
+            if (count >= max_ranges)
+                return -1;
+            ranges[count].first = first;
+            ranges[count].last = last;
+            count++;
+        }
+
+        if (*p == ',') {
+            p++;
+            continue;
+        }
+        if (*p != '\0')
+            return -1;
+        break;
+    }
+    return count;
+}
+
+/*
+ * ボディの指定範囲を送信します。
+ * ファイルキャッシュにある場合はその一部を送信します。
+ *
+ * 戻り値
+ *  送信したバイト数を返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int64 send_body_range(SOCKET socket, const char* cache_data, int fd, int64 offset, int64 length)
+{
+    /* ファイルキャッシュのボディは INT_MAX 以下です。*/
+    if (cache_data != NULL)
+        return send_data(socket, cache_data + offset, (int)length);
+    return send_file(socket, fd, offset, length);
+}
+
+/*
+ * バイト範囲のボディを部分レスポンス(206)で送信します。
+ * 範囲が１つの場合は Content-Range ヘッダーを付けて送信します。
+ * 複数の場合は multipart/byteranges で送信します。
+ *
+ * ファイルキャッシュにあればその一部を送信しますが、
+ * ファイル全体をファイルキャッシュに設定することはしません。
+ *
+ * 戻り値
+ *  送信したボディのバイト数を返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int64 doc_send_range(SOCKET socket,
+                            struct doc_file_t* df,
+                            const char* cache_data,
+                            struct byte_range_t* ranges,
+                            int range_count,
+                            int keep_alive_timeout,
+                            int keep_alive_requests)
+{
+    struct doc_header_t* dh;
+    char fields[sizeof(dh->fields) + 128];
+    char header_buff[DOC_HEADER_SIZE];
+    int header_size;
+    int fields_size;
+    int64 total_size = 0;
+    int i;
+
+    dh = &df->header;
+    if (range_count == 1) {
+        int64 length;
+
+        /* Content-Length 行を置き換えて Content-Range を追加します。*/
+        length = ranges[0].last - ranges[0].first + 1;
+        memcpy(fields, dh->fields, dh->length_offset);
+        fields_size = dh->length_offset;
+        fields_size += snprintf(fields + fields_size, sizeof(fields) - fields_size,
+                                "Content-Length: %lld\r\n"
+                                "Content-Range: bytes %lld-%lld/%lld\r\n",
+                                length, ranges[0].first, ranges[0].last, dh->content_length);
+        memcpy(fields + fields_size, dh->fields + dh->length_end, dh->fields_size - dh->length_end);
+        fields_size += dh->fields_size - dh->length_end;
+
+        header_size = compose_header(header_buff, sizeof(header_buff),
+                                     status_line_206, fields, fields_size,
+                                     keep_alive_timeout, keep_alive_requests);
+        if (send_header(socket, header_buff, header_size, length) < 0)
+            return -1;
+        return send_body_range(socket, cache_data, df->fd, ranges[0].first, length);
+    } else {
+        char part_buff[512];
+        const char* type;
+        int type_size;
+        int part_size;
+        int64 content_length = 0;
+
+        /* Content-Type の値(ファイルの MIME/type) */
+        type = dh->fields + dh->type_offset + 14;
+        type_size = dh->length_offset - dh->type_offset - 14 - 2;
+
+        /* 各パートのヘッダーとボディ、終端の境界の長さを合計します。*/
+        for (i = 0; i < range_count; i++) {
+            content_length += snprintf(part_buff, sizeof(part_buff),
+                                       "\r\n--%s\r\n"
+                                       "Content-Type: %.*s\r\n"
+                                       "Content-Range: bytes %lld-%lld/%lld\r\n"
+                                       "\r\n",
+                                       range_boundary, type_size, type,
+                                       ranges[i].first, ranges[i].last, dh->content_length);
+            content_length += ranges[i].last - ranges[i].first + 1;
+        }
+        content_length += snprintf(part_buff, sizeof(part_buff), "\r\n--%s--\r\n", range_boundary);
+
+        /* Content-Type と Content-Length 行を置き換えます。*/
+        memcpy(fields, dh->fields, dh->type_offset);
+        fields_size = dh->type_offset;
+        fields_size += snprintf(fields + fields_size, sizeof(fields) - fields_size,
+                                "Content-Type: multipart/byteranges; boundary=%s\r\n"
+                                "Content-Length: %lld\r\n",
+                                range_boundary, content_length);
+        memcpy(fields + fields_size, dh->fields + dh->length_end, dh->fields_size - dh->length_end);
+        fields_size += dh->fields_size - dh->length_end;
+
+        header_size = compose_header(header_buff, sizeof(header_buff),
+                                     status_line_206, fields, fields_size,
+                                     keep_alive_timeout, keep_alive_requests);
+
+        /* 複数回の送信を少ないTCPセグメントにまとめます。*/
+        out_cork(socket, 1);
+        if (send_data(socket, header_buff, header_size) < 0) {
+            out_cork(socket, 0);
+            return -1;
+        }
+        for (i = 0; i < range_count; i++) {
+            int64 length;
+            int64 n;
+
+            part_size = snprintf(part_buff, sizeof(part_buff),
+                                 "\r\n--%s\r\n"
+                                 "Content-Type: %.*s\r\n"
+                                 "Content-Range: bytes %lld-%lld/%lld\r\n"
+                                 "\r\n",
+                                 range_boundary, type_size, type,
+                                 ranges[i].first, ranges[i].last, dh->content_length);
+            if (send_data(socket, part_buff, part_size) < 0)
+                break;
+            total_size += part_size;
+
+            length = ranges[i].last - ranges[i].first + 1;
+            n = send_body_range(socket, cache_data, df->fd, ranges[i].first, length);
+            if (n < 0)
+                break;
+            total_size += n;
+            if (n != length)
+                break;
+        }
+        if (i == range_count) {
+            part_size = snprintf(part_buff, sizeof(part_buff), "\r\n--%s--\r\n", range_boundary);
+            if (send_data(socket, part_buff, part_size) > 0)
+                total_size += part_size;
+        }
+        out_cork(socket, 0);
+        return (total_size == content_length)? total_size : -1;
+    }
+}
+
+/*
+ * 範囲を満たすことができない場合のレスポンス(416)を送信します。
+ *
+ * 戻り値
+ *  ステータスを返します。
+ */
+static int doc_send_416(SOCKET socket,
+                        int64 size,
+                        int keep_alive_timeout,
+                        int keep_alive_requests,
+                        int* content_size)
+{
+    char fields[256];
+    char header_buff[DOC_HEADER_SIZE];
+    int fields_size;
+    int header_size;
+
+    fields_size = snprintf(fields, sizeof(fields),
+                           "Server: %s\r\n"
+                           "Content-Range: bytes */%lld\r\n"
+                           "Content-Length: 0\r\n",
+                           SERVER_NAME, size);
+    header_size = compose_header(header_buff, sizeof(header_buff),
+                                 status_line_416, fields, fields_size,
+                                 keep_alive_timeout, keep_alive_requests);
+    send_data(socket, header_buff, header_size);
+    *content_size = 0;
+    return HTTP_RANGE_NOT_SATISFIABLE;
+}
+
+/* 1970-01-01 からの日数(グレゴリオ暦) */
+static long days_from_civil(int year, int month, int day)
+{
+    int era;
+    int yoe;
+    int doy;
+    int doe;
+
+    year -= (month <= 2);
+    era = ((year >= 0)? year : year - 399) / 400;
+    yoe = year - era * 400;
+    doy = (153 * (month + ((month > 2)? -3 : 9)) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return (long)era * 146097L + doe - 719468L;
+}
+
+/*
+ * HTTP の日付文字列を解析します。
+ * 次の３つの書式を受け付けます。
+ *
+ *   Sun, 06 Nov 1994 08:49:37 GMT   (IMF-fixdate)
+ *   Sunday, 06-Nov-94 08:49:37 GMT  (RFC 850)
+ *   Sun Nov  6 08:49:37 1994        (asctime)
+ *
+ * 戻り値
+ *  日時(time_t)を返します。
+ *  解析できない場合は -1 を返します。
+ */
+static time_t parse_http_date(const char* value)
+{
+    const char* p;
+    char mon_name[4];
+    int day, year, hour, min, sec;
+    int month;
+
+    p = strchr(value, ',');
+    if (p != NULL) {
+        if (sscanf(p + 1, " %d %3s %d %d:%d:%d", &day, mon_name, &year, &hour, &min, &sec) != 6 &&
+            sscanf(p + 1, " %d-%3s-%d %d:%d:%d", &day, mon_name, &year, &hour, &min, &sec) != 6)
+            return -1;
+    } else {
+        if (sscanf(value, "%*s %3s %d %d:%d:%d %d", mon_name, &day, &hour, &min, &sec, &year) != 6)
+            return -1;
+    }
+    if (year < 100)
+        year += (year < 70)? 2000 : 1900;
+
+    for (month = 0; month < 12; month++) {
+        if (strcmp(mon_name, month_names[month]) == 0)
+            break;
+    }
+    if (month == 12 || day < 1 || day > 31 ||
+        hour < 0 || hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 60)
+        return -1;
+
+    return (time_t)(days_from_civil(year, month + 1, day) * 86400L +
+                    hour * 3600L + min * 60L + sec);
+}
+
+/*
+ * If-None-Match の ETag のリストに一致するものがあるか調べます。
+ * 弱い比較(W/ を無視)を行ないます。
+ *
+ * 戻り値
+ *  一致するものがある場合は 1 を返します。
+ */
+static int match_etag(const char* list, const char* etag)
+{
+    const char* p;
+    int etag_len;
+
+    etag_len = strlen(etag);
+    p = list;
+    while (*p) {
+        const char* tag;
+
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (*p == '*')
+            return 1;
+        if (p[0] == 'W' && p[1] == '/')
+            p += 2;
+        tag = p;
+        if (*p == '"') {
+            p++;
+            while (*p && *p != '"')
+                p++;
+            if (*p == '"')
+                p++;
+        }
+        if (p - tag == etag_len && memcmp(tag, etag, etag_len) == 0)
+            return 1;
+        while (*p && *p != ',')
+            p++;
+    }
+    return 0;
+}
+
+/*
+ * 条件付きリクエストでドキュメントが変更されていないか調べます。
+ * If-None-Match がある場合は If-Modified-Since を使用しません。
+ *
+ * 戻り値
+ *  変更されていない場合(304)は 1 を返します。
+ */
+static int check_not_modified(struct http_header_t* hdr, struct doc_header_t* dh)
+{
+    char* value;
+    time_t since;
+
+    value = get_http_header(hdr, "If-None-Match");
+    if (value != NULL)
+        return match_etag(value, dh->etag);
+
+    value = get_http_header(hdr, "If-Modified-Since");
+    if (value == NULL)
+        return 0;
+    /* 送信した Last-Modified がそのまま返される場合がほとんどです。*/
+    if (strcmp(value, dh->modify_date) == 0)
+        return 1;
+    since = parse_http_date(value);
+    return (since >= 0 && dh->last_modified <= since);
+}
+
+/*
+ * 変更されていないことを通知するレスポンス(304)を送信します。
+ * ETag とキャッシュのキーになる Vary を付加します。
+ *
+ * 戻り値
+ *  ステータスを返します。
+ */
+static int doc_send_304(SOCKET socket,
+                        struct doc_header_t* dh,
+                        int keep_alive_timeout,
+                        int keep_alive_requests,
+                        int* content_size)
+{
+    char fields[256];
+    char header_buff[DOC_HEADER_SIZE];
+    int fields_size;
+    int header_size;
+
+    fields_size = snprintf(fields, sizeof(fields),
+                           "Server: %s\r\n"
+                           "ETag: %s\r\n",
+                           SERVER_NAME, dh->etag);
+#ifdef HAVE_LIBZ
+    if (dh->compressible && g_conf->gzip_flag)
+        fields_size += snprintf(fields + fields_size, sizeof(fields) - fields_size, "%s", header_vary);
+#endif
+    header_size = compose_header(header_buff, sizeof(header_buff),
+                                 status_line_304, fields, fields_size,
+                                 keep_alive_timeout, keep_alive_requests);
+    send_data(socket, header_buff, header_size);
+    *content_size = 0;
+    return HTTP_NOT_MODIFIED;
+}
+
+/*
+ * If-Range ヘッダーがある場合はドキュメントが変更されていないか調べます。
+ * ETag の場合は強い比較を行ないます。
+ *
+ * 戻り値
+ *  Range ヘッダーを適用する場合は 1 を返します。
+ *  変更されている場合は 0 を返します(ドキュメント全体を送信します)。
+ */
+static int check_if_range(struct http_header_t* hdr, struct doc_file_t* df)
+{
+    char* value;
+
+    value = get_http_header(hdr, "If-Range");
+    if (value == NULL)
+        return 1;
+    if (*value == '"')
+        return (strcmp(value, df->header.etag) == 0);
+    if (*value == 'W' && value[1] == '/')
+        return 0;
+    return (parse_http_date(value) == df->header.last_modified);
+}
+
+/*
+ * 読み込んだボディをファイルキャッシュに設定します。
+ * 読み込みの権利(bc_get_single)がある場合は待機しているスレッドにも渡します。
+ * data が NULL の場合は読み込みの権利だけを解放します。
+ */
+static void cache_body(void** flight, const char* key, time_t mtime, int size, const char* data)
+{
+    if (*flight != NULL) {
+        bc_load_end(g_file_cache, *flight, data);
+        *flight = NULL;
+    } else if (data != NULL) {
+        bc_set(g_file_cache, key, mtime, size, data);
+    }
+}
+
+/*
+ * ドキュメントバンドルからドキュメントを送信します。
+ * ボディはメモリマップされたバンドルから直接送信します。
+ * ヘッダーフィールドはエントリごとに一度だけ組み立てます。
+ *
+ * 戻り値
+ *  ステータスを返します。
+ */
+static int doc_send_bundle(SOCKET socket,
+                           struct in_addr addr,
+                           const char* file_name,
+                           struct http_header_t* hdr,
+                           int keep_alive_timeout,
+                           int keep_alive_requests,
+                           int* content_size)
+{
+    char path[MAX_PATH];
+    struct bundle_file_t bf;
+    struct doc_header_t* dh;
+    struct doc_file_t df;
+    char header_buff[DOC_HEADER_SIZE];
+    int header_size;
+    const char* data;
+    int data_size;
+    char* range_value;
+    int encoding = DOC_ENCODING_IDENTITY;
+
+    /* ドキュメントルートと同じ正規化したパスで検索します。*/
+    doc_path(path, sizeof(path), "", file_name);
+    if (bundle_find(g_bundle, path, &bf) < 0) {
+        /* Not Found(404)を送信 */
+        if (missing_log_permit())
+            err_log(addr, "request file not found in bundle (%s)", file_name);
+        return doc_status_send(socket, HTTP_NOTFOUND,
+                               keep_alive_timeout, keep_alive_requests, content_size);
+    }
+
+    range_value = get_http_header(hdr, "Range");
+#ifdef HAVE_LIBZ
+    /* 圧縮済みのボディがあり、クライアントが gzip を受け付ける場合 */
+    if (bf.gz_data != NULL && g_conf->gzip_flag && range_value == NULL && accept_gzip(hdr))
+        encoding = DOC_ENCODING_GZIP;
+#endif
+    data = (encoding == DOC_ENCODING_GZIP)? bf.gz_data : bf.data;
+    data_size = (int)((encoding == DOC_ENCODING_GZIP)? bf.gz_size : bf.size);
+
+    dh = bundle_get_header(g_bundle, bf.index, encoding);
+    if (dh == NULL) {
+        char etag[64];
+
+        if (encoding == DOC_ENCODING_GZIP)
+            snprintf(etag, sizeof(etag), "%.*s-gz\"", (int)strlen(bf.etag) - 1, bf.etag);
+        else
+            snprintf(etag, sizeof(etag), "%s", bf.etag);
+        build_doc_header(bf.path, bf.mtime, bf.size, etag,
+                         encoding, (int64)data_size, bf.type, &df.header);
+        df.header.precompressed = (encoding == DOC_ENCODING_GZIP);
+        dh = bundle_set_header(g_bundle, bf.index, encoding, &df.header);
+        if (dh == NULL)
+            dh = &df.header;
+    }
+
+    /* If-None-Match, If-Modified-Since ヘッダーを調べます。*/
+    if (check_not_modified(hdr, dh))
+        return doc_send_304(socket, dh, keep_alive_timeout, keep_alive_requests, content_size);
+
+    /* Range ヘッダーがある場合は指定された範囲だけを送信します。*/
+    if (range_value != NULL && encoding == DOC_ENCODING_IDENTITY) {
+        struct byte_range_t ranges[DOC_MAX_RANGES];
+        int range_count;
+
+        if (dh != &df.header)
+            memcpy(&df.header, dh, sizeof(struct doc_header_t));
+        df.entry = NULL;
+        df.fd = -1;
+        df.fd_owner = 0;
+        if (check_if_range(hdr, &df)) {
+            range_count = parse_range(range_value, bf.size, ranges, DOC_MAX_RANGES);
+            if (range_count == 0)
+                return doc_send_416(socket, bf.size,
+                                    keep_alive_timeout, keep_alive_requests, content_size);
+            if (range_count > 0) {
+                int64 range_size;
+
+                range_size = doc_send_range(socket, &df, bf.data, ranges, range_count,
+                                            keep_alive_timeout, keep_alive_requests);
+                if (range_size < 0)
+                    err_log(addr, "document send error (%s): %s", file_name, strerror(errno));
+                *content_size = (range_size < 0)? 0 : (int)range_size;
+                return HTTP_PARTIAL_CONTENT;
+            }
+        }
+    }
+
+    /* ヘッダーとボディの送信 */
+    header_size = compose_header(header_buff, sizeof(header_buff),
+                                 status_line_200, dh->fields, dh->fields_size,
+                                 keep_alive_timeout, keep_alive_requests);
+    *content_size = out_send_header_body(socket, header_buff, header_size, data, data_size);
+    if (*content_size < 0) {
+        err_log(addr, "document send error (%s): %s", file_name, strerror(errno));
+        *content_size = 0;
+    }
+    return HTTP_OK;
 }
 
 int doc_send(SOCKET socket,
@@ -149,126 +1455,268 @@ int doc_send(SOCKET socket,
              int* content_size)
 {
     char fpath[MAX_PATH];
-    int fd;
-    struct stat file_stat;
+    struct doc_file_t df;
     struct mmap_t* map;
     char send_buff[BUF_SIZE];
+    char header_buff[DOC_HEADER_SIZE];
+    char* body_key;
+#ifdef HAVE_LIBZ
+    char gz_key[MAX_PATH+8];
+#endif
+    void* flight = NULL;
+    int header_size;
+    int header_sent = 0;
     int total_size = 0;
-    int index;
-    char ext_name[MAX_PATH];
-    char* mime_type = NULL;
-    char default_mime_type[256];
+    int file_size;
+    char* range_value;
 
-    char now_date[256]; 
-    struct tm modify_gmt;
-    char modify_date[256];
-    char* head_date;
+    /* ドキュメントバンドルが指定されている場合はファイルを参照しません。*/
+    if (g_bundle != NULL)
+        return doc_send_bundle(socket, addr, file_name, hdr,
+                               keep_alive_timeout, keep_alive_requests, content_size);
 
     /* フルパスのファイル名を生成します。*/
-    snprintf(fpath, sizeof(fpath), "%s/%s", root, file_name);
+    doc_path(fpath, sizeof(fpath), root, file_name);
 #ifdef _WIN32
     /* パス区切り文字を置換する */
     chrep(fpath, '/', '\\');
 #endif
 
-    /* ファイル情報の取得 */
-    if (stat(fpath, &file_stat) < 0) {
-        err_log(addr, "fstat error (%s): %s", file_name, strerror(errno));
-        /* Not Found(404)を送信 */
-        return error_handler(socket, HTTP_NOTFOUND, content_size);
-    }
-
-    /* ディレクトリか調べます。*/
-    if (S_ISDIR(file_stat.st_mode)) {
+    /* ファイル情報、ディスクリプタ、組み立て済みのヘッダーフィールドを取得します。*/
+    if (doc_open(fpath, file_name, addr, &df) < 0) {
         /* Not Found(404)を送信 */
-        return error_handler(socket, HTTP_NOTFOUND, content_size);
+        return doc_status_send(socket, HTTP_NOTFOUND,
+                               keep_alive_timeout, keep_alive_requests, content_size);
     }
 
-    /* ファイル更新日時をヘッダー文字列(GMT)に変換します。*/
-    mt_gmtime(&file_stat.st_mtime, &modify_gmt);
-    gmtstr(modify_date, sizeof(modify_date), &modify_gmt);
+    range_value = get_http_header(hdr, "Range");
+#ifdef HAVE_LIBZ
+    /* クライアントが gzip を受け付ける場合は圧縮したドキュメントに切り替えます。
+       Range は圧縮前のドキュメントに適用します。*/
+    if (df.header.compressible && g_conf->gzip_flag && range_value == NULL && accept_gzip(hdr)) {
+        struct doc_file_t gzdf;
 
-    /* If-Modified-Since ヘッダーがあるか調べます。*/
-    head_date = get_http_header(hdr, "If-Modified-Since");
-    if (head_date != NULL) {
-        if (strcmp(head_date, modify_date) == 0) {
-            /* クライアントにキャッシュされているものを使用するように通知します。*/
-            return forward_handler(socket, HTTP_NOT_MODIFIED, content_size);
+        if (doc_open_gzip(fpath, file_name, addr, &df, &gzdf) == 0) {
+            doc_close(&df);
+            df = gzdf;
         }
     }
-
-    /* ファイルの拡張子からMIME/typeを決定 */
-    ext_name[0] = '\0';
-    index = lastindexof(fpath, '.');
-    if (index > 0) {
-        substr(ext_name, fpath, index+1, -1);
-        mime_type = get_mime_type(ext_name);
+#endif
+    /* ボディのファイルキャッシュのキー(圧縮済みファイルはそのパス) */
+    body_key = fpath;
+#ifdef HAVE_LIBZ
+    if (df.header.encoding == DOC_ENCODING_GZIP) {
+        if (df.header.precompressed)
+            snprintf(gz_key, sizeof(gz_key), "%s.gz", fpath);
+        else
+            snprintf(gz_key, sizeof(gz_key), "gzip:%s", fpath);
+        body_key = gz_key;
     }
-    if (mime_type == NULL) {
-        snprintf(default_mime_type, sizeof(default_mime_type), "application/%s", ext_name);
-        mime_type = default_mime_type;
+#endif
+
+    /* If-None-Match, If-Modified-Since ヘッダーを調べます。*/
+    if (check_not_modified(hdr, &df.header)) {
+        doc_close(&df);
+        /* クライアントにキャッシュされているものを使用するように通知します。*/
+        return doc_send_304(socket, &df.header,
+                            keep_alive_timeout, keep_alive_requests, content_size);
     }
 
-    /* 現在時刻をGMTで取得 */
-    now_gmtstr(now_date, sizeof(now_date));
+    /* Range ヘッダーがある場合は指定された範囲だけを送信します。*/
+    if (range_value != NULL && df.header.encoding == DOC_ENCODING_IDENTITY && check_if_range(hdr, &df)) {
+        struct byte_range_t ranges[DOC_MAX_RANGES];
+        int range_count;
 
-    /* ヘッダーの編集 */
-    if (keep_alive_requests > 0) {
-        snprintf(send_buff, sizeof(send_buff), header_keep_alive_200,
-                 now_date, SERVER_NAME, mime_type, file_stat.st_size, modify_date,
-                 keep_alive_timeout, keep_alive_requests);
-    } else {
-        snprintf(send_buff, sizeof(send_buff), header_template_200,
-                 now_date, SERVER_NAME, mime_type, file_stat.st_size, modify_date);
+        range_count = parse_range(range_value, df.header.content_length, ranges, DOC_MAX_RANGES);
+        if (range_count == 0) {
+            doc_close(&df);
+            return doc_send_416(socket, df.header.content_length,
+                                keep_alive_timeout, keep_alive_requests, content_size);
+        }
+        if (range_count > 0) {
+            char* cache_data = NULL;
+            void* cache_ref = NULL;
+            int64 range_size;
+
+            /* ファイルキャッシュにあれば使用しますが、設定はしません。*/
+            if (bc_cacheable(g_file_cache, df.header.content_length))
+                cache_data = bc_get(g_file_cache, body_key, df.header.mtime,
+                                    (int)df.header.content_length, &cache_ref);
+            if (cache_data == NULL && df.fd < 0) {
+                if ((df.fd = FILE_OPEN(body_key, O_RDONLY|O_BINARY, S_IREAD)) < 0) {
+                    doc_close(&df);
+                    err_log(addr, "request file can't open (%s): %s", file_name, strerror(errno));
+                    return doc_status_send(socket, HTTP_NOTFOUND,
+                                           keep_alive_timeout, keep_alive_requests, content_size);
+                }
+                df.fd_owner = 1;
+            }
+            range_size = doc_send_range(socket, &df, cache_data, ranges, range_count,
+                                        keep_alive_timeout, keep_alive_requests);
+            if (cache_ref != NULL)
+                bc_release(g_file_cache, cache_ref);
+            if (range_size < 0)
+                err_log(addr, "document send error (%s): %s", file_name, strerror(errno));
+            doc_close(&df);
+            if (range_size < 0)
+                range_size = 0;
+            *content_size = (range_size > INT_MAX)? INT_MAX : (int)range_size;
+            return HTTP_PARTIAL_CONTENT;
+        }
     }
 
-    /* ヘッダーの送信 */
-    if (send_data(socket, send_buff, strlen(send_buff)) < 0) {
-        err_log(addr, "document send error (%s): %s", file_name, strerror(errno)); 
+    /* ヘッダーの編集(Date と Keep-Alive のみ) */
+    header_size = compose_header(header_buff, sizeof(header_buff),
+                                 status_line_200, df.header.fields, df.header.fields_size,
+                                 keep_alive_timeout, keep_alive_requests);
+
+    /* ファイルから送信する大きなボディはキャッシュせずにストリーミングします。
+       INT_MAX を超えるボディはメモリに読み込まずに常にストリーミングします。*/
+    if (((g_conf->stream_threshold > 0 && df.header.content_length >= g_conf->stream_threshold) ||
+         df.header.content_length > INT_MAX) &&
+        (df.header.encoding == DOC_ENCODING_IDENTITY || df.header.precompressed)) {
+        int64 stream_size;
+
+        if (df.fd < 0) {
+            if ((df.fd = FILE_OPEN(body_key, O_RDONLY|O_BINARY, S_IREAD)) < 0) {
+                doc_close(&df);
+                err_log(addr, "request file can't open (%s): %s", file_name, strerror(errno));
+                return doc_status_send(socket, HTTP_NOTFOUND,
+                                       keep_alive_timeout, keep_alive_requests, content_size);
+            }
+            df.fd_owner = 1;
+        }
+        if (send_header(socket, header_buff, header_size, 1) < 0)
+            err_log(addr, "document send error (%s): %s", file_name, strerror(errno));
+        stream_size = send_file_stream(socket, df.fd, df.header.content_length);
+        if (stream_size != df.header.content_length)
+            err_log(addr, "document send error (%s): %s", file_name, strerror(errno));
+        doc_close(&df);
+        if (stream_size < 0)
+            stream_size = 0;
+        *content_size = (stream_size > INT_MAX)? INT_MAX : (int)stream_size;
+        return HTTP_OK;
     }
 
+    /* ここからのボディは INT_MAX 以下です(動的な圧縮は bc_cacheable() の範囲のみ)。*/
+    file_size = (int)df.header.content_length;
+
+    /* ヘッダーはボディと一緒に送信します。*/
+
     if (g_file_cache != NULL) {
         char* cache_data;
+        void* cache_ref;
 
-        /* ファイルキャッシュからデータを取得します。*/
-        cache_data = fc_get(g_file_cache, fpath, file_stat.st_mtime, file_stat.st_size);
+        /* ファイルキャッシュからデータを取得します。
+           他のスレッドが読み込み中の場合はそれを待ちます。*/
+        cache_data = bc_get_single(g_file_cache, body_key, df.header.mtime, file_size,
+                                   &cache_ref, &flight);
         if (cache_data != NULL) {
-            /* キャッシュ内容（ボディ）の送信 */
-            *content_size = send_data(socket, cache_data, file_stat.st_size);
+            doc_close(&df);
+            /* ヘッダーとキャッシュ内容（ボディ）の送信 */
+            *content_size = out_send_header_body(socket,
+                                                 header_buff, header_size,
+                                                 cache_data, file_size);
+            bc_release(g_file_cache, cache_ref);
+            if (*content_size < 0)
+                err_log(addr, "document cache send error (%s): %s", file_name, strerror(errno));
             return HTTP_OK;
         }
     }
 
-    /* ファイルをオープンします。*/
-    if ((fd = FILE_OPEN(fpath, O_RDONLY|O_BINARY, S_IREAD)) < 0) {
-        /* Not Found(404)を送信 */
-        err_log(addr, "request file can't open (%s): %s", file_name, strerror(errno));
-        return error_handler(socket, HTTP_NOTFOUND, content_size);
+#ifdef HAVE_LIBZ
+    if (df.header.encoding == DOC_ENCODING_GZIP && ! df.header.precompressed) {
+        char* data;
+        int data_size = 0;
+
+        /* ファイルキャッシュから削除された圧縮データを作り直します。*/
+        data = gzip_file(fpath, -1, (int)df.header.size, &data_size);
+        if (data == NULL || data_size != file_size) {
+            /* 圧縮中にファイルが更新された場合はヘッダーと一致しません。*/
+            if (data != NULL)
+                free(data);
+            cache_body(&flight, body_key, df.header.mtime, file_size, NULL);
+            doc_close(&df);
+            doc_cache_invalidate(fpath);
+            err_log(addr, "gzip compress error (%s)", file_name);
+            return error_handler(socket, HTTP_INTERNAL_SERVER_ERROR, content_size);
+        }
+        cache_body(&flight, body_key, df.header.mtime, data_size, data);
+        total_size = out_send_header_body(socket,
+                                          header_buff, header_size,
+                                          data, data_size);
+        if (total_size < 0)
+            err_log(addr, "document send error (%s): %s", file_name, strerror(errno));
+        free(data);
+        goto final;
+    }
+#endif
+
+    /* キャッシュからディスクリプタを取得できない場合はオープンします。*/
+    if (df.fd < 0) {
+        if ((df.fd = FILE_OPEN(body_key, O_RDONLY|O_BINARY, S_IREAD)) < 0) {
+            cache_body(&flight, body_key, df.header.mtime, file_size, NULL);
+            doc_close(&df);
+            /* Not Found(404)を送信 */
+            err_log(addr, "request file can't open (%s): %s", file_name, strerror(errno));
+            return doc_status_send(socket, HTTP_NOTFOUND,
+                                   keep_alive_timeout, keep_alive_requests, content_size);
+        }
+        df.fd_owner = 1;
     }
 
+#ifdef __linux__
+    if (! bc_cacheable(g_file_cache, file_size)) {
+        /* キャッシュしないファイルは sendfile() でボディを送信します。*/
+        if (send_header(socket, header_buff, header_size, file_size) < 0)
+            err_log(addr, "document send error (%s): %s", file_name, strerror(errno));
+        total_size = (int)send_file(socket, df.fd, 0, file_size);
+        if (total_size < 0)
+            err_log(addr, "document send error (%s): %s", file_name, strerror(errno));
+        goto final;
+    }
+#endif
+
     /* メモリマップドファイル */
-    map = mmap_open(fd, MMAP_READONLY, MMAP_AUTO_SIZE);
+    map = mmap_open(df.fd, MMAP_READONLY, MMAP_AUTO_SIZE);
     if (map) {
-        if (g_file_cache != NULL) {
-            /* ファイル内容をキャッシュに設定します。*/
-            fc_set(g_file_cache, fpath, file_stat.st_mtime, (int)map->size, map->ptr);
+        void* map_ref = NULL;
+
+        if (g_file_cache != NULL && map->size == file_size) {
+            if (g_conf->file_cache_mmap) {
+                /* マップをそのままキャッシュに設定します(コピーしません)。*/
+                bc_set_map(g_file_cache, body_key, df.header.mtime, map, flight, &map_ref);
+                flight = NULL;
+            } else {
+                /* ファイル内容をキャッシュに設定します。*/
+                cache_body(&flight, body_key, df.header.mtime, file_size, map->ptr);
+            }
         }
-        /* ボディの送信 */
-        total_size = send_data(socket, map->ptr, (int)map->size);
+        /* ヘッダーとボディの送信 */
+        total_size = out_send_header_body(socket,
+                                          header_buff, header_size,
+                                          map->ptr, (int)map->size);
         if (total_size < 0)
             err_log(addr, "document cache send error (%s): %s", file_name, strerror(errno)); 
-        mmap_close(map);
+        /* キャッシュに設定したマップは参照を解放します。*/
+        if (map_ref != NULL)
+            bc_release(g_file_cache, map_ref);
+        else
+            mmap_close(map);
     } else {
         if (g_file_cache != NULL) {
             char* data;
 
             /* ファイル内容をメモリに読み込んでキャッシュに設定します。*/
-            data = (char*)malloc(file_stat.st_size);
+            data = (char*)malloc(file_size);
             if (data != NULL) {
-                if (FILE_READ(fd, data, file_stat.st_size) == file_stat.st_size) {
-                    fc_set(g_file_cache, fpath, file_stat.st_mtime, file_stat.st_size, data);
-                    /* ボディの送信 */
-                    total_size = send_data(socket, data, file_stat.st_size);
+                if (read_file(df.fd, data, file_size, 0) == file_size) {
+                    cache_body(&flight, body_key, df.header.mtime, file_size, data);
+                    /* ヘッダーとボディの送信 */
+                    total_size = out_send_header_body(socket,
+                                                      header_buff, header_size,
+                                                      data, file_size);
+                    header_sent = 1;
                     if (total_size < 0)
                         err_log(addr, "document cache send error (%s): %s", file_name, strerror(errno)); 
                 }
@@ -280,7 +1728,12 @@ int doc_send(SOCKET socket,
         if (total_size == 0) {
             int length;
 
-            while ((length = FILE_READ(fd, send_buff, sizeof(send_buff))) > 0) {
+            if (! header_sent) {
+                if (send_header(socket, header_buff, header_size, file_size) < 0)
+                    err_log(addr, "document send error (%s): %s", file_name, strerror(errno));
+            }
+
+            while ((length = read_file(df.fd, send_buff, sizeof(send_buff), total_size)) > 0) {
                 /* 読み込めたデータを送信 */
                 if ((length = send_data(socket, send_buff, length)) < 0) {
                     err_log(addr, "document send error (%s): %s", file_name, strerror(errno)); 
@@ -291,12 +1744,131 @@ int doc_send(SOCKET socket,
         }
     }
 
+#if defined(__linux__) || defined(HAVE_LIBZ)
+final:
+#endif
+    /* 読み込めなかった場合も待機しているスレッドを起床させます。*/
+    cache_body(&flight, body_key, df.header.mtime, file_size, NULL);
+
     /* 送信データサイズのチェック */
-    if (file_stat.st_size != total_size) {
+    if (file_size != total_size) {
         err_log(addr, "file read size error (%s)", file_name);
     }
-    /* ファイルクローズ */
-    FILE_CLOSE(fd);
+    /* ファイルクローズ(キャッシュのディスクリプタは参照を解放します) */
+    doc_close(&df);
     *content_size = total_size;
     return HTTP_OK;
 }
+
+/*
+ * ボディをファイルキャッシュに読み込みます。
+ * すでにキャッシュにある場合は読み込みません。
+ *
+ * 戻り値
+ *  ファイルキャッシュに設定したバイト数を返します。
+ */
+static int64 preload_body(const char* key, struct doc_file_t* df)
+{
+    int size;
+    void* ref;
+    char* data;
+    int fd;
+    int64 loaded = 0;
+
+    if (g_conf->stream_threshold > 0 && df->header.content_length >= g_conf->stream_threshold)
+        return 0;
+    size = (int)df->header.content_length;
+    if (! bc_cacheable(g_file_cache, size))
+        return 0;
+    if (bc_get(g_file_cache, key, df->header.mtime, size, &ref) != NULL) {
+        bc_release(g_file_cache, ref);
+        return 0;
+    }
+
+    fd = df->fd;
+    if (fd < 0) {
+        if ((fd = FILE_OPEN(key, O_RDONLY|O_BINARY, S_IREAD)) < 0)
+            return 0;
+    }
+    if (g_conf->file_cache_mmap) {
+        struct mmap_t* map;
+
+        /* マップをそのままキャッシュに設定します。*/
+        map = mmap_open(fd, MMAP_READONLY, MMAP_AUTO_SIZE);
+        if (map != NULL) {
+            if (map->size == size &&
+                bc_set_map(g_file_cache, key, df->header.mtime, map, NULL, &ref) == 0) {
+                bc_release(g_file_cache, ref);
+                loaded = size;
+            } else {
+                mmap_close(map);
+            }
+            if (fd != df->fd)
+                FILE_CLOSE(fd);
+            return loaded;
+        }
+    }
+    data = (char*)malloc(size);
+    if (data != NULL) {
+        if (read_file(fd, data, size, 0) == size) {
+            if (bc_set(g_file_cache, key, df->header.mtime, size, data) == 0)
+                loaded = size;
+        }
+        free(data);
+    }
+    if (fd != df->fd)
+        FILE_CLOSE(fd);
+    return loaded;
+}
+
+/*
+ * ドキュメントをドキュメントキャッシュとファイルキャッシュに読み込みます。
+ * 起動時にキャッシュを準備するために使用します(cache_warm.c)。
+ * gzip を使用する場合は圧縮したボディも読み込みます。
+ *
+ * root: ドキュメントルート
+ * file_name: ドキュメントルートからのファイル名
+ *
+ * 戻り値
+ *  ファイルキャッシュに設定したバイト数を返します。
+ *  ファイルが存在しない場合は -1 を返します。
+ */
+int64 doc_preload(const char* root, const char* file_name)
+{
+    char fpath[MAX_PATH];
+    struct in_addr addr;
+    struct doc_file_t df;
+    int64 loaded;
+
+    if (check_file(file_name))
+        return -1;
+    doc_path(fpath, sizeof(fpath), root, file_name);
+#ifdef _WIN32
+    chrep(fpath, '/', '\\');
+#endif
+    memset(&addr, 0, sizeof(addr));
+    if (doc_open(fpath, file_name, addr, &df) < 0)
+        return -1;
+
+    loaded = preload_body(fpath, &df);
+#ifdef HAVE_LIBZ
+    if (df.header.compressible && g_conf->gzip_flag) {
+        struct doc_file_t gzdf;
+
+        /* 圧縮したボディは doc_open_gzip() で設定されます。*/
+        if (doc_open_gzip(fpath, file_name, addr, &df, &gzdf) == 0) {
+            if (gzdf.header.precompressed) {
+                char gz_key[MAX_PATH+8];
+
+                snprintf(gz_key, sizeof(gz_key), "%s.gz", fpath);
+                loaded += preload_body(gz_key, &gzdf);
+            } else {
+                loaded += gzdf.header.content_length;
+            }
+            doc_close(&gzdf);
+        }
+    }
+#endif
+    doc_close(&df);
+    return loaded;
+}
@@ -22,36 +22,60 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
+#ifdef __linux__
+#define _GNU_SOURCE     /* accept4() */
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
 #include "http_server.h"
 
-#ifdef WIN32
-static HANDLE queue_cond;
-#else
-static pthread_mutex_t queue_mutex;
-static pthread_cond_t queue_cond;
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/epoll.h>
+#define USE_EPOLL
 #endif
 
 static CS_DEF(worker_thread_info_lock);
 
-static API_FUNCPTR get_api(const char* content_name, struct appzone_t** zone)
+#ifdef USE_EPOLL
+#define EVENT_MAX_COUNT   256   /* epoll_wait() max events */
+#define EVENT_WAIT_TIMEOUT 1000 /* shutdown check interval(ms) */
+#define ACCEPT_BATCH_COUNT 64   /* max accept count per event */
+#else
+#define ACCEPT_BATCH_COUNT 1
+#endif
+
+/* http acceptor(listen socket, request queue and event loop) */
+struct acceptor_t {
+    int acceptor_no;                    /* acceptor number(0 is main thread) */
+    SOCKET listen_socket;               /* listen socket */
+    struct wqueue_t* queue;             /* request queue(lock-free) */
+    struct wqueue_t* args_pool;         /* free thread_args_t pool */
+#ifdef USE_EPOLL
+    int event_fd;                       /* epoll descriptor */
+    struct thread_args_t* idle_head;    /* keep-alive idle list(oldest first) */
+    struct thread_args_t* idle_tail;
+    CS_DEF(idle_list_lock);
+#endif
+};
+
+static struct acceptor_t* acceptor_tbl; /* acceptor table(acceptor_threads) */
+
+static API_FUNCPTR get_api(const char* content_name,
+                           struct appzone_t** zone,
+                           struct route_match_t* match)
 {
-    int n;
     struct hook_api_t* api;
 
-    n = g_conf->api_count;
-    api = g_conf->api_table;
-    while (n--) {
-        if (strcmp(api->content_name, content_name) == 0) {
-            *zone = api->app_zone;
-            return api->func_ptr;
-        }
-        api++;
-    }
-    return NULL;
+    /* 完全一致のハッシュ表とワイルドカードのトライ木から検索します。*/
+    api = route_lookup(content_name, match);
+    if (api == NULL)
+        return NULL;
+    *zone = api->app_zone;
+    return api->func_ptr;
 }
 
 static void break_signal()
@@ -159,6 +183,33 @@ static void do_server_status(char* buf)
         sprintf(tbuf, "%5d %-6s %-19s %s\n", i+1, status, timebuf, countbuf);
         strcat(buf, tbuf);
     }
+
+    /* ファイルキャッシュの統計(http.file_cache_size の調整用) */
+    if (g_file_cache != NULL) {
+        struct bc_stats_t st;
+        int64 lookups;
+
+        bc_stats(g_file_cache, &st);
+        lookups = st.hits + st.misses;
+        strcat(buf, "\n[file cache]\n");
+        sprintf(tbuf, "policy %s  size %lld/%lld bytes  pinned %lld bytes  mapped %lld bytes  files %d\n",
+                st.policy, st.bytes, st.max_size, st.pinned_bytes, st.mapped_bytes, st.entries);
+        strcat(buf, tbuf);
+        sprintf(tbuf, "hits %lld  misses %lld  hit ratio %.1f%%\n",
+                st.hits, st.misses, (lookups > 0)? st.hits * 100.0 / lookups : 0.0);
+        strcat(buf, tbuf);
+        sprintf(tbuf, "inserts %lld  evictions %lld  rejects %lld\n",
+                st.inserts, st.evictions, st.rejects);
+        strcat(buf, tbuf);
+        sprintf(tbuf, "coalesced misses %lld  wait timeouts %lld\n",
+                st.coalesced, st.wait_timeouts);
+        strcat(buf, tbuf);
+        if (st.arena_size > 0) {
+            sprintf(tbuf, "arena %lld/%lld bytes%s\n",
+                    st.arena_used, st.arena_size, (st.arena_hugepage)? "  hugepage" : "");
+            strcat(buf, tbuf);
+        }
+    }
 }
 
 static int do_command(SOCKET socket, struct request_t* req, int* content_len)
@@ -209,20 +260,21 @@ static int request_proc(SOCKET socket,
     int status;
     struct appzone_t* z;
     API_FUNCPTR funcptr;
+    struct route_match_t match;
 
     *is_keep_alive = 0;
-    funcptr = get_api(req->content_name, &z);
+    funcptr = get_api(req->content_name, &z, &match);
     if (funcptr == NULL) {
         /* ドキュメントを送信します。*/
         if (check_file(req->content_name)) {
             /* error */
             err_log(addr, "file check error (%s)", req->content_name);
-            status = error_handler(socket, HTTP_NOTFOUND, content_size);
+            status = doc_status_send(socket, HTTP_NOTFOUND, 0, 0, content_size);
         } else {
-            if (*g_conf->document_root == '\0') {
+            if (*g_conf->document_root == '\0' && g_bundle == NULL) {
                 /* error */
                 err_log(addr, "document root is empty!");
-                status = error_handler(socket, HTTP_NOTFOUND, content_size);
+                status = doc_status_send(socket, HTTP_NOTFOUND, 0, 0, content_size);
             } else {
                 /* ドキュメントの送信 */
                 status = doc_send(socket,
@@ -254,8 +306,14 @@ static int request_proc(SOCKET socket,
             err_log(addr, "resp_initialize(): no memory!");
             status = error_handler(socket, HTTP_INTERNAL_SERVER_ERROR, content_size);
         } else {
-            /* APIを実行します。*/
+            /* APIを実行します。
+               resp_send_header() と resp_send_body() の出力を
+               まとめて送信するため実行中はソケットの出力を保留します。*/
+            out_cork(socket, 1);
+            route_set_current(req, &match);
             status = (*funcptr)(req, resp, &g_conf->u_param);
+            route_set_current(NULL, NULL);
+            out_cork(socket, 0);
             *content_size = resp->content_size;
             resp_finalize(resp);
         }
@@ -279,11 +337,223 @@ static int is_timeout_thread(struct worker_thread_info_t* th_info)
     return 0;
 }
 
+/*
+ * ワーカースレッドへ渡す領域をプールから取得します。
+ * プールが空の場合は新たに確保します。
+ *
+ * 戻り値
+ *  領域のポインタを返します。
+ *  メモリ不足の場合は NULL を返します。
+ */
+static struct thread_args_t* thread_args_alloc(struct acceptor_t* acc)
+{
+    struct thread_args_t* th_args;
+
+    th_args = (struct thread_args_t*)wq_pop(acc->args_pool);
+    if (th_args == NULL)
+        th_args = (struct thread_args_t*)malloc(sizeof(struct thread_args_t));
+    return th_args;
+}
+
+/*
+ * ワーカースレッドへ渡した領域をアクセプターのプールへ戻します。
+ * プールが満杯の場合は解放します。
+ */
+static void thread_args_free(struct thread_args_t* th_args)
+{
+    if (wq_push(th_args->acceptor->args_pool, th_args) < 0)
+        free(th_args);
+}
+
+/*
+ * リクエストされた情報をキューイング(push)します。
+ * 待機中のワーカースレッドがあれば１つだけ起床します。
+ *
+ * 戻り値
+ *  正常に終了した場合はゼロを返します。
+ *  キューが満杯の場合は -1 を返します。
+ */
+static int request_queue_push(struct acceptor_t* acc, struct thread_args_t* th_args)
+{
+    if (wq_push(acc->queue, th_args) < 0) {
+        err_log(th_args->sockaddr.sin_addr, "request queue is full.");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * 自分のアクセプターのキューが空の場合は
+ * 他のアクセプターのキューからリクエストを取り出します(work stealing)。
+ */
+static struct thread_args_t* request_queue_steal(struct acceptor_t* acc)
+{
+    int i;
+
+    for (i = 1; i < g_conf->acceptor_threads; i++) {
+        struct thread_args_t* th_args;
+        struct acceptor_t* victim;
+
+        victim = &acceptor_tbl[(acc->acceptor_no + i) % g_conf->acceptor_threads];
+        th_args = (struct thread_args_t*)wq_pop(victim->queue);
+        if (th_args != NULL)
+            return th_args;
+    }
+    return NULL;
+}
+
+#ifdef USE_EPOLL
+/*
+ * ソケットをイベントの監視対象に追加します。
+ * クライアントソケットは EPOLLET|EPOLLONESHOT で登録します。
+ *
+ * 戻り値
+ *  正常に終了した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int event_add(struct acceptor_t* acc, struct event_handler_t* eh, unsigned int events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = eh;
+    if (epoll_ctl(acc->event_fd, EPOLL_CTL_ADD, eh->socket, &ev) < 0) {
+        err_write("event_add: epoll_ctl error: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int event_rearm(struct acceptor_t* acc, struct event_handler_t* eh, unsigned int events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = eh;
+    if (epoll_ctl(acc->event_fd, EPOLL_CTL_MOD, eh->socket, &ev) < 0) {
+        err_write("event_rearm: epoll_ctl error: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void idle_list_remove(struct acceptor_t* acc, struct thread_args_t* th_args)
+{
+    if (th_args->prev)
+        th_args->prev->next = th_args->next;
+    else
+        acc->idle_head = th_args->next;
+    if (th_args->next)
+        th_args->next->prev = th_args->prev;
+    else
+        acc->idle_tail = th_args->prev;
+    th_args->prev = th_args->next = NULL;
+}
+
+/* キープアライブ中のソケットにデータが到着したイベント */
+static int on_keep_alive_ready(struct event_handler_t* eh, unsigned int events)
+{
+    struct thread_args_t* th_args;
+    struct acceptor_t* acc;
+
+    th_args = (struct thread_args_t*)eh->data;
+    acc = th_args->acceptor;
+
+    CS_START(&acc->idle_list_lock);
+    idle_list_remove(acc, th_args);
+    CS_END(&acc->idle_list_lock);
+
+    if (events & EPOLLIN) {
+        /* ワーカースレッドにリクエストを処理させます。*/
+        if (request_queue_push(acc, th_args) < 0) {
+            SOCKET_CLOSE(th_args->client_socket);
+            thread_args_free(th_args);
+        }
+    } else {
+        /* クライアントから切断されました。*/
+        SOCKET_CLOSE(th_args->client_socket);
+        thread_args_free(th_args);
+    }
+    return 0;
+}
+
+/*
+ * キープアライブ中のソケットをイベントループに戻します。
+ * 次のリクエストが到着するまでワーカースレッドを占有しません。
+ *
+ * 戻り値
+ *  正常に終了した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int keep_alive_park(struct thread_args_t* th_args)
+{
+    unsigned int events = EPOLLIN|EPOLLRDHUP|EPOLLET|EPOLLONESHOT;
+    struct acceptor_t* acc;
+    int result;
+
+    acc = th_args->acceptor;
+    th_args->idle_time = system_time();
+    th_args->handler.socket = th_args->client_socket;
+    th_args->handler.callback = on_keep_alive_ready;
+    th_args->handler.data = th_args;
+
+    /* イベント通知より先にアイドルリストへ追加しておきます。*/
+    CS_START(&acc->idle_list_lock);
+    th_args->next = NULL;
+    th_args->prev = acc->idle_tail;
+    if (acc->idle_tail)
+        acc->idle_tail->next = th_args;
+    else
+        acc->idle_head = th_args;
+    acc->idle_tail = th_args;
+    CS_END(&acc->idle_list_lock);
+
+    if (th_args->event_flag) {
+        result = event_rearm(acc, &th_args->handler, events);
+    } else {
+        result = event_add(acc, &th_args->handler, events);
+        if (result == 0)
+            th_args->event_flag = 1;
+    }
+    if (result < 0) {
+        CS_START(&acc->idle_list_lock);
+        idle_list_remove(acc, th_args);
+        CS_END(&acc->idle_list_lock);
+    }
+    return result;
+}
+
+/*
+ * keep_alive_timeout 秒を経過したアイドル中のソケットをクローズします。
+ * close_all がゼロ以外の場合はすべてクローズします。
+ */
+static void keep_alive_expire(struct acceptor_t* acc, int close_all)
+{
+    int64 limit_time;
+
+    limit_time = system_time() - (int64)g_conf->keep_alive_timeout * 1000000L;
+    CS_START(&acc->idle_list_lock);
+    while (acc->idle_head != NULL) {
+        struct thread_args_t* th_args;
+
+        th_args = acc->idle_head;
+        if (! close_all && th_args->idle_time > limit_time)
+            break;
+        idle_list_remove(acc, th_args);
+        /* クローズするとepollの監視対象からも外れます。*/
+        SOCKET_CLOSE(th_args->client_socket);
+        thread_args_free(th_args);
+    }
+    CS_END(&acc->idle_list_lock);
+}
+#endif
+
 /* スレッドをあらかじめプールしておいて空いているスレッドに
    処理を割り当てるボス・ワーカー方式 */
 static void http_thread(void* argv)
 {
     struct worker_thread_info_t* th_info;
+    struct acceptor_t* acc;
     struct thread_args_t* th_args;
     SOCKET socket;
     struct in_addr addr;
@@ -291,88 +561,44 @@ static void http_thread(void* argv)
     int status = HTTP_OK;
     int content_size;
     int keep_alive_mode = 0;
-    int keep_alive_requests;
-    int timeout_end_flag = 0;
-
-#ifdef _WIN32
-    int timeout = INFINITE;
-#elif defined(MAC_OSX)
-    int timeout = -1;
-    struct timeval tv;
-    struct timespec ts;
-#else
+    int park_flag;
     int timeout = -1;
-    struct timespec ts;
-#endif
 
     th_info = (struct worker_thread_info_t*)argv;
+    acc = th_info->acceptor;
 
 #if 0
     if (g_conf->min_worker_threads != g_conf->max_worker_threads) {
         if (th_info->thread_no > g_conf->min_worker_threads) {
-            /* タイムアウト（秒）時間を算出します。*/
-            timeout = g_conf->worker_thread_check_interval;
-#ifdef _WIN32
-            /* windowsはミリ秒になります。*/
-            timeout *= 1000;
-#elif defined(MAC_OSX)
-            gettimeofday(&tv, NULL);
-            ts.tv_sec = tv.tv_sec + timeout;
-            ts.tv_nsec = tv.tv_usec * 1000;
-#else
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_sec += timeout;
-#endif
+            /* タイムアウト（ミリ秒）時間を算出します。*/
+            timeout = g_conf->worker_thread_check_interval * 1000;
         }
     }
 #endif
 
     while (! g_shutdown_flag) {
-#ifndef WIN32
-        pthread_mutex_lock(&queue_mutex);
-#endif
-        /* キューにデータが入るまで待機します。*/
         th_info->status = WORKER_THREAD_SLEEPING;
-        while (que_empty(g_queue)) {
-#ifdef WIN32
-            if (WaitForSingleObject(queue_cond, timeout) == WAIT_TIMEOUT) {
+
+        /* キューからデータを取り出します。
+           空の場合は他のアクセプターのキューを調べてから待機します。*/
+        th_args = (struct thread_args_t*)wq_pop(acc->queue);
+        if (th_args == NULL)
+            th_args = request_queue_steal(acc);
+        if (th_args == NULL) {
+            th_args = (struct thread_args_t*)wq_wait_pop(acc->queue, timeout);
+            if (th_args == NULL) {
                 /* タイムアウトで抜けてきた場合はスレッド終了を判定します。*/
-                if (is_timeout_thread(th_info)) {
-                    timeout_end_flag = 1;
+                if (timeout >= 0 && is_timeout_thread(th_info))
                     break;
-                }
-            }
-#else
-            if (timeout < 0) {
-                pthread_cond_wait(&queue_cond, &queue_mutex);
-            } else {
-                if (pthread_cond_timedwait(&queue_cond, &queue_mutex, &ts) == ETIMEDOUT) {
-                    if (is_timeout_thread(th_info)) {
-                        timeout_end_flag = 1;
-                        break;
-                    }
-                }
+                continue;
             }
-#endif
         }
-#ifndef WIN32
-        pthread_mutex_unlock(&queue_mutex);
-#endif
-
-        if (timeout_end_flag)
-            break;
-
-        /* キューからデータを取り出します。*/
-        th_args = (struct thread_args_t*)que_pop(g_queue);
-        if (th_args == NULL)
-            continue;
 
         addr = th_args->sockaddr.sin_addr;
         socket = th_args->client_socket;
 
         th_info->status = WORKER_THREAD_RUNNING;
-
-        keep_alive_requests = g_conf->keep_alive_requests;
+        park_flag = 0;
 
         do {
             keep_alive_mode = 0;
@@ -391,7 +617,7 @@ static void http_thread(void* argv)
                             th_info->command_flag = 1;
                             status = do_command(socket, req, &content_size);
                         } else {
-                            status = error_handler(socket, HTTP_NOTFOUND, &content_size);
+                            status = doc_status_send(socket, HTTP_NOTFOUND, 0, 0, &content_size);
                         }
                     } else {
                         char* val;
@@ -409,14 +635,14 @@ static void http_thread(void* argv)
                         status = request_proc(socket,
                                               req,
                                               addr,
-                                              (keep_alive_mode)? keep_alive_requests : 0,
+                                              (keep_alive_mode)? th_args->keep_alive_requests : 0,
                                               &content_size,
                                               &keep_alive_mode);
                     }
                 }
                 if (keep_alive_mode) {
-                    if (keep_alive_requests > 0)
-                        keep_alive_requests--;
+                    if (th_args->keep_alive_requests > 0)
+                        th_args->keep_alive_requests--;
                 }
             } else {
                 /* get_request() error */
@@ -438,20 +664,31 @@ static void http_thread(void* argv)
                 /* Keep-Alive が指定されていてリクエスト回数がリミットに達していない場合は
                    現在のソケットから次のリクエストを読み込みます。*/
                 if (keep_alive_mode) {
-                    if (keep_alive_requests <= 0)
+                    if (th_args->keep_alive_requests <= 0)
                         keep_alive_mode = 0;
 
                     if (keep_alive_mode) {
+#ifdef USE_EPOLL
+                        /* 次のリクエストはイベントループで待機します。
+                           データが到着すると再びキューイングされます。*/
+                        if (keep_alive_park(th_args) == 0)
+                            park_flag = 1;
+                        keep_alive_mode = 0;
+#else
                         /* 指定秒待ってデータが来ないようであればソケットをクローズします。*/
                         if (! wait_recv_data(socket, g_conf->keep_alive_timeout * 1000))
                             keep_alive_mode = 0;
+#endif
                     }
                 }
             }
         } while (keep_alive_mode);
 
+        if (park_flag)
+            continue;
+
         /* パラメータ領域の解放 */
-        free(th_args);
+        thread_args_free(th_args);
 
 #ifdef WIN32
         /* sleep(1ms)しないとベンチマークにてパフォーマンスが上がらないため(2008/11/13)。*/
@@ -488,13 +725,20 @@ static int get_empty_worker_thread()
     return -1;
 }
 
-static void worker_thread_create(int index)
+static void worker_thread_create(int index, struct acceptor_t* acc)
 {
 #ifdef _WIN32
     uintptr_t thread_id;
-    thread_id = _beginthread(http_thread, 0, &g_worker_thread_tbl[index]);
 #else
     pthread_t thread_id;
+#endif
+
+    /* リクエストを受け取るアクセプターを設定します。*/
+    g_worker_thread_tbl[index].acceptor = acc;
+
+#ifdef _WIN32
+    thread_id = _beginthread(http_thread, 0, &g_worker_thread_tbl[index]);
+#else
     pthread_create(&thread_id, NULL, (void*)http_thread, &g_worker_thread_tbl[index]);
     /* スレッドの使用していた領域を終了時に自動的に解放します。*/
     pthread_detach(thread_id);
@@ -504,88 +748,320 @@ static void worker_thread_create(int index)
     g_worker_thread_tbl[index].status = WORKER_THREAD_SLEEPING;
 }
 
-static void worker_thread_extend()
+static void worker_thread_extend(struct acceptor_t* acc)
 {
     int index;
 
     CS_START(&worker_thread_info_lock);
     index = get_empty_worker_thread();
     if (index >= 0) {
-        worker_thread_create(index);
+        worker_thread_create(index, acc);
         g_conf->worker_threads++;
     }
     CS_END(&worker_thread_info_lock);
 }
 
-static int request_http()
+/*
+ * クライアントからの接続を受け付けます。
+ * epoll を使用する場合はリスニングソケットがノンブロッキングのため
+ * 待機中の接続がなければ INVALID_SOCKET を返します。
+ */
+static SOCKET accept_client(struct acceptor_t* acc, struct sockaddr_in* sockaddr)
 {
-    struct sockaddr_in sockaddr;
-    int n;
+    socklen_t n;
     SOCKET client_socket;
-    struct thread_args_t* th_args;
 
-    n = sizeof(struct sockaddr);
-    client_socket = accept(g_listen_socket, (struct sockaddr*)&sockaddr, (socklen_t*)&n);
-    if (client_socket < 0)
-        return 0;
-    if (g_shutdown_flag) {
-        SOCKET_CLOSE(client_socket);
-        return -1;
+    for (;;) {
+        n = sizeof(struct sockaddr_in);
+#ifdef USE_EPOLL
+        client_socket = accept4(acc->listen_socket, (struct sockaddr*)sockaddr, &n, SOCK_CLOEXEC);
+#else
+        client_socket = accept(acc->listen_socket, (struct sockaddr*)sockaddr, &n);
+#endif
+        if (client_socket != INVALID_SOCKET)
+            break;
+        /* 接続待ちの間にクライアントが切断した場合は次の接続を受け付けます。*/
+        if (errno != EINTR && errno != ECONNABORTED)
+            break;
     }
+    return client_socket;
+}
 
-    /* スレッドへ渡す情報を作成します */
-    th_args = (struct thread_args_t*)malloc(sizeof(struct thread_args_t));
-    if (th_args == NULL) {
-        err_log(sockaddr.sin_addr, "No memory.");
-        SOCKET_CLOSE(client_socket);
-        return 0;
-    }
-    th_args->client_socket = client_socket;
-    th_args->sockaddr = sockaddr;
+/*
+ * 待機中の接続を ACCEPT_BATCH_COUNT 件まで続けて受け付けます。
+ * 残りの接続はレベルトリガーのため次のイベントで通知されます。
+ */
+static int request_http(struct acceptor_t* acc)
+{
+    int i;
 
-    /* リクエストされた情報をキューイング(push)します。*/
-    que_push(g_queue, th_args);
+    for (i = 0; i < ACCEPT_BATCH_COUNT; i++) {
+        struct sockaddr_in sockaddr;
+        SOCKET client_socket;
+        struct thread_args_t* th_args;
 
-    /* キューイングされたことをスレッドへ通知します。*/
-#ifdef WIN32
-    SetEvent(queue_cond);
-#else
-    pthread_mutex_lock(&queue_mutex);
-    pthread_cond_signal(&queue_cond);
-    pthread_mutex_unlock(&queue_mutex);
-#endif
+        client_socket = accept_client(acc, &sockaddr);
+        if (client_socket == INVALID_SOCKET)
+            break;
+        if (g_shutdown_flag) {
+            SOCKET_CLOSE(client_socket);
+            return -1;
+        }
+
+        /* スレッドへ渡す情報を作成します */
+        th_args = thread_args_alloc(acc);
+        if (th_args == NULL) {
+            err_log(sockaddr.sin_addr, "No memory.");
+            SOCKET_CLOSE(client_socket);
+            break;
+        }
+        th_args->client_socket = client_socket;
+        th_args->sockaddr = sockaddr;
+        th_args->acceptor = acc;
+        th_args->keep_alive_requests = g_conf->keep_alive_requests;
+        th_args->event_flag = 0;
+        th_args->prev = th_args->next = NULL;
+
+        if (request_queue_push(acc, th_args) < 0) {
+            SOCKET_CLOSE(client_socket);
+            thread_args_free(th_args);
+            break;
+        }
+
+        if (g_conf->worker_threads < g_conf->max_worker_threads) {
+            if (! wq_empty(acc->queue)) {
+                /* ワーカースレッドに拡張性があり、
+                キューにデータがある場合はワーカースレッドを増やします。*/
+                worker_thread_extend(acc);
+            }
+        }
+    }
     return 0;
 }
 
-static int do_http_event()
+static int do_http_event(struct acceptor_t* acc)
 {
     /* HTTPクライアントからの接続を受付 */
-    if (g_conf->worker_threads < g_conf->max_worker_threads) {
-        if (! que_empty(g_queue)) {
-            /* ワーカースレッドに拡張性があり、
-            キューにデータがある場合はワーカースレッドを増やします。*/
-            worker_thread_extend();
+    return request_http(acc);
+}
+
+/*
+ * HTTPのリスニングソケットを作成します。
+ * 複数のアクセプターを使用する場合は SO_REUSEPORT を設定して
+ * 同じポートをアクセプター毎のソケットで待ち受けます。
+ *
+ * 戻り値
+ *  ソケットを返します。
+ *  エラーの場合は INVALID_SOCKET を返します。
+ */
+SOCKET socket_listen(ulong addr, ushort port, int backlog, struct sockaddr_in* sockaddr)
+{
+    SOCKET listen_socket;
+    int sockopt = 1;
+
+    if (g_conf->acceptor_threads < 2)
+        return sock_listen(addr, port, backlog, sockaddr);
+
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket == INVALID_SOCKET) {
+        err_write("socket_listen: can't open socket: %s", strerror(errno));
+        return INVALID_SOCKET;
+    }
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&sockopt, sizeof(sockopt));
+#ifdef SO_REUSEPORT
+    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, (const char*)&sockopt, sizeof(sockopt)) < 0) {
+        err_write("socket_listen: SO_REUSEPORT error: %s", strerror(errno));
+        SOCKET_CLOSE(listen_socket);
+        return INVALID_SOCKET;
+    }
+#endif
+
+    memset(sockaddr, 0, sizeof(struct sockaddr_in));
+    sockaddr->sin_family = AF_INET;
+    sockaddr->sin_addr.s_addr = htonl(addr);
+    sockaddr->sin_port = htons(port);
+    if (bind(listen_socket, (struct sockaddr*)sockaddr, sizeof(struct sockaddr_in)) < 0) {
+        err_write("socket_listen: bind error: %s", strerror(errno));
+        SOCKET_CLOSE(listen_socket);
+        return INVALID_SOCKET;
+    }
+    if (listen(listen_socket, backlog) < 0) {
+        err_write("socket_listen: listen error: %s", strerror(errno));
+        SOCKET_CLOSE(listen_socket);
+        return INVALID_SOCKET;
+    }
+    return listen_socket;
+}
+
+#ifdef USE_EPOLL
+/* リスニングソケットのイベント */
+static int on_http_listen(struct event_handler_t* eh, unsigned int events)
+{
+    return do_http_event((struct acceptor_t*)eh->data);
+}
+
+static int on_session_relay_listen(struct event_handler_t* eh, unsigned int events)
+{
+    return request_session_relay();
+}
+
+/*
+ * 監視しているソケットが読み込み可能になるとハンドラーを呼び出します。
+ * ハンドラーが -1 を返すかシャットダウンモードになるとループを抜けます。
+ */
+static void event_loop(struct acceptor_t* acc)
+{
+    struct epoll_event events[EVENT_MAX_COUNT];
+
+    while (! g_shutdown_flag) {
+        int n;
+        int i;
+
+        n = epoll_wait(acc->event_fd, events, EVENT_MAX_COUNT, EVENT_WAIT_TIMEOUT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            err_write("event_loop: epoll_wait error: %s", strerror(errno));
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            struct event_handler_t* eh;
+
+            eh = (struct event_handler_t*)events[i].data.ptr;
+            if ((*eh->callback)(eh, events[i].events) < 0)
+                return;
         }
+
+        /* タイムアウトしたキープアライブのソケットをクローズします。*/
+        keep_alive_expire(acc, 0);
     }
-    return request_http();
+}
+
+static void acceptor_event_server(struct acceptor_t* acc)
+{
+    struct event_handler_t listen_eh;
+    struct event_handler_t srelay_eh;
+
+    acc->event_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (acc->event_fd < 0) {
+        err_write("http_server: epoll_create error: %s", strerror(errno));
+        return;
+    }
+
+    /* リスニングソケットはノンブロッキングにして
+       レベルトリガーで監視します。*/
+    fcntl(acc->listen_socket, F_SETFL, fcntl(acc->listen_socket, F_GETFL) | O_NONBLOCK);
+    listen_eh.socket = acc->listen_socket;
+    listen_eh.callback = on_http_listen;
+    listen_eh.data = acc;
+    if (event_add(acc, &listen_eh, EPOLLIN) < 0)
+        goto final;
+
+    /* セッション・リレーはメインスレッドのアクセプターで受け付けます。*/
+    if (acc->acceptor_no == 0 && g_session_relay_socket != INVALID_SOCKET) {
+        srelay_eh.socket = g_session_relay_socket;
+        srelay_eh.callback = on_session_relay_listen;
+        srelay_eh.data = NULL;
+        if (event_add(acc, &srelay_eh, EPOLLIN) < 0)
+            goto final;
+    }
+
+    event_loop(acc);
+
+final:
+    /* アイドル中のキープアライブのソケットをすべてクローズします。*/
+    keep_alive_expire(acc, 1);
+    close(acc->event_fd);
+    acc->event_fd = -1;
+}
+
+/* メインスレッド以外のアクセプター */
+static void acceptor_thread(void* argv)
+{
+    struct acceptor_t* acc;
+
+    acc = (struct acceptor_t*)argv;
+    acceptor_event_server(acc);
+
+    shutdown(acc->listen_socket, 2);  /* 2: RDWR stop */
+    SOCKET_CLOSE(acc->listen_socket);
+}
+#else
+static int do_default_http_event()
+{
+    return do_http_event(&acceptor_tbl[0]);
 }
 
 static int is_shutdown()
 {
     return g_shutdown_flag;
 }
+#endif
+
+static int acceptor_initialize(struct acceptor_t* acc, int acceptor_no)
+{
+    acc->acceptor_no = acceptor_no;
+    if (acceptor_no == 0) {
+        acc->listen_socket = g_listen_socket;
+        acc->queue = g_queue;
+    } else {
+        struct sockaddr_in sockaddr;
+
+        acc->listen_socket = socket_listen(INADDR_ANY,
+                                           g_conf->port_no,
+                                           g_conf->backlog,
+                                           &sockaddr);
+        if (acc->listen_socket == INVALID_SOCKET)
+            return -1;
+        acc->queue = wq_initialize(REQUEST_QUEUE_SIZE);
+        if (acc->queue == NULL) {
+            SOCKET_CLOSE(acc->listen_socket);
+            return -1;
+        }
+    }
+
+    acc->args_pool = wq_initialize(THREAD_ARGS_POOL_SIZE);
+    if (acc->args_pool == NULL) {
+        if (acceptor_no != 0) {
+            wq_finalize(acc->queue);
+            SOCKET_CLOSE(acc->listen_socket);
+        }
+        return -1;
+    }
+
+#ifdef USE_EPOLL
+    acc->event_fd = -1;
+    acc->idle_head = acc->idle_tail = NULL;
+    CS_INIT(&acc->idle_list_lock);
+#endif
+    return 0;
+}
+
+static void acceptor_finalize(struct acceptor_t* acc)
+{
+    /* 待機中のワーカースレッドを起床させます。
+       キューはワーカースレッドが参照しているため解放しません。*/
+    wq_wakeup_all(acc->queue);
+}
 
 void http_server()
 {
     int i;
     struct sockaddr_in sockaddr;
     char ip_addr[256];
+#ifndef USE_EPOLL
     int sc = 1;
     SOCKET sockets[2];
     SOCK_EVENT_CB cbfuncs[2];
+#endif
 
     g_http_start_time = system_time();
 
+#ifndef USE_EPOLL
+    /* 複数のアクセプターは epoll が使用できる環境のみ有効です。*/
+    g_conf->acceptor_threads = 1;
+#endif
+
     CS_INIT(&worker_thread_info_lock);
     if (is_session_relay()) {
         /* セッション・リレー用のワーカースレッドを起動します。*/
@@ -594,52 +1070,67 @@ void http_server()
     }
 
     /* HTTPリスニングソケットの作成 */
-    g_listen_socket = sock_listen(INADDR_ANY,
-                                  g_conf->port_no,
-                                  g_conf->backlog,
-                                  &sockaddr);
+    g_listen_socket = socket_listen(INADDR_ANY,
+                                    g_conf->port_no,
+                                    g_conf->backlog,
+                                    &sockaddr);
     if (g_listen_socket == INVALID_SOCKET)
         return;  /* error */
 
+    /* アクセプターの初期化 */
+    acceptor_tbl = (struct acceptor_t*)calloc(g_conf->acceptor_threads,
+                                              sizeof(struct acceptor_t));
+    if (acceptor_tbl == NULL) {
+        err_write("http_server: no memory.");
+        return;
+    }
+    for (i = 0; i < g_conf->acceptor_threads; i++) {
+        if (acceptor_initialize(&acceptor_tbl[i], i) < 0) {
+            err_write("http_server: acceptor(%d) initialize error.", i);
+            g_conf->acceptor_threads = i;
+            break;
+        }
+    }
+
     /* 自分自身の IPアドレスを取得します。*/
     sock_local_addr(ip_addr);
 
     /* スターティングメッセージの表示 */
-    TRACE("http port: %d on %s listening ... %d threads\n\n",
-        g_conf->port_no, ip_addr, g_conf->worker_threads);
-
-    /* キューイング制御の初期化 */
-#ifdef WIN32
-    queue_cond = CreateEvent(NULL, FALSE, FALSE, NULL);
-#else
-    pthread_mutex_init(&queue_mutex, NULL);
-    pthread_cond_init(&queue_cond, NULL);
-#endif
+    TRACE("http port: %d on %s listening ... %d threads, %d acceptors\n\n",
+        g_conf->port_no, ip_addr, g_conf->worker_threads, g_conf->acceptor_threads);
 
     /* ワーカースレッドを生成します。 */
     for (i = 0; i < g_conf->worker_threads; i++) {
         /* スレッドを作成します。
            生成されたスレッドはリクエストキューが空のため、
-           待機状態に入ります。*/
-        worker_thread_create(i);
+           待機状態に入ります。
+           ワーカースレッドはアクセプター毎のグループに分けます。*/
+        worker_thread_create(i, &acceptor_tbl[i % g_conf->acceptor_threads]);
     }
 
+#ifdef USE_EPOLL
+    /* メインスレッド以外のアクセプターを起動します。*/
+    for (i = 1; i < g_conf->acceptor_threads; i++) {
+        pthread_t thread_id;
+
+        pthread_create(&thread_id, NULL, (void*)acceptor_thread, &acceptor_tbl[i]);
+        pthread_detach(thread_id);
+    }
+    acceptor_event_server(&acceptor_tbl[0]);
+#else
     sockets[0] = g_listen_socket;
-    cbfuncs[0] = do_http_event;
+    cbfuncs[0] = do_default_http_event;
     if (g_session_relay_socket != INVALID_SOCKET) {
         sockets[1] = g_session_relay_socket;
         cbfuncs[1] = request_session_relay;
         sc++;
     }
     sock_event(sc, sockets, cbfuncs, is_shutdown);
-
-#ifdef WIN32
-    CloseHandle(queue_cond);
-#else
-    pthread_cond_destroy(&queue_cond);
-    pthread_mutex_destroy(&queue_mutex);
 #endif
 
+    for (i = 0; i < g_conf->acceptor_threads; i++)
+        acceptor_finalize(&acceptor_tbl[i]);
+
     if (is_session_relay())
         session_relay_close();
 
@@ -36,6 +36,7 @@
 #define DEFAULT_WORKER_THREAD_CHECK_INTERVAL 1800 /* thread check interval(30 min) */
 #define DEFAULT_KEEP_ALIVE_TIMEOUT 3     /* keep-alive timeout seconds */
 #define DEFAULT_KEEP_ALIVE_REQUESTS 5    /* keep-alive max requests */
+#define DEFAULT_ACCEPTOR_THREADS 1       /* acceptor threads number */
 
 #define DEFAULT_SESSION_RELAY_PORT 9080         /* session relay listen port */
 #define DEFAULT_SESSION_RELAY_BACKLOG 5         /* session relay listen backlog number */
@@ -43,10 +44,220 @@
 #define DEFAULT_SESSION_RELAY_CHECK_INTERVAL 300 /* session relay server check interval(5 min) */
 #define ZONE_CAPACITY 20
 
+#define REQUEST_QUEUE_SIZE 4096             /* request queue capacity(per acceptor) */
+#define SESSION_RELAY_QUEUE_SIZE 256        /* session relay queue capacity */
+#define THREAD_ARGS_POOL_SIZE 1024          /* free thread_args_t pool capacity(per acceptor) */
+#define DEFAULT_DOC_CACHE_ENTRIES 1000      /* max static document cache entries(open files) */
+#define DEFAULT_DOC_CACHE_VALID 60          /* static document stat() revalidation interval(sec) */
+#define DEFAULT_DOC_MISSING_ENTRIES 1024    /* max cached nonexistent paths(negative cache) */
+#define DOC_MISSING_LOG_RATE 10             /* not found error logs per second */
+#define DEFAULT_DOC_WATCH_FLAG 1            /* watch document root changes(Linux only) */
+#define DEFAULT_GZIP_FLAG 1                 /* gzip content negotiation(zlib only) */
+#define DEFAULT_FILE_CACHE_POLICY "tinylfu" /* file cache admission/eviction policy */
+#define DEFAULT_FILE_CACHE_MAX_OBJECT (1024*1024L) /* max cacheable file size(bytes) */
+#define DEFAULT_FILE_CACHE_MMAP 0           /* file cache entries reference mmap */
+#define DEFAULT_FILE_CACHE_ARENA 0          /* file cache bodies in preallocated arena */
+#define DEFAULT_FILE_CACHE_HUGEPAGE 0       /* arena on MAP_HUGETLB pages */
+#define DEFAULT_CACHE_WARM_THREADS 4        /* file cache warming threads */
+#define CACHE_WARM_MAX_URIS 65536           /* max distinct URIs counted from access log */
+#define DEFAULT_STREAM_THRESHOLD (16*1024*1024L) /* stream larger files(bytes) */
+#define DOC_STREAM_CHUNK (4*1024*1024)      /* streaming send/fadvise unit(bytes) */
+#define GZIP_MIN_SIZE 256                   /* smallest document compressed on the fly */
+#define DOC_MAX_RANGES 16                   /* max byte ranges per request(Range) */
+#define DOC_HEADER_SIZE 1024                /* response header buffer size */
+#define CLOCK_DATE_SIZE 64                  /* Date header string buffer size */
+#define DEFAULT_ACCESS_LOG_BUFFER (256*1024) /* per-thread access log buffer(bytes) */
+#define ROUTE_MAX_CAPTURES 8                /* max wildcard captures per route */
+
+#ifndef HTTP_PARTIAL_CONTENT
+#define HTTP_PARTIAL_CONTENT 206
+#endif
+#ifndef HTTP_RANGE_NOT_SATISFIABLE
+#define HTTP_RANGE_NOT_SATISFIABLE 416
+#endif
+
+/* atomic operations(lock-free queues, caches and counters) */
+#ifdef _WIN32
+/* 32/64 bit integers use Interlocked functions, volatile access is acquire/release(/volatile:ms).
+   pointers use ATOMIC_XXX_PTR. */
+#define ATOMIC_LOAD(p)          ((sizeof(*(p)) == 8)? *(volatile LONG64*)(p) : (LONG64)*(volatile LONG*)(p))
+#define ATOMIC_LOAD_RELAXED(p)  ATOMIC_LOAD(p)
+#define ATOMIC_STORE(p, v)      ((sizeof(*(p)) == 8)? (void)(*(volatile LONG64*)(p) = (LONG64)(v)) \
+                                                    : (void)(*(volatile LONG*)(p) = (LONG)(v)))
+#define ATOMIC_CAS(p, e, v)     ((sizeof(*(p)) == 8)? atomic_cas64((volatile LONG64*)(p), (LONG64*)(e), (LONG64)(v)) \
+                                                    : atomic_cas32((volatile LONG*)(p), (LONG*)(e), (LONG)(v)))
+#define ATOMIC_EXCHANGE(p, v)   ((sizeof(*(p)) == 8)? InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v)) \
+                                                    : (LONG64)InterlockedExchange((volatile LONG*)(p), (LONG)(v)))
+#define ATOMIC_FETCH_ADD(p, v)  ((sizeof(*(p)) == 8)? InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v)) \
+                                                    : (LONG64)InterlockedExchangeAdd((volatile LONG*)(p), (LONG)(v)))
+#define ATOMIC_ADD(p, v)        (ATOMIC_FETCH_ADD(p, v) + (v))
+#define ATOMIC_SUB(p, v)        (ATOMIC_FETCH_ADD(p, -(v)) - (v))
+#define ATOMIC_FENCE()          MemoryBarrier()
+#define ATOMIC_LOAD_PTR(p)      (*(void* volatile*)(p))
+#define ATOMIC_STORE_PTR(p, v)  (*(void* volatile*)(p) = (void*)(v))
+#define ATOMIC_CAS_PTR(p, e, v) atomic_cas_ptr((void* volatile*)(p), (void**)(e), (void*)(v))
+
+static __inline int atomic_cas32(volatile LONG* p, LONG* expected, LONG value)
+{
+    LONG prev = InterlockedCompareExchange(p, value, *expected);
+    if (prev == *expected)
+        return 1;
+    *expected = prev;
+    return 0;
+}
+
+static __inline int atomic_cas64(volatile LONG64* p, LONG64* expected, LONG64 value)
+{
+    LONG64 prev = InterlockedCompareExchange64(p, value, *expected);
+    if (prev == *expected)
+        return 1;
+    *expected = prev;
+    return 0;
+}
+
+static __inline int atomic_cas_ptr(void* volatile* p, void** expected, void* value)
+{
+    void* prev = InterlockedCompareExchangePointer(p, value, *expected);
+    if (prev == *expected)
+        return 1;
+    *expected = prev;
+    return 0;
+}
+#else
+#define ATOMIC_LOAD(p)          __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define ATOMIC_LOAD_RELAXED(p)  __atomic_load_n(p, __ATOMIC_RELAXED)
+#define ATOMIC_STORE(p, v)      __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ATOMIC_CAS(p, e, v)     __atomic_compare_exchange_n(p, e, v, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define ATOMIC_EXCHANGE(p, v)   __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#define ATOMIC_FETCH_ADD(p, v)  __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST)
+#define ATOMIC_ADD(p, v)        __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST)
+#define ATOMIC_SUB(p, v)        __atomic_sub_fetch(p, v, __ATOMIC_SEQ_CST)
+#define ATOMIC_FENCE()          __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define ATOMIC_LOAD_PTR(p)      ATOMIC_LOAD(p)
+#define ATOMIC_STORE_PTR(p, v)  ATOMIC_STORE(p, v)
+#define ATOMIC_CAS_PTR(p, e, v) ATOMIC_CAS(p, e, v)
+#endif
+
+/* static document content-coding(doc_cache.c variant key) */
+#define DOC_ENCODING_IDENTITY 0
+#define DOC_ENCODING_GZIP 1
+
+/* document bundle file(bundle.c, nesta_pack) */
+#define BUNDLE_MAGIC "NESTABD1"
+#define BUNDLE_VERSION 1
+#define BUNDLE_ALIGN 16                     /* body alignment in bundle */
+
+/* event handler(epoll) */
+struct event_handler_t {
+    SOCKET socket;                      /* watch socket */
+    int (*callback)(struct event_handler_t*, unsigned int); /* ready callback */
+    void* data;                         /* callback data */
+};
+
+/* precomposed response header fields(static document) */
+struct doc_header_t {
+    time_t mtime;                       /* file modified time */
+    int64 size;                         /* file size */
+    int64 content_length;               /* body size(compressed size if gzip) */
+    int encoding;                       /* DOC_ENCODING_XXX */
+    int compressible;                   /* text type(gzip candidate) */
+    int precompressed;                  /* body is sibling "path.gz" file */
+    time_t last_modified;               /* Last-Modified(original file) */
+    char modify_date[CLOCK_DATE_SIZE];  /* Last-Modified(GMT) */
+    char etag[64];                      /* strong ETag(quoted) */
+    int fields_size;                    /* length of fields */
+    int type_offset;                    /* offset of Content-Type line */
+    int length_offset;                  /* offset of Content-Length line */
+    int length_end;                     /* end of Content-Length line */
+    char fields[512];                   /* Server ... Last-Modified, Vary */
+};
+
+/* opened static document(doc_cache.c reference) */
+struct doc_file_t {
+    void* entry;                        /* cache entry(NULL is not cached) */
+    int fd;                             /* file descriptor(-1 is not opened) */
+    int fd_owner;                       /* doc_send() closes fd */
+    unsigned int generation;            /* doc_cache_generation() before stat() */
+    struct doc_header_t header;         /* header fields */
+};
+
+/* document bundle file header(all offsets are from top of file) */
+struct bundle_header_t {
+    char magic[8];                      /* BUNDLE_MAGIC */
+    unsigned int version;               /* BUNDLE_VERSION */
+    unsigned int count;                 /* number of entries */
+    int64 index_offset;                 /* entry table(sorted by path) */
+    int64 strings_offset;               /* string table('\0' terminated) */
+    int64 strings_size;                 /* string table size */
+    int64 file_size;                    /* bundle file size */
+    int64 build_time;                   /* packed time */
+};
+
+/* document bundle entry */
+struct bundle_entry_t {
+    unsigned int path;                  /* path(string table offset, no leading '/') */
+    unsigned int type;                  /* MIME/type(string table offset) */
+    unsigned int etag;                  /* strong ETag(string table offset) */
+    unsigned int reserved;
+    int64 mtime;                        /* file modified time */
+    int64 offset;                       /* body offset */
+    int64 size;                         /* body size */
+    int64 gz_offset;                    /* gzip body offset */
+    int64 gz_size;                      /* gzip body size(0 is none) */
+};
+
+/* document bundle lookup result(points into the mapped bundle) */
+struct bundle_file_t {
+    int index;                          /* entry index */
+    const char* path;
+    const char* type;
+    const char* etag;
+    time_t mtime;
+    const char* data;                   /* body */
+    int64 size;
+    const char* gz_data;                /* gzip body(NULL is none) */
+    int64 gz_size;
+};
+
+/* file cache statistics(body_cache.c) */
+struct bc_stats_t {
+    const char* policy;                 /* policy name */
+    int64 max_size;                     /* cache size(bytes) */
+    int64 bytes;                        /* cached bytes */
+    int64 pinned_bytes;                 /* pinned bytes */
+    int entries;                        /* cached files */
+    int64 hits;                         /* bc_get() hit count */
+    int64 misses;                       /* bc_get() miss count */
+    int64 inserts;                      /* bc_set() count */
+    int64 evictions;                    /* evicted by policy */
+    int64 rejects;                      /* not admitted by policy */
+    int64 coalesced;                    /* misses served by other thread's load */
+    int64 wait_timeouts;                /* gave up waiting other thread's load */
+    int64 mapped_bytes;                 /* cached bytes referencing mmap */
+    int64 arena_size;                   /* arena size(0 is not arena) */
+    int64 arena_used;                   /* allocated arena chunks */
+    int arena_hugepage;                 /* arena on MAP_HUGETLB */
+};
+
+/* wildcard route match(captured path segments) */
+struct route_match_t {
+    int count;                          /* number of captures */
+    int rest_flag;                      /* last capture is trailing '*' */
+    char* capture[ROUTE_MAX_CAPTURES];  /* pointers into path */
+    char path[MAX_CONTENT_NAME+1];      /* copy of content name */
+};
+
 /* http thread argument */
 struct thread_args_t {
     SOCKET client_socket;
     struct sockaddr_in sockaddr;
+    struct acceptor_t* acceptor;        /* accepted acceptor */
+    int keep_alive_requests;            /* remaining keep-alive requests */
+    int64 idle_time;                    /* keep-alive idle start time(micro seconds) */
+    int event_flag;                     /* registered to event loop */
+    struct event_handler_t handler;     /* keep-alive event handler */
+    struct thread_args_t* prev;         /* keep-alive idle list */
+    struct thread_args_t* next;
 };
 
 /* http worker thread status */
@@ -61,6 +272,7 @@ struct worker_thread_info_t {
     int command_flag;                   /* executing command flag */
     unsigned long count;                /* request count */
     int64 last_access;                  /* last access time(micro seconds) */
+    struct acceptor_t* acceptor;        /* request queue owner */
 };
 
 /* program configuration */
@@ -69,6 +281,7 @@ struct http_conf_t {
     char username[256];                 /* execute as username(Linux/MacOSX only) */
     ushort port_no;                     /* listen port number */
     int backlog;                        /* listen backlog number */
+    int acceptor_threads;               /* acceptor thread number(SO_REUSEPORT) */
     int worker_threads;                 /* worker thread number */
     int extend_worker_threads;          /* extend worker thread number */
     int min_worker_threads;             /* min worker thread number(not parameter) */
@@ -78,9 +291,28 @@ struct http_conf_t {
     int keep_alive_timeout;             /* keep-alive timeout seconds */
     int keep_alive_requests;            /* max keep-alive requests */
     char document_root[MAX_PATH+1];     /* document root */
+    char mime_types_file[MAX_PATH+1];   /* mime.types file name */
     char access_log_fname[MAX_PATH+1];  /* access log file name */
     int daily_log_flag;                 /* daily access log */
+    int access_log_buffer;              /* per-thread log buffer(0 is synchronous) */
     long file_cache_size;               /* file cache size(bytes) */
+    char file_cache_policy[16];         /* file cache policy(tinylfu or lru) */
+    long file_cache_max_object;         /* max cacheable file size(bytes) */
+    char file_cache_pin[1024];          /* pinned paths(comma separated) */
+    int file_cache_mmap;                /* cache mmap references instead of copies */
+    int file_cache_arena;               /* store bodies in preallocated arena */
+    int file_cache_hugepage;            /* arena on MAP_HUGETLB pages */
+    long stream_threshold;              /* never cached, streamed file size(bytes) */
+    char document_bundle[MAX_PATH+1];   /* document bundle file(nesta_pack) */
+    char cache_warm_manifest[MAX_PATH+1]; /* file cache warming list */
+    char cache_warm_glob[1024];         /* file cache warming patterns(comma separated) */
+    int cache_warm_log;                 /* warm top-N URIs of previous access log */
+    int cache_warm_threads;             /* file cache warming threads */
+    int doc_cache_entries;              /* max static document cache entries */
+    int doc_cache_valid;                /* static document revalidation interval(sec) */
+    int doc_missing_entries;            /* max cached nonexistent paths */
+    int doc_watch_flag;                 /* watch document root(inotify) */
+    int gzip_flag;                      /* gzip content negotiation */
     char error_file[MAX_PATH+1];        /* error file name */
     char output_file[MAX_PATH+1];       /* output file name */
     int api_count;                      /* count of request hook APIs */
@@ -148,17 +380,22 @@ int g_trace_mode;           /* not zero is trace mode */
 #ifndef _MAIN
     extern
 #endif
-struct file_cache_t* g_file_cache;  /* file cache */
+struct body_cache_t* g_file_cache;  /* file cache */
+
+#ifndef _MAIN
+    extern
+#endif
+struct bundle_t* g_bundle;  /* document bundle(NULL is document_root) */
 
 #ifndef _MAIN
     extern
 #endif
-struct queue_t* g_queue;  /* HTTP request queue */
+struct wqueue_t* g_queue;  /* HTTP request queue */
 
 #ifndef _MAIN
     extern
 #endif
-struct queue_t* g_session_relay_queue;  /* session relay request command queue */
+struct wqueue_t* g_session_relay_queue;  /* session relay request command queue */
 
 #ifndef _MAIN
     extern
@@ -194,9 +431,106 @@ void dyn_unload(void);
 void http_server(void);
 SOCKET socket_listen(ulong addr, ushort port, int backlog, struct sockaddr_in* sockaddr);
 
+/* wqueue.c */
+struct wqueue_t* wq_initialize(int capacity);
+void wq_finalize(struct wqueue_t* wq);
+int wq_push(struct wqueue_t* wq, void* data);
+void* wq_pop(struct wqueue_t* wq);
+void* wq_wait_pop(struct wqueue_t* wq, int timeout_ms);
+void wq_wakeup_all(struct wqueue_t* wq);
+int wq_empty(struct wqueue_t* wq);
+
 /* document.c */
+int doc_initialize(void);
+void doc_finalize(void);
+int doc_status_send(SOCKET socket, int status, int keep_alive_timeout, int keep_alive_requests, int* content_size);
 int check_file(const char* request_file);
 int doc_send(SOCKET socket, struct in_addr addr, const char* root, const char* file_name, struct http_header_t* hdr, int keep_alive_timeout, int keep_alive_requests, int* res_size);
+int64 doc_preload(const char* root, const char* file_name);
+
+/* bundle.c */
+struct bundle_t* bundle_open(const char* fname);
+void bundle_close(struct bundle_t* b);
+int bundle_count(struct bundle_t* b);
+int bundle_find(struct bundle_t* b, const char* path, struct bundle_file_t* bf);
+struct doc_header_t* bundle_get_header(struct bundle_t* b, int index, int encoding);
+struct doc_header_t* bundle_set_header(struct bundle_t* b, int index, int encoding, struct doc_header_t* dh);
+
+/* cache_warm.c */
+int cache_warm(void);
+
+/* output.c */
+int out_cork(SOCKET socket, int on);
+int out_send_more(SOCKET socket, const char* buf, int size);
+int out_send_header_body(SOCKET socket, const char* header, int header_size, const char* body, int body_size);
+
+/* route.c */
+int route_initialize(void);
+void route_finalize(void);
+struct hook_api_t* route_lookup(const char* content_name, struct route_match_t* match);
+void route_set_current(struct request_t* req, struct route_match_t* match);
+int get_route_param_count(struct request_t* req);
+const char* get_route_param(struct request_t* req, int index);
+
+/* mime.c */
+int mime_initialize(const char* fname);
+void mime_finalize(void);
+const char* mime_type(const char* ext);
+
+/* arena.c */
+struct arena_t* arena_initialize(int64 size, int max_chunk, int hugepage);
+void arena_finalize(struct arena_t* ar);
+int arena_chunk_size(struct arena_t* ar, int size);
+int arena_max_size(struct arena_t* ar);
+void* arena_alloc(struct arena_t* ar, int size);
+int arena_contains(struct arena_t* ar, const void* p);
+int arena_slab(struct arena_t* ar, const void* p);
+void arena_free(struct arena_t* ar, void* p);
+int arena_stats(struct arena_t* ar, int64* size, int64* used);
+
+/* body_cache.c */
+struct body_cache_t* bc_initialize(int64 max_size,
+                                   int64 max_object_size,
+                                   const char* policy,
+                                   const char* root,
+                                   const char* pins,
+                                   int arena,
+                                   int hugepage);
+void bc_finalize(struct body_cache_t* bc);
+int bc_cacheable(struct body_cache_t* bc, int64 size);
+char* bc_get(struct body_cache_t* bc, const char* key, time_t mtime, int size, void** ref);
+void bc_release(struct body_cache_t* bc, void* ref);
+char* bc_get_single(struct body_cache_t* bc, const char* key, time_t mtime, int size, void** ref, void** flight);
+int bc_load_end(struct body_cache_t* bc, void* flight, const char* data);
+int bc_set_map(struct body_cache_t* bc, const char* key, time_t mtime, struct mmap_t* map, void* flight, void** ref);
+int bc_set(struct body_cache_t* bc, const char* key, time_t mtime, int size, const char* data);
+void bc_remove(struct body_cache_t* bc, const char* key);
+void bc_remove_dir(struct body_cache_t* bc, const char* dir);
+void bc_stats(struct body_cache_t* bc, struct bc_stats_t* st);
+
+/* doc_cache.c */
+int doc_cache_initialize(int max_entries, int valid_time, int missing_entries);
+void doc_cache_finalize(void);
+int doc_cache_get(const char* path, int encoding, struct doc_file_t* df);
+unsigned int doc_cache_generation(void);
+int doc_cache_revalidate(const char* path, int encoding, time_t mtime, int64 size, unsigned int generation, struct doc_file_t* df);
+int doc_cache_set(const char* path, int encoding, const struct doc_header_t* dh, int fd, unsigned int generation, struct doc_file_t* df);
+void doc_cache_release(struct doc_file_t* df);
+void doc_cache_set_valid(int valid_time);
+void doc_cache_invalidate(const char* path);
+void doc_cache_invalidate_dir(const char* dir);
+int doc_cache_is_missing(const char* path);
+void doc_cache_set_missing(const char* path);
+
+/* doc_watch.c */
+int doc_watch_initialize(const char* root);
+void doc_watch_finalize(void);
+
+/* clock.c */
+int clock_initialize(void);
+void clock_finalize(void);
+int clock_date(char* buf);
+time_t clock_time(void);
 
 /* command.c */
 void stop_server(void);
@@ -204,9 +538,10 @@ void status_server(void);
 void trace_mode_server(const char* mode);
 
 /* log.c */
-void log_initialize(const char* fname, int daily_flag);
+void log_initialize(const char* fname, int daily_flag, int buffer_size);
 void log_write(struct request_t* req, int status, int content_size);
 void log_finalize(void);
+int log_previous_fname(char* buf, int bufsize);
 
 /* srelay_server.c */
 int session_relay_server(void);
@@ -29,6 +29,10 @@
 #include "http_server.h"
 #include <time.h>
 
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
 /*
  * OUTPUT FORMAT:
  *   ipaddr [DATE TIME] "method uri protocol" status content-length times(us)
@@ -39,7 +43,40 @@
  * LOG FILE NAME:
  * non daily:  basename.extname
  * daily mode: basename_YYYY-MM-DD.extname
+ *
+ * バッファサイズを指定した場合、ワーカースレッドはログをスレッドごとの
+ * リングバッファに追加するだけで、ファイルには書き込みません。
+ * ログ出力スレッドが一定間隔ですべてのバッファをまとめて writev() で書き込み、
+ * 日毎のファイルの切り替えも行ないます。
+ * バッファが一杯の場合はリクエストを待たせずにそのログを破棄して件数を記録します。
+ * 日時はクロックスレッドの現在時刻(clock_time)をスレッドごとに変換して使用します。
  */
+#define LOG_RECORD_SIZE 1024        /* max record length */
+#define LOG_FLUSH_MSEC 100          /* log writer interval(ms) */
+#define LOG_MAX_IOV 64              /* buffers per writev() */
+
+#ifdef _WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/* スレッドごとのリングバッファ(単一の書き込み側と読み込み側) */
+struct log_buffer_t {
+    char* data;
+    unsigned int mask;                  /* size - 1 */
+    volatile unsigned int head;         /* written to file(log writer) */
+    volatile unsigned int tail;         /* appended(worker thread) */
+    volatile int dropped;               /* records dropped by full buffer */
+    struct log_buffer_t* next;
+};
+
+/* スレッドごとに変換した日時 */
+struct log_time_t {
+    time_t sec;
+    struct tm tm;
+};
+
 static int log_daily_flag = 0;  // daily is 1.
 static char log_cur_date[20];   // yyyy-mm-dd
 static char log_basename[MAX_PATH+1];
@@ -49,6 +86,20 @@ static int log_fd = -1;
 
 static CS_DEF(log_critical_section);
 
+/* 非同期出力 */
+static int log_buffer_size = 0;         // 0 is synchronous write.
+static struct log_buffer_t* log_buffers = NULL;
+static volatile int log_shutdown_flag = 0;
+static int log_async = 0;
+#ifdef _WIN32
+static HANDLE log_thread_handle;
+#else
+static pthread_t log_thread_id;
+#endif
+
+static THREAD_LOCAL struct log_buffer_t* log_thread_buffer = NULL;
+static THREAD_LOCAL struct log_time_t log_thread_time;
+
 static void log_open()
 {
     char file_name[MAX_PATH+1];
@@ -86,7 +137,222 @@ static char* set_cur_date(char* dt, int dt_size)
     return dt;
 }
 
-void log_initialize(const char* fname, int daily_flag)
+/* 日付が変わった場合はファイルを新しい日付で作成し直します。*/
+static void log_rotate(struct tm* now)
+{
+    char date_buf[20];
+
+    snprintf(date_buf, sizeof(date_buf), "%d-%02d-%02d",
+             now->tm_year+1900, now->tm_mon+1, now->tm_mday);
+    if (strcmp(log_cur_date, date_buf)) {
+        log_close();
+        strcpy(log_cur_date, date_buf);
+        log_open();
+    }
+}
+
+/* 現在時刻をスレッドごとに変換します。秒が変わった場合だけ変換します。*/
+static struct tm* log_localtime(void)
+{
+    time_t now;
+
+    now = clock_time();
+    if (now == 0)
+        time(&now);   /* クロックが開始されていません。*/
+    if (now != log_thread_time.sec) {
+        mt_localtime(&now, &log_thread_time.tm);
+        log_thread_time.sec = now;
+    }
+    return &log_thread_time.tm;
+}
+
+#ifdef _WIN32
+/* ファイルにすべて書き込みます。*/
+static void write_all(int fd, const char* data, int size)
+{
+    while (size > 0) {
+        int n;
+
+        n = FILE_WRITE(fd, data, size);
+        if (n <= 0)
+            break;
+        data += n;
+        size -= n;
+    }
+}
+#else
+/* 複数の領域を writev() でまとめて書き込みます。*/
+static void write_iov(int fd, struct iovec* vp, int vcnt)
+{
+    while (vcnt > 0) {
+        ssize_t n;
+
+        n = writev(fd, vp, vcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        /* 書き込めた分だけ iovec を進めます。*/
+        while (n > 0) {
+            if ((size_t)n >= vp->iov_len) {
+                n -= vp->iov_len;
+                vp++;
+                vcnt--;
+            } else {
+                vp->iov_base = (char*)vp->iov_base + n;
+                vp->iov_len -= n;
+                n = 0;
+            }
+        }
+        while (vcnt > 0 && vp->iov_len == 0) {
+            vp++;
+            vcnt--;
+        }
+    }
+}
+#endif
+
+/*
+ * すべてのスレッドのバッファをファイルに書き込みます。
+ * ログ出力スレッド(終了時は log_finalize)だけが呼び出します。
+ */
+static void log_flush()
+{
+    struct log_buffer_t* b;
+    int dropped = 0;
+#ifndef _WIN32
+    struct iovec iov[LOG_MAX_IOV];
+    struct log_buffer_t* vbuf[LOG_MAX_IOV];
+    unsigned int vtail[LOG_MAX_IOV];
+    int vcnt = 0;
+    int bcnt = 0;
+    int i;
+#endif
+
+    /* バッファは追加されるだけなので先頭を取得してからたどります。*/
+    CS_START(&log_critical_section);
+    b = log_buffers;
+    CS_END(&log_critical_section);
+
+    if (log_daily_flag) {
+        time_t now;
+        struct tm tm;
+
+        now = clock_time();
+        if (now == 0)
+            time(&now);
+        mt_localtime(&now, &tm);
+        log_rotate(&tm);
+    }
+
+    for (; b != NULL; b = b->next) {
+        unsigned int head;
+        unsigned int tail;
+        unsigned int pos;
+        unsigned int len;
+
+        dropped += (int)ATOMIC_EXCHANGE(&b->dropped, 0);
+        head = b->head;
+        tail = (unsigned int)ATOMIC_LOAD(&b->tail);
+        if (head == tail)
+            continue;
+        pos = head & b->mask;
+        len = tail - head;
+#ifdef _WIN32
+        if (pos + len > b->mask + 1) {
+            write_all(log_fd, b->data + pos, b->mask + 1 - pos);
+            write_all(log_fd, b->data, len - (b->mask + 1 - pos));
+        } else {
+            write_all(log_fd, b->data + pos, len);
+        }
+        ATOMIC_STORE(&b->head, tail);
+#else
+        /* リングバッファの末尾で折り返している場合は２つの領域になります。*/
+        if (pos + len > b->mask + 1) {
+            iov[vcnt].iov_base = b->data + pos;
+            iov[vcnt++].iov_len = b->mask + 1 - pos;
+            iov[vcnt].iov_base = b->data;
+            iov[vcnt++].iov_len = len - (b->mask + 1 - pos);
+        } else {
+            iov[vcnt].iov_base = b->data + pos;
+            iov[vcnt++].iov_len = len;
+        }
+        vbuf[bcnt] = b;
+        vtail[bcnt++] = tail;
+        if (vcnt > LOG_MAX_IOV - 2) {
+            write_iov(log_fd, iov, vcnt);
+            for (i = 0; i < bcnt; i++)
+                ATOMIC_STORE(&vbuf[i]->head, vtail[i]);
+            vcnt = 0;
+            bcnt = 0;
+        }
+#endif
+    }
+#ifndef _WIN32
+    if (vcnt > 0) {
+        write_iov(log_fd, iov, vcnt);
+        for (i = 0; i < bcnt; i++)
+            ATOMIC_STORE(&vbuf[i]->head, vtail[i]);
+    }
+#endif
+    if (dropped > 0)
+        err_write("access log: %d records dropped(buffer full).", dropped);
+}
+
+#ifdef _WIN32
+static unsigned __stdcall log_thread(void* argv)
+#else
+static void* log_thread(void* argv)
+#endif
+{
+    while (! ATOMIC_LOAD(&log_shutdown_flag)) {
+#ifdef _WIN32
+        Sleep(LOG_FLUSH_MSEC);
+#else
+        usleep(LOG_FLUSH_MSEC * 1000);
+#endif
+        log_flush();
+    }
+#ifdef _WIN32
+    _endthreadex(0);
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+/* 呼び出したスレッドのバッファを作成して登録します。*/
+static struct log_buffer_t* log_thread_buffer_new()
+{
+    struct log_buffer_t* b;
+
+    b = (struct log_buffer_t*)calloc(1, sizeof(struct log_buffer_t));
+    if (b == NULL)
+        return NULL;
+    b->data = (char*)malloc(log_buffer_size);
+    if (b->data == NULL) {
+        free(b);
+        return NULL;
+    }
+    b->mask = log_buffer_size - 1;
+
+    CS_START(&log_critical_section);
+    b->next = log_buffers;
+    log_buffers = b;
+    CS_END(&log_critical_section);
+    return b;
+}
+
+/*
+ * アクセスログを初期化します。
+ *
+ * fname: ログファイル名(NULL または空の場合は出力しません)
+ * daily_flag: 日毎のファイルにする場合は 1
+ * buffer_size: スレッドごとのバッファサイズ(バイト、２のべき乗に切り上げ)
+ *              ゼロの場合はリクエストごとに書き込みます。
+ */
+void log_initialize(const char* fname, int daily_flag, int buffer_size)
 {
     if (fname != NULL && *fname != '\0') {
         log_daily_flag = daily_flag;
@@ -110,10 +376,73 @@ void log_initialize(const char* fname, int daily_flag)
     }
     /* クリティカルセクションの初期化 */
     CS_INIT(&log_critical_section);
+
+    if (log_fd >= 0 && buffer_size > 0) {
+        log_buffer_size = LOG_RECORD_SIZE * 2;
+        while (log_buffer_size < buffer_size)
+            log_buffer_size <<= 1;
+        log_shutdown_flag = 0;
+#ifdef _WIN32
+        log_thread_handle = (HANDLE)_beginthreadex(NULL, 0, log_thread, NULL, 0, NULL);
+        if (log_thread_handle == 0)
+            err_write("log_initialize: can't create thread, write synchronously.");
+        else
+            log_async = 1;
+#else
+        if (pthread_create(&log_thread_id, NULL, log_thread, NULL) != 0)
+            err_write("log_initialize: can't create thread, write synchronously: %s", strerror(errno));
+        else
+            log_async = 1;
+#endif
+    }
+}
+
+/*
+ * 前日のアクセスログのファイル名を取得します。
+ * 日毎のログでない場合は現在のログファイル名になります。
+ *
+ * 戻り値
+ *  取得できた場合はゼロを返します。
+ *  アクセスログを出力していない場合は -1 を返します。
+ */
+int log_previous_fname(char* buf, int bufsize)
+{
+    time_t timebuf;
+    struct tm yesterday;
+
+    if (log_basename[0] == '\0')
+        return -1;
+    if (! log_daily_flag) {
+        snprintf(buf, bufsize, "%s", log_basename);
+        return 0;
+    }
+    time(&timebuf);
+    timebuf -= 24 * 60 * 60;
+    mt_localtime(&timebuf, &yesterday);
+    snprintf(buf, bufsize, "%s_%d-%02d-%02d%s", log_basename,
+             yesterday.tm_year+1900, yesterday.tm_mon+1, yesterday.tm_mday,
+             log_extname);
+    return 0;
 }
 
 void log_finalize()
 {
+    /* ログ出力スレッドを終了して残りを書き込みます。
+       終了時はワーカースレッドがまだ追加している場合があるため、
+       バッファは解放せずに以降のログはバッファに残したままにします(書き込みません)。*/
+    if (log_async) {
+        ATOMIC_STORE(&log_shutdown_flag, 1);
+#ifdef _WIN32
+        WaitForSingleObject(log_thread_handle, INFINITE);
+        CloseHandle(log_thread_handle);
+#else
+        pthread_join(log_thread_id, NULL);
+#endif
+        log_flush();
+        log_close();
+        return;
+    }
+
     /* ファイルクローズ */
     log_close();
 
@@ -121,11 +450,42 @@ void log_finalize()
     CS_DELETE(&log_critical_section);
 }
 
+/* スレッドのバッファにログを追加します。一杯の場合は破棄します。*/
+static void log_append(const char* record, int len)
+{
+    struct log_buffer_t* b;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int pos;
+    unsigned int first;
+
+    b = log_thread_buffer;
+    if (b == NULL) {
+        b = log_thread_buffer_new();
+        if (b == NULL)
+            return;
+        log_thread_buffer = b;
+    }
+    head = (unsigned int)ATOMIC_LOAD(&b->head);
+    tail = b->tail;
+    if ((unsigned int)len > b->mask + 1 - (tail - head)) {
+        ATOMIC_ADD(&b->dropped, 1);
+        return;
+    }
+    pos = tail & b->mask;
+    first = b->mask + 1 - pos;
+    if ((unsigned int)len <= first) {
+        memcpy(b->data + pos, record, len);
+    } else {
+        memcpy(b->data + pos, record, first);
+        memcpy(b->data, record + first, len - first);
+    }
+    ATOMIC_STORE(&b->tail, tail + len);
+}
+
 void log_write(struct request_t* req, int status, int content_len)
 {
-    char date_buf[20];
-    time_t timebuf;
-    struct tm now;
+    struct tm* now;
     char* user_agent = "-";
     char* method = "-";
     char* uri = "-";
@@ -133,7 +493,8 @@ void log_write(struct request_t* req, int status, int content_len)
     char* remote_ip_addr;
     char ip_addr[256];
     int lap_time;
-    char outbuf[1024];
+    char outbuf[LOG_RECORD_SIZE];
+    int len;
 
     if (log_fd < 0)
         return; 
@@ -141,23 +502,7 @@ void log_write(struct request_t* req, int status, int content_len)
         return; 
 
     /* 現在時刻の取得 */
-    time(&timebuf);
-    mt_localtime(&timebuf, &now);
-
-    /* クリティカルセクションの開始 */
-    CS_START(&log_critical_section);
-
-    if (log_daily_flag) {
-        snprintf(date_buf, sizeof(date_buf), "%d-%02d-%02d",
-                 now.tm_year+1900, now.tm_mon+1, now.tm_mday);
-
-        if (strcmp(log_cur_date, date_buf)) {
-            /* ファイルを新しい日付で作成し直します。*/
-            log_close();
-            strcpy(log_cur_date, date_buf);
-            log_open();
-        }
-    }
+    now = log_localtime();
 
     user_agent = get_http_header(&req->header, "user-agent");
     method = req->method;
@@ -191,14 +536,30 @@ void log_write(struct request_t* req, int status, int content_len)
     /* リクエスト処理時間(usec) */
     lap_time = (int)(system_time() - req->start_time);
 
-    /* ログの出力 */
-    snprintf(outbuf, sizeof(outbuf), "%s [%d/%02d/%02d %02d:%02d:%02d] \"%s %s %s\" \"%s\" %d %d %d\n",
-             ip_addr,
-             now.tm_year+1900, now.tm_mon+1, now.tm_mday,
-             now.tm_hour, now.tm_min, now.tm_sec,
-             method, uri, protocol, user_agent,
-             status, content_len, lap_time);
-    FILE_WRITE(log_fd, outbuf, strlen(outbuf));
+    /* ログの編集 */
+    len = snprintf(outbuf, sizeof(outbuf), "%s [%d/%02d/%02d %02d:%02d:%02d] \"%s %s %s\" \"%s\" %d %d %d\n",
+                   ip_addr,
+                   now->tm_year+1900, now->tm_mon+1, now->tm_mday,
+                   now->tm_hour, now->tm_min, now->tm_sec,
+                   method, uri, protocol, user_agent,
+                   status, content_len, lap_time);
+    if (len >= (int)sizeof(outbuf)) {
+        /* 切り詰めた場合も改行で終わらせます。*/
+        len = sizeof(outbuf) - 1;
+        outbuf[len-1] = '\n';
+    }
+
+    if (log_async) {
+        log_append(outbuf, len);
+        return;
+    }
+
+    /* クリティカルセクションの開始 */
+    CS_START(&log_critical_section);
+
+    if (log_daily_flag)
+        log_rotate(now);
+    FILE_WRITE(log_fd, outbuf, len);
 
     /* クリティカルセクションの終了 */
     CS_END(&log_critical_section);
@@ -116,6 +116,8 @@ static void cleanup()
             }
         }
         dyn_unload();
+        if (action == ACT_START)
+            route_finalize();
 
         if (action == ACT_START) {
             int zone_c;
@@ -144,18 +146,29 @@ static void cleanup()
             vect_finalize(g_conf->zone_table);
             log_finalize();
             TRACE("%s terminated.\n", "log");
+            doc_watch_finalize();
+            doc_finalize();
+            TRACE("%s terminated.\n", "document cache");
+            if (g_bundle != NULL) {
+                bundle_close(g_bundle);
+                TRACE("%s terminated.\n", "document bundle");
+            }
+            mime_finalize();
+            TRACE("%s terminated.\n", "mime types");
+            clock_finalize();
+            TRACE("%s terminated.\n", "clock");
             if (g_file_cache != NULL) {
-                fc_finalize(g_file_cache);
+                bc_finalize(g_file_cache);
                 TRACE("%s terminated.\n", "file cache");
             }
             if (g_session_relay_queue != NULL) {
-                que_finalize(g_session_relay_queue);
+                wq_finalize(g_session_relay_queue);
                 TRACE("%s terminated.\n", "session relay queue");
             }
             if (g_worker_thread_tbl != NULL) {
                 free(g_worker_thread_tbl);
             }
-            que_finalize(g_queue);
+            wq_finalize(g_queue);
             TRACE("%s terminated.\n", "request queue");
         }
         logout_finalize();
@@ -214,7 +227,7 @@ static int startup()
         int i;
 
         /* HTTPリクエスト・キューの初期化 */
-        g_queue = que_initialize();
+        g_queue = wq_initialize(REQUEST_QUEUE_SIZE);
         if (g_queue == NULL)
             return -1;
         TRACE("%s initialized.\n", "request queue");
@@ -233,7 +246,7 @@ static int startup()
 
         /* セッション・リレー・キューの初期化 */
         if (is_session_relay()) {
-            g_session_relay_queue = que_initialize();
+            g_session_relay_queue = wq_initialize(SESSION_RELAY_QUEUE_SIZE);
             if (g_session_relay_queue == NULL)
                 return -1;
             TRACE("%s initialized.\n", "session relay queue");
@@ -241,15 +254,55 @@ static int startup()
 
         /* ファイルキャッシュの初期化 */
         if (g_conf->file_cache_size > 0) {
-            g_file_cache = fc_initialize(g_conf->file_cache_size);
+            g_file_cache = bc_initialize(g_conf->file_cache_size,
+                                         g_conf->file_cache_max_object,
+                                         g_conf->file_cache_policy,
+                                         g_conf->document_root,
+                                         g_conf->file_cache_pin,
+                                         g_conf->file_cache_arena,
+                                         g_conf->file_cache_hugepage);
             if (g_file_cache) {
-                TRACE("file cache initialized(%ld bytes).\n", g_conf->file_cache_size);
+                TRACE("file cache initialized(%ld bytes, %s).\n",
+                      g_conf->file_cache_size, g_conf->file_cache_policy);
             }
         }
 
         /* アクセスログの初期化 */
-        log_initialize(g_conf->access_log_fname, g_conf->daily_log_flag);
+        log_initialize(g_conf->access_log_fname, g_conf->daily_log_flag, g_conf->access_log_buffer);
         TRACE("%s initialized.\n", "log");
+
+        /* Date ヘッダーのクロックを初期化 */
+        if (clock_initialize() < 0)
+            return -1;
+        TRACE("%s initialized.\n", "clock");
+
+        /* MIME タイプの初期化 */
+        if (mime_initialize(g_conf->mime_types_file) < 0)
+            return -1;
+        TRACE("%s initialized.\n", "mime types");
+
+        /* ドキュメントキャッシュの初期化 */
+        if (doc_initialize() < 0)
+            return -1;
+        TRACE("%s initialized.\n", "document cache");
+
+        /* ドキュメントバンドルをオープンします。*/
+        if (*g_conf->document_bundle != '\0') {
+            g_bundle = bundle_open(g_conf->document_bundle);
+            if (g_bundle == NULL)
+                return -1;
+            TRACE("document bundle initialized(%d files).\n", bundle_count(g_bundle));
+        }
+
+        /* ドキュメントルートの監視を開始します。*/
+        if (g_conf->doc_watch_flag && *g_conf->document_root != '\0' && g_bundle == NULL) {
+            if (doc_watch_initialize(g_conf->document_root) == 0)
+                TRACE("%s initialized.\n", "document watch");
+        }
+
+        /* リクエストを受け付ける前にファイルキャッシュを準備します。*/
+        if (g_file_cache != NULL && g_bundle == NULL)
+            cache_warm();
     }
 
     /* セッションリレーの初期化を行ないます。*/
@@ -318,6 +371,13 @@ static int startup()
         }
     }
 
+    /* API のルーティングテーブルを作成します。*/
+    if (action == ACT_START) {
+        if (route_initialize() < 0)
+            return -1;
+        TRACE("%s initialized(%d APIs).\n", "route table", g_conf->api_count);
+    }
+
     /* 初期化 API の呼び出し */
     if (action == ACT_START) {
         if (g_conf->init_api_count > 0) {
@@ -389,6 +449,9 @@ static int parse_config()
     /* デフォルトのbacklogを設定します。*/
     g_conf->backlog = DEFAULT_BACKLOG;
 
+    /* デフォルトのacceptor_threadsを設定します。*/
+    g_conf->acceptor_threads = DEFAULT_ACCEPTOR_THREADS;
+
     /* デフォルトのworker_threadsを設定します。*/
     g_conf->worker_threads = DEFAULT_WORKER_THREADS;
 
@@ -399,6 +462,23 @@ static int parse_config()
     g_conf->keep_alive_timeout = DEFAULT_KEEP_ALIVE_TIMEOUT;
     g_conf->keep_alive_requests = DEFAULT_KEEP_ALIVE_REQUESTS;
 
+    /* デフォルトのドキュメントキャッシュを設定します。*/
+    g_conf->doc_cache_entries = DEFAULT_DOC_CACHE_ENTRIES;
+    g_conf->doc_cache_valid = DEFAULT_DOC_CACHE_VALID;
+    g_conf->doc_missing_entries = DEFAULT_DOC_MISSING_ENTRIES;
+    g_conf->doc_watch_flag = DEFAULT_DOC_WATCH_FLAG;
+    g_conf->gzip_flag = DEFAULT_GZIP_FLAG;
+    g_conf->access_log_buffer = DEFAULT_ACCESS_LOG_BUFFER;
+
+    /* デフォルトのファイルキャッシュを設定します。*/
+    strcpy(g_conf->file_cache_policy, DEFAULT_FILE_CACHE_POLICY);
+    g_conf->file_cache_max_object = DEFAULT_FILE_CACHE_MAX_OBJECT;
+    g_conf->file_cache_mmap = DEFAULT_FILE_CACHE_MMAP;
+    g_conf->file_cache_arena = DEFAULT_FILE_CACHE_ARENA;
+    g_conf->file_cache_hugepage = DEFAULT_FILE_CACHE_HUGEPAGE;
+    g_conf->stream_threshold = DEFAULT_STREAM_THRESHOLD;
+    g_conf->cache_warm_threads = DEFAULT_CACHE_WARM_THREADS;
+
     /* コンフィグファイル名がパラメータで指定されていない場合は
        デフォルトのファイル名を使用します。*/
     if (conf_file == NULL)
@@ -441,6 +521,12 @@ static int parse_config()
         g_conf->max_worker_threads = g_conf->worker_threads;
     }
 
+    /* アクセプター数の調整（各アクセプターに１つ以上のワーカースレッド）*/
+    if (g_conf->acceptor_threads < 1)
+        g_conf->acceptor_threads = 1;
+    if (g_conf->acceptor_threads > g_conf->worker_threads)
+        g_conf->acceptor_threads = g_conf->worker_threads;
+
     /* セッション・リレーが指定されている場合で
        パラメータに値が設定されていない場合は初期値を設定します。*/
     if (g_conf->session_relay_host[0]) {
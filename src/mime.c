@@ -0,0 +1,308 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2010 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "http_server.h"
+#include <ctype.h>
+
+/*
+ * 拡張子から MIME タイプを求めるレジストリです。
+ *
+ * 起動時に組み込みのテーブルと mime.types ファイルから
+ * オープンアドレス法のハッシュ表を作成します。
+ * 作成後は参照のみのためロックを使用しません。
+ * 拡張子は大文字・小文字を区別しません。
+ *
+ * mime.types の形式(Apache/nginx と同じ)
+ *   # comment
+ *   text/html  html htm
+ */
+#define MIME_EXT_SIZE 32        /* max extension length(include '\0') */
+#define MIME_LINE_SIZE 1024     /* mime.types line buffer size */
+
+struct mime_entry_t {
+    char* extension;            /* lower case */
+    char* type;
+};
+
+static struct mime_entry_t* mime_tbl;
+static unsigned int mime_mask;
+static int mime_count;
+
+/* 組み込みの MIME タイプ */
+static const char* builtin_mime_table[][2] = {
+    { "html", "text/html" },
+    { "htm", "text/html" },
+    { "hdml", "text/x-hdml" },
+    { "css", "text/css" },
+    { "txt", "text/plain" },
+    { "js", "application/javascript" },
+    { "xml", "application/xml" },
+    { "gif", "image/gif" },
+    { "jpe", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "jpg", "image/jpeg" },
+    { "png", "image/png" },
+    { "xbm", "image/x-bitmap" },
+    { "svg", "image/svg+xml" },
+    { "ico", "image/x-icon" },
+    { "webp", "image/webp" },
+    { "woff", "font/woff" },
+    { "woff2", "font/woff2" },
+    { "au", "audio/basic" },
+    { "snd", "audio/basic" },
+    { "wav", "audio/x-wav" },
+    { "aif", "audio/aiff" },
+    { "aiff", "audio/aiff" },
+    { "mp2", "audio/x-mpeg" },
+    { "mp3", "audio/mpeg" },
+    { "ram", "audio/x-pn-realaudio" },
+    { "rm", "audio/x-pn-realaudio" },
+    { "ra", "audio/x-pn-realaudio" },
+    { "qt", "video/quicktime" },
+    { "mov", "video/quicktime" },
+    { "mpeg", "video/mpeg" },
+    { "mpg", "video/mpeg" },
+    { "mpe", "video/mpeg" },
+    { "mp4", "video/mp4" },
+    { "avi", "video/x-msvideo" },
+    { "pdf", "application/vnd.pdf" },
+    { "fdf", "application/vnd.fdf" },
+    { "json", "text/plain" },
+    { "wasm", "application/wasm" },
+    { "zip", "application/zip" },
+    { NULL, NULL }
+};
+
+/* FNV-1a */
+static unsigned int mime_hash(const char* ext)
+{
+    unsigned int h = 2166136261U;
+
+    while (*ext) {
+        h ^= (unsigned char)*ext++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/* 拡張子を小文字に変換します。長すぎる場合は -1 を返します。*/
+static int mime_lower(char* dst, const char* ext)
+{
+    int i;
+
+    for (i = 0; ext[i] != '\0'; i++) {
+        if (i >= MIME_EXT_SIZE-1)
+            return -1;
+        dst[i] = (char)tolower((unsigned char)ext[i]);
+    }
+    dst[i] = '\0';
+    return 0;
+}
+
+static struct mime_entry_t* mime_slot(struct mime_entry_t* tbl,
+                                      unsigned int mask,
+                                      const char* ext)
+{
+    unsigned int i;
+
+    i = mime_hash(ext) & mask;
+    while (tbl[i].extension != NULL) {
+        if (strcmp(tbl[i].extension, ext) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return &tbl[i];
+}
+
+/* 使用率が 1/2 を超える場合はハッシュ表を２倍に拡張します。*/
+static int mime_expand()
+{
+    struct mime_entry_t* new_tbl;
+    unsigned int new_mask;
+    unsigned int i;
+
+    if ((unsigned int)(mime_count + 1) * 2 <= mime_mask + 1)
+        return 0;
+
+    new_mask = (mime_mask + 1) * 2 - 1;
+    new_tbl = (struct mime_entry_t*)calloc(new_mask + 1, sizeof(struct mime_entry_t));
+    if (new_tbl == NULL) {
+        err_write("mime: no memory.");
+        return -1;
+    }
+    for (i = 0; i <= mime_mask; i++) {
+        if (mime_tbl[i].extension != NULL)
+            *mime_slot(new_tbl, new_mask, mime_tbl[i].extension) = mime_tbl[i];
+    }
+    free(mime_tbl);
+    mime_tbl = new_tbl;
+    mime_mask = new_mask;
+    return 0;
+}
+
+/* 拡張子と MIME タイプを登録します。同じ拡張子は置き換えます。*/
+static int mime_put(const char* ext, const char* type)
+{
+    struct mime_entry_t* e;
+    char lower_ext[MIME_EXT_SIZE];
+    char* new_type;
+
+    if (mime_lower(lower_ext, ext) < 0)
+        return 0;   /* ignore */
+    if (mime_expand() < 0)
+        return -1;
+
+    new_type = strdup(type);
+    if (new_type == NULL) {
+        err_write("mime: no memory.");
+        return -1;
+    }
+    e = mime_slot(mime_tbl, mime_mask, lower_ext);
+    if (e->extension == NULL) {
+        e->extension = strdup(lower_ext);
+        if (e->extension == NULL) {
+            err_write("mime: no memory.");
+            free(new_type);
+            return -1;
+        }
+        mime_count++;
+    } else {
+        free(e->type);
+    }
+    e->type = new_type;
+    return 0;
+}
+
+/* mime.types ファイルを読み込みます。*/
+static int mime_load(const char* fname)
+{
+    FILE* fp;
+    char buf[MIME_LINE_SIZE];
+    int err = 0;
+
+    if ((fp = fopen(fname, "r")) == NULL) {
+        err_write("mime: file open error: %s", fname);
+        return -1;
+    }
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+        char* type;
+        char* ext;
+        int index;
+
+        /* コメントの排除 */
+        index = indexof(buf, '#');
+        if (index >= 0)
+            buf[index] = '\0';
+
+        type = strtok(buf, " \t\r\n");
+        if (type == NULL)
+            continue;
+        while ((ext = strtok(NULL, " \t\r\n;")) != NULL) {
+            if (mime_put(ext, type) < 0) {
+                err = -1;
+                break;
+            }
+        }
+        if (err < 0)
+            break;
+    }
+    fclose(fp);
+    return err;
+}
+
+/*
+ * MIME タイプのハッシュ表を作成します。
+ * 組み込みのテーブルを登録したあとに mime.types ファイルを読み込みます。
+ * ファイルで指定された拡張子は組み込みの内容よりも優先されます。
+ *
+ * fname: mime.types ファイル名(NULL または空文字の場合は組み込みのみ)
+ *
+ * 戻り値
+ *  正常に終了した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int mime_initialize(const char* fname)
+{
+    int i;
+
+    mime_mask = 63;
+    mime_count = 0;
+    mime_tbl = (struct mime_entry_t*)calloc(mime_mask + 1, sizeof(struct mime_entry_t));
+    if (mime_tbl == NULL) {
+        err_write("mime_initialize: no memory.");
+        return -1;
+    }
+    for (i = 0; builtin_mime_table[i][0] != NULL; i++) {
+        if (mime_put(builtin_mime_table[i][0], builtin_mime_table[i][1]) < 0)
+            return -1;
+    }
+    if (fname != NULL && *fname != '\0') {
+        if (mime_load(fname) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * MIME タイプのハッシュ表を解放します。
+ */
+void mime_finalize()
+{
+    unsigned int i;
+
+    if (mime_tbl == NULL)
+        return;
+    for (i = 0; i <= mime_mask; i++) {
+        if (mime_tbl[i].extension != NULL) {
+            free(mime_tbl[i].extension);
+            free(mime_tbl[i].type);
+        }
+    }
+    free(mime_tbl);
+    mime_tbl = NULL;
+}
+
+/*
+ * 拡張子から MIME タイプを求めます。
+ *
+ * ext: 拡張子('.'を含まない)
+ *
+ * 戻り値
+ *  MIME タイプの文字列を返します。
+ *  登録されていない場合は NULL を返します。
+ */
+const char* mime_type(const char* ext)
+{
+    struct mime_entry_t* e;
+    char lower_ext[MIME_EXT_SIZE];
+
+    if (mime_tbl == NULL || mime_lower(lower_ext, ext) < 0)
+        return NULL;
+    e = mime_slot(mime_tbl, mime_mask, lower_ext);
+    return e->type;
+}
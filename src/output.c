@@ -0,0 +1,167 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2010 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "http_server.h"
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#endif
+
+/*
+ * レスポンスの出力をまとめて送信する関数群です。
+ *
+ * ヘッダーとボディを別々に send() すると小さなレスポンスでも
+ * システムコールが２回になり、TCPセグメントも分かれてしまいます。
+ * ヘッダーはボディの先頭と一緒に writev() で送信するか、
+ * MSG_MORE/TCP_CORK で後続のデータと連結させます。
+ */
+
+/* writev() が使用できない環境でヘッダーとボディを連結して送信する最大サイズ */
+#define OUT_COALESCE_SIZE 8192
+
+/*
+ * ソケットの出力を保留(cork)します。
+ * on がゼロの場合は保留を解除して溜まっているデータを送信します。
+ * TCP_CORK(Linux)または TCP_NOPUSH(Mac OS X)が使用できない環境では何もしません。
+ *
+ * 戻り値
+ *  正常に終了した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int out_cork(SOCKET socket, int on)
+{
+#if defined(TCP_CORK)
+    return setsockopt(socket, IPPROTO_TCP, TCP_CORK, (const char*)&on, sizeof(on));
+#elif defined(TCP_NOPUSH)
+    return setsockopt(socket, IPPROTO_TCP, TCP_NOPUSH, (const char*)&on, sizeof(on));
+#else
+    return 0;
+#endif
+}
+
+/*
+ * 後続のデータがあることを通知してデータを送信します。
+ * データは次の送信と同じTCPセグメントにまとめられます。
+ * MSG_MORE が使用できない環境では send_data() で送信します。
+ *
+ * 戻り値
+ *  送信したバイト数を返します。
+ *  エラーの場合は -1 を返します。
+ */
+int out_send_more(SOCKET socket, const char* buf, int size)
+{
+#ifdef MSG_MORE
+    int sent = 0;
+
+    while (sent < size) {
+        ssize_t n;
+
+        n = send(socket, buf + sent, size - sent, MSG_MORE);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        sent += (int)n;
+    }
+    return sent;
+#else
+    return send_data(socket, buf, size);
+#endif
+}
+
+/*
+ * ヘッダーとボディを１回のシステムコールで送信します。
+ * 一部だけ送信された場合は残りを続けて送信します。
+ *
+ * 戻り値
+ *  送信したボディのバイト数を返します。
+ *  エラーの場合は -1 を返します。
+ */
+int out_send_header_body(SOCKET socket,
+                         const char* header,
+                         int header_size,
+                         const char* body,
+                         int body_size)
+{
+#ifndef _WIN32
+    struct iovec iov[2];
+    struct iovec* vp;
+    int vcnt;
+    int remain;
+
+    iov[0].iov_base = (void*)header;
+    iov[0].iov_len = header_size;
+    iov[1].iov_base = (void*)body;
+    iov[1].iov_len = body_size;
+    vp = iov;
+    vcnt = 2;
+    remain = header_size + body_size;
+
+    while (remain > 0) {
+        ssize_t n;
+
+        n = writev(socket, vp, vcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        remain -= (int)n;
+
+        /* 送信できた分だけ iovec を進めます。*/
+        while (n > 0) {
+            if ((size_t)n >= vp->iov_len) {
+                n -= vp->iov_len;
+                vp++;
+                vcnt--;
+            } else {
+                vp->iov_base = (char*)vp->iov_base + n;
+                vp->iov_len -= n;
+                n = 0;
+            }
+        }
+    }
+    return body_size;
+#else
+    if (header_size + body_size <= OUT_COALESCE_SIZE) {
+        char buf[OUT_COALESCE_SIZE];
+
+        /* 小さなレスポンスは連結して１回で送信します。*/
+        memcpy(buf, header, header_size);
+        memcpy(buf + header_size, body, body_size);
+        if (send_data(socket, buf, header_size + body_size) < 0)
+            return -1;
+        return body_size;
+    }
+    if (send_data(socket, header, header_size) < 0)
+        return -1;
+    return send_data(socket, body, body_size);
+#endif
+}
@@ -0,0 +1,375 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2010 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "http_server.h"
+
+/*
+ * API のルーティングテーブルです。
+ *
+ * dyn_api_load() で設定された g_conf->api_table を起動時に次の２つに変換します。
+ *
+ *   完全一致のルート: コンテンツ名をキーにしたハッシュ表(オープンアドレス法)
+ *   ワイルドカードのルート: '/' で区切ったセグメント単位のトライ木
+ *
+ * ワイルドカード '*' は１つのセグメントに一致します。
+ * パターンの最後の '*' は残りのすべてのセグメントに一致します。
+ * 例えば "samples/" に '*' を続けたパターンは samples/a と samples/a/b に一致し、
+ * "users/" '*' "/profile" のパターンは users/100/profile に一致します。
+ * '*' に一致したセグメントはキャプチャとして API から参照できます。
+ * 同じパスに一致する場合は完全一致、固定のセグメント、ワイルドカードの順に優先します。
+ */
+#ifdef _WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+struct route_node_t {
+    char* segment;                      /* NULL is wildcard */
+    struct hook_api_t* api;             /* route end(exact segments) */
+    struct hook_api_t* rest_api;        /* route end with trailing '*' */
+    struct route_node_t* child;         /* first child */
+    struct route_node_t* wildcard;      /* '*' child */
+    struct route_node_t* sibling;       /* next sibling */
+};
+
+static struct hook_api_t** route_tbl;   /* exact route hash table */
+static unsigned int route_mask;
+static struct route_node_t* route_root; /* wildcard route trie */
+
+/* API 実行中のルート(ワーカースレッド毎) */
+static THREAD_LOCAL struct request_t* current_req;
+static THREAD_LOCAL struct route_match_t* current_match;
+
+/* FNV-1a */
+static unsigned int route_hash(const char* name)
+{
+    unsigned int h = 2166136261U;
+
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static struct hook_api_t** route_slot(const char* name)
+{
+    unsigned int i;
+
+    i = route_hash(name) & route_mask;
+    while (route_tbl[i] != NULL) {
+        if (strcmp(route_tbl[i]->content_name, name) == 0)
+            break;
+        i = (i + 1) & route_mask;
+    }
+    return &route_tbl[i];
+}
+
+static struct route_node_t* route_node_new(const char* segment, int len)
+{
+    struct route_node_t* node;
+
+    node = (struct route_node_t*)calloc(1, sizeof(struct route_node_t));
+    if (node == NULL)
+        return NULL;
+    if (segment != NULL) {
+        node->segment = (char*)malloc(len + 1);
+        if (node->segment == NULL) {
+            free(node);
+            return NULL;
+        }
+        memcpy(node->segment, segment, len);
+        node->segment[len] = '\0';
+    }
+    return node;
+}
+
+static void route_node_free(struct route_node_t* node)
+{
+    while (node != NULL) {
+        struct route_node_t* next;
+
+        next = node->sibling;
+        route_node_free(node->child);
+        route_node_free(node->wildcard);
+        if (node->segment)
+            free(node->segment);
+        free(node);
+        node = next;
+    }
+}
+
+/* ワイルドカードを含むルートをトライ木に追加します。*/
+static int route_trie_add(struct hook_api_t* api)
+{
+    struct route_node_t* node;
+    const char* p;
+
+    node = route_root;
+    p = api->content_name;
+    for (;;) {
+        const char* end;
+        int len;
+        struct route_node_t* child;
+
+        end = strchr(p, '/');
+        len = (end != NULL)? (int)(end - p) : (int)strlen(p);
+
+        if (len == 1 && *p == '*') {
+            if (end == NULL) {
+                /* 最後の '*' は残りのセグメントすべてに一致します。*/
+                if (node->rest_api == NULL)
+                    node->rest_api = api;
+                return 0;
+            }
+            if (node->wildcard == NULL) {
+                node->wildcard = route_node_new(NULL, 0);
+                if (node->wildcard == NULL)
+                    return -1;
+            }
+            child = node->wildcard;
+        } else {
+            for (child = node->child; child != NULL; child = child->sibling) {
+                if ((int)strlen(child->segment) == len && memcmp(child->segment, p, len) == 0)
+                    break;
+            }
+            if (child == NULL) {
+                child = route_node_new(p, len);
+                if (child == NULL)
+                    return -1;
+                child->sibling = node->child;
+                node->child = child;
+            }
+        }
+        node = child;
+        if (end == NULL)
+            break;
+        p = end + 1;
+    }
+    if (node->api == NULL)
+        node->api = api;
+    return 0;
+}
+
+/* トライ木を検索します。固定のセグメントを優先してバックトラックします。*/
+static struct hook_api_t* route_trie_match(struct route_node_t* node,
+                                           char* path,
+                                           struct route_match_t* match)
+{
+    struct hook_api_t* api;
+    struct route_node_t* child;
+    char* end;
+    char* next;
+    int len;
+    int count;
+
+    if (path == NULL)
+        return node->api;
+
+    end = strchr(path, '/');
+    len = (end != NULL)? (int)(end - path) : (int)strlen(path);
+    next = (end != NULL)? end + 1 : NULL;
+    count = match->count;
+
+    for (child = node->child; child != NULL; child = child->sibling) {
+        if ((int)strlen(child->segment) == len && memcmp(child->segment, path, len) == 0) {
+            api = route_trie_match(child, next, match);
+            if (api != NULL)
+                return api;
+            break;
+        }
+    }
+    if (node->wildcard != NULL && len > 0 && count < ROUTE_MAX_CAPTURES) {
+        match->capture[count] = path;
+        match->count = count + 1;
+        api = route_trie_match(node->wildcard, next, match);
+        if (api != NULL)
+            return api;
+        match->count = count;
+    }
+    if (node->rest_api != NULL && *path != '\0' && count < ROUTE_MAX_CAPTURES) {
+        match->capture[count] = path;
+        match->count = count + 1;
+        match->rest_flag = 1;
+        return node->rest_api;
+    }
+    return NULL;
+}
+
+/*
+ * g_conf->api_table からルーティングテーブルを作成します。
+ * 同じコンテンツ名が複数ある場合は最初の API を使用します。
+ *
+ * 戻り値
+ *  正常に終了した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int route_initialize()
+{
+    unsigned int size = 16;
+    int i;
+
+    while (size < (unsigned int)g_conf->api_count * 2)
+        size <<= 1;
+    route_tbl = (struct hook_api_t**)calloc(size, sizeof(struct hook_api_t*));
+    if (route_tbl == NULL) {
+        err_write("route_initialize: no memory.");
+        return -1;
+    }
+    route_mask = size - 1;
+
+    route_root = route_node_new(NULL, 0);
+    if (route_root == NULL) {
+        err_write("route_initialize: no memory.");
+        return -1;
+    }
+
+    for (i = 0; i < g_conf->api_count; i++) {
+        struct hook_api_t* api;
+
+        api = &g_conf->api_table[i];
+        if (strchr(api->content_name, '*') != NULL) {
+            if (route_trie_add(api) < 0) {
+                err_write("route_initialize: no memory.");
+                return -1;
+            }
+        } else {
+            struct hook_api_t** slot;
+
+            slot = route_slot(api->content_name);
+            if (*slot == NULL)
+                *slot = api;
+        }
+    }
+    return 0;
+}
+
+/*
+ * ルーティングテーブルを解放します。
+ */
+void route_finalize()
+{
+    if (route_tbl != NULL) {
+        free(route_tbl);
+        route_tbl = NULL;
+    }
+    if (route_root != NULL) {
+        route_node_free(route_root);
+        route_root = NULL;
+    }
+}
+
+/*
+ * コンテンツ名に一致する API を検索します。
+ * ワイルドカードに一致した場合はキャプチャを match に設定します。
+ *
+ * content_name: リクエストされたコンテンツ名
+ * match: キャプチャを設定する領域
+ *
+ * 戻り値
+ *  API のポインタを返します。
+ *  一致する API がない場合は NULL を返します。
+ */
+struct hook_api_t* route_lookup(const char* content_name, struct route_match_t* match)
+{
+    struct hook_api_t* api;
+    int i;
+
+    match->count = 0;
+    match->rest_flag = 0;
+    if (route_tbl == NULL)
+        return NULL;
+
+    api = *route_slot(content_name);
+    if (api != NULL)
+        return api;
+    if (route_root->child == NULL && route_root->wildcard == NULL && route_root->rest_api == NULL)
+        return NULL;
+
+    strncpy(match->path, content_name, sizeof(match->path)-1);
+    match->path[sizeof(match->path)-1] = '\0';
+    api = route_trie_match(route_root, match->path, match);
+    if (api == NULL) {
+        match->count = 0;
+        return NULL;
+    }
+    /* キャプチャの区切り文字を終端にします。
+       残りのセグメントに一致したキャプチャは '/' を含みます。*/
+    for (i = 0; i < match->count; i++) {
+        char* end;
+
+        if (i == match->count - 1 && match->rest_flag)
+            break;
+        end = strchr(match->capture[i], '/');
+        if (end != NULL)
+            *end = '\0';
+    }
+    return api;
+}
+
+/*
+ * API を実行するワーカースレッドに現在のルートを設定します。
+ * API の実行が終わったら req と match に NULL を設定します。
+ */
+void route_set_current(struct request_t* req, struct route_match_t* match)
+{
+    current_req = req;
+    current_match = match;
+}
+
+/*
+ * ワイルドカードに一致したセグメントの数を取得します。
+ * API の中から呼び出します。
+ */
+int get_route_param_count(struct request_t* req)
+{
+    if (req == NULL || req != current_req)
+        return 0;
+    return current_match->count;
+}
+
+/*
+ * ワイルドカードに一致したセグメントを取得します。
+ * API の中から呼び出します。
+ *
+ * req: リクエスト構造体のポインタ
+ * index: パターンの '*' の位置(0 から)
+ *
+ * 戻り値
+ *  セグメントの文字列を返します。
+ *  存在しない場合は NULL を返します。
+ */
+const char* get_route_param(struct request_t* req, int index)
+{
+    if (req == NULL || req != current_req)
+        return NULL;
+    if (index < 0 || index >= current_match->count)
+        return NULL;
+    return current_match->capture[index];
+}
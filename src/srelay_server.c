@@ -35,13 +35,6 @@
 #define CMD_DEL_SESSION    5  /* DS(Delete Session) */
 #define CMD_COPY_SESSION   6  /* CS(Copy Session) */
 
-#ifdef WIN32
-static HANDLE srelay_queue_cond;
-#else
-static pthread_mutex_t srelay_queue_mutex;
-static pthread_cond_t srelay_queue_cond;
-#endif
-
 static struct appzone_t* get_zone(const char* zonename)
 {
     int n;
@@ -552,22 +545,8 @@ static void session_relay_thread(void* argv)
     while (! g_shutdown_flag) {
         int cmd;
 
-#ifndef WIN32
-        pthread_mutex_lock(&srelay_queue_mutex);
-#endif
-        /* キューにデータが入るまで待機します。*/
-        while (que_empty(g_session_relay_queue)) {
-#ifdef WIN32
-            WaitForSingleObject(srelay_queue_cond, INFINITE);
-#else
-            pthread_cond_wait(&srelay_queue_cond, &srelay_queue_mutex);
-#endif
-        }
-#ifndef WIN32
-        pthread_mutex_unlock(&srelay_queue_mutex);
-#endif
-        /* キューからデータを取り出します。*/
-        th_args = (struct thread_args_t*)que_pop(g_session_relay_queue);
+        /* キューにデータが入るまで待機して取り出します。*/
+        th_args = (struct thread_args_t*)wq_wait_pop(g_session_relay_queue, -1);
         if (th_args == NULL)
             continue;
 
@@ -634,17 +613,13 @@ int request_session_relay()
     th_args->client_socket = client_socket;
     th_args->sockaddr = sockaddr;
 
-    /* リクエストされた情報をキューイング(push)します。*/
-    que_push(g_session_relay_queue, th_args);
-
-    /* キューイングされたことをスレッドへ通知します。*/
-#ifdef WIN32
-    SetEvent(srelay_queue_cond);
-#else
-    pthread_mutex_lock(&srelay_queue_mutex);
-    pthread_cond_signal(&srelay_queue_cond);
-    pthread_mutex_unlock(&srelay_queue_mutex);
-#endif
+    /* リクエストされた情報をキューイング(push)します。
+       待機中のスレッドがあれば起床します。*/
+    if (wq_push(g_session_relay_queue, th_args) < 0) {
+        err_log(sockaddr.sin_addr, "session relay queue is full.");
+        SOCKET_CLOSE(client_socket);
+        free(th_args);
+    }
     return 0;
 }
 
@@ -676,14 +651,6 @@ int session_relay_server()
             g_conf->session_relay_copy_host[i], g_conf->session_relay_copy_port[i]);
     }
 
-    /* キューイング制御の初期化 */
-#ifdef WIN32
-    srelay_queue_cond = CreateEvent(NULL, FALSE, FALSE, NULL);
-#else
-    pthread_mutex_init(&srelay_queue_mutex, NULL);
-    pthread_cond_init(&srelay_queue_cond, NULL);
-#endif
-
     /* ワーカースレッドを生成します。 */
     for (i = 0; i < g_conf->session_relay_worker_threads; i++) {
         /* スレッドを作成します。
@@ -702,10 +669,6 @@ int session_relay_server()
 
 void session_relay_close()
 {
-#ifdef WIN32
-    CloseHandle(srelay_queue_cond);
-#else
-    pthread_cond_destroy(&srelay_queue_cond);
-    pthread_mutex_destroy(&srelay_queue_mutex);
-#endif
+    /* 待機中のワーカースレッドを起床させます。*/
+    wq_wakeup_all(g_session_relay_queue);
 }
@@ -0,0 +1,322 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2010 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "http_server.h"
+#include <limits.h>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+/*
+ * 固定長のリングバッファによるロックフリーの MPMC キューです。
+ * (Dmitry Vyukov's bounded MPMC queue)
+ *
+ * 各セルはシーケンス番号を持ち、プッシュとポップは
+ * 位置カウンタの compare-and-swap だけで行ないます。
+ * キューが空の場合のみ待機側はスリープします(Linux は futex)。
+ * Windows は SRWLOCK/CONDITION_VARIABLE を使用します。
+ */
+#define WQ_CACHE_LINE 64
+
+struct wq_cell_t {
+    volatile size_t sequence;
+    void* data;
+};
+
+struct wqueue_t {
+    size_t mask;                        /* capacity - 1 */
+    struct wq_cell_t* cells;
+    char pad0[WQ_CACHE_LINE];
+    volatile size_t enqueue_pos;
+    char pad1[WQ_CACHE_LINE];
+    volatile size_t dequeue_pos;
+    char pad2[WQ_CACHE_LINE];
+    volatile int waiters;               /* sleeping consumers */
+    volatile int wake_seq;              /* futex word */
+#ifdef _WIN32
+    SRWLOCK park_lock;
+    CONDITION_VARIABLE park_cond;
+#elif !defined(__linux__)
+    pthread_mutex_t park_mutex;
+    pthread_cond_t park_cond;
+#endif
+};
+
+#ifdef __linux__
+static void futex_wait(volatile int* addr, int val, int timeout_ms)
+{
+    struct timespec ts;
+    struct timespec* tp = NULL;
+
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        tp = &ts;
+    }
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, tp, NULL, 0);
+}
+
+static void futex_wake(volatile int* addr, int count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+#endif
+
+/*
+ * キューを初期化します。
+ * capacity は２のべき乗に切り上げられます。
+ *
+ * capacity: キューに保持できる最大の要素数
+ *
+ * 戻り値
+ *  キュー構造体のポインタを返します。
+ *  エラーの場合は NULL を返します。
+ */
+struct wqueue_t* wq_initialize(int capacity)
+{
+    struct wqueue_t* wq;
+    size_t size = 2;
+    size_t i;
+
+    while (size < (size_t)capacity)
+        size <<= 1;
+
+    wq = (struct wqueue_t*)calloc(1, sizeof(struct wqueue_t));
+    if (wq == NULL) {
+        err_write("wq_initialize: no memory.");
+        return NULL;
+    }
+    wq->cells = (struct wq_cell_t*)malloc(sizeof(struct wq_cell_t) * size);
+    if (wq->cells == NULL) {
+        err_write("wq_initialize: no memory.");
+        free(wq);
+        return NULL;
+    }
+    for (i = 0; i < size; i++)
+        wq->cells[i].sequence = i;
+    wq->mask = size - 1;
+#ifdef _WIN32
+    InitializeSRWLock(&wq->park_lock);
+    InitializeConditionVariable(&wq->park_cond);
+#elif !defined(__linux__)
+    pthread_mutex_init(&wq->park_mutex, NULL);
+    pthread_cond_init(&wq->park_cond, NULL);
+#endif
+    return wq;
+}
+
+/*
+ * キューを終了します。
+ * キューに残っている要素は解放しません。
+ */
+void wq_finalize(struct wqueue_t* wq)
+{
+    if (wq == NULL)
+        return;
+#if !defined(_WIN32) && !defined(__linux__)
+    pthread_cond_destroy(&wq->park_cond);
+    pthread_mutex_destroy(&wq->park_mutex);
+#endif
+    free(wq->cells);
+    free(wq);
+}
+
+static void wq_wakeup(struct wqueue_t* wq, int count)
+{
+    ATOMIC_ADD(&wq->wake_seq, 1);
+#ifdef __linux__
+    futex_wake(&wq->wake_seq, count);
+#elif defined(_WIN32)
+    AcquireSRWLockExclusive(&wq->park_lock);
+    if (count == 1)
+        WakeConditionVariable(&wq->park_cond);
+    else
+        WakeAllConditionVariable(&wq->park_cond);
+    ReleaseSRWLockExclusive(&wq->park_lock);
+#else
+    pthread_mutex_lock(&wq->park_mutex);
+    if (count == 1)
+        pthread_cond_signal(&wq->park_cond);
+    else
+        pthread_cond_broadcast(&wq->park_cond);
+    pthread_mutex_unlock(&wq->park_mutex);
+#endif
+}
+
+/*
+ * キューに要素を追加します。
+ * 待機しているスレッドがある場合は１つだけ起床させます。
+ *
+ * 戻り値
+ *  正常に終了した場合はゼロを返します。
+ *  キューが満杯の場合は -1 を返します。
+ */
+int wq_push(struct wqueue_t* wq, void* data)
+{
+    struct wq_cell_t* cell;
+    size_t pos;
+
+    pos = ATOMIC_LOAD_RELAXED(&wq->enqueue_pos);
+    for (;;) {
+        intptr_t diff;
+
+        cell = &wq->cells[pos & wq->mask];
+        diff = (intptr_t)ATOMIC_LOAD(&cell->sequence) - (intptr_t)pos;
+        if (diff == 0) {
+            if (ATOMIC_CAS(&wq->enqueue_pos, &pos, pos + 1))
+                break;
+        } else if (diff < 0) {
+            return -1;  /* full */
+        } else {
+            pos = ATOMIC_LOAD_RELAXED(&wq->enqueue_pos);
+        }
+    }
+    cell->data = data;
+    ATOMIC_STORE(&cell->sequence, pos + 1);
+
+    /* 待機スレッドの有無はプッシュの完了後に調べます。*/
+    ATOMIC_FENCE();
+    if (ATOMIC_LOAD_RELAXED(&wq->waiters) > 0)
+        wq_wakeup(wq, 1);
+    return 0;
+}
+
+/*
+ * キューから要素を取り出します。
+ * キューが空の場合は待機せずに NULL を返します。
+ */
+void* wq_pop(struct wqueue_t* wq)
+{
+    struct wq_cell_t* cell;
+    size_t pos;
+    void* data;
+
+    pos = ATOMIC_LOAD_RELAXED(&wq->dequeue_pos);
+    for (;;) {
+        intptr_t diff;
+
+        cell = &wq->cells[pos & wq->mask];
+        diff = (intptr_t)ATOMIC_LOAD(&cell->sequence) - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (ATOMIC_CAS(&wq->dequeue_pos, &pos, pos + 1))
+                break;
+        } else if (diff < 0) {
+            return NULL;  /* empty */
+        } else {
+            pos = ATOMIC_LOAD_RELAXED(&wq->dequeue_pos);
+        }
+    }
+    data = cell->data;
+    ATOMIC_STORE(&cell->sequence, pos + wq->mask + 1);
+    return data;
+}
+
+/*
+ * キューから要素を取り出します。
+ * キューが空の場合は要素が追加されるまで待機します。
+ *
+ * timeout_ms: 待機時間(ミリ秒)、-1 は無制限
+ *
+ * 戻り値
+ *  要素のポインタを返します。
+ *  タイムアウトまたは wq_wakeup_all() で起床した場合は NULL を返します。
+ */
+void* wq_wait_pop(struct wqueue_t* wq, int timeout_ms)
+{
+    void* data;
+    int seq;
+
+    data = wq_pop(wq);
+    if (data != NULL)
+        return data;
+
+    /* 待機する前に起床シーケンスを取得しておきます。
+       その後にプッシュされた場合は futex_wait() がすぐに戻ります。*/
+    seq = ATOMIC_LOAD(&wq->wake_seq);
+    ATOMIC_ADD(&wq->waiters, 1);
+    data = wq_pop(wq);
+    if (data == NULL) {
+#ifdef __linux__
+        futex_wait(&wq->wake_seq, seq, timeout_ms);
+#elif defined(_WIN32)
+        AcquireSRWLockExclusive(&wq->park_lock);
+        if (ATOMIC_LOAD(&wq->wake_seq) == seq)
+            SleepConditionVariableSRW(&wq->park_cond, &wq->park_lock,
+                                      (timeout_ms < 0)? INFINITE : (DWORD)timeout_ms, 0);
+        ReleaseSRWLockExclusive(&wq->park_lock);
+#else
+        pthread_mutex_lock(&wq->park_mutex);
+        if (ATOMIC_LOAD(&wq->wake_seq) == seq) {
+            if (timeout_ms < 0) {
+                pthread_cond_wait(&wq->park_cond, &wq->park_mutex);
+            } else {
+                struct timespec ts;
+                struct timeval tv;
+
+                gettimeofday(&tv, NULL);
+                ts.tv_sec = tv.tv_sec + timeout_ms / 1000;
+                ts.tv_nsec = tv.tv_usec * 1000 + (timeout_ms % 1000) * 1000000L;
+                if (ts.tv_nsec >= 1000000000L) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&wq->park_cond, &wq->park_mutex, &ts);
+            }
+        }
+        pthread_mutex_unlock(&wq->park_mutex);
+#endif
+        data = wq_pop(wq);
+    }
+    ATOMIC_ADD(&wq->waiters, -1);
+    return data;
+}
+
+/*
+ * 待機しているすべてのスレッドを起床させます。
+ */
+void wq_wakeup_all(struct wqueue_t* wq)
+{
+    wq_wakeup(wq, INT_MAX);
+}
+
+/*
+ * キューが空か調べます。
+ * 他のスレッドが操作している場合は目安になります。
+ */
+int wq_empty(struct wqueue_t* wq)
+{
+    size_t dpos;
+    size_t epos;
+
+    dpos = ATOMIC_LOAD(&wq->dequeue_pos);
+    epos = ATOMIC_LOAD(&wq->enqueue_pos);
+    return (epos == dpos);
+}
@@ -0,0 +1,468 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2010 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * ドキュメントバンドルの作成ツール
+ *
+ * document_root 以下のファイルを１つのバンドルファイルにまとめます。
+ * パスの順に並べたエントリテーブル、MIME/type、ETag と
+ * gzip で圧縮したボディ(任意)を含みます。
+ * nesta.conf の http.document_bundle に指定して使用します。
+ *
+ * 出力は一時ファイルに書き込んでから rename() で置き換えるため、
+ * 動作中のバンドルを壊さずに入れ替えることができます。
+ *
+ * build:
+ *   cc -O2 -DHAVE_LIBZ -I. -I/usr/local/include/nestalib -o nesta_pack \
+ *      tools/nesta_pack.c src/mime.c -lnesta -lz
+ *
+ * usage:
+ *   ./nesta_pack [-z] [-m mime.types] document_root bundle_file
+ *
+ *   -z  テキスト系のファイルを gzip で圧縮したボディも格納します
+ *       (xxx.gz のファイルがある場合はそれを使用します)
+ *   -m  MIME/type の定義ファイル(http.mime_types と同じもの)
+ */
+#include "src/http_server.h"
+#include <dirent.h>
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+struct pack_file_t {
+    char* path;                         /* document_root relative path */
+    char* fpath;                        /* full path */
+    char* gz_fpath;                     /* precompressed file(xxx.gz) */
+    int skip;                           /* gzip variant of other file */
+};
+
+static struct pack_file_t* files = NULL;
+static int file_count = 0;
+static int file_capacity = 0;
+static int gzip_flag = 0;
+
+static char* strings = NULL;
+static int strings_size = 0;
+static int strings_capacity = 0;
+
+static void usage()
+{
+    fprintf(stderr, "usage: nesta_pack [-z] [-m mime.types] document_root bundle_file\n");
+}
+
+static void add_file(const char* path, const char* fpath)
+{
+    if (file_count >= file_capacity) {
+        file_capacity = (file_capacity == 0)? 256 : file_capacity * 2;
+        files = (struct pack_file_t*)realloc(files, sizeof(struct pack_file_t) * file_capacity);
+        if (files == NULL) {
+            fprintf(stderr, "no memory.\n");
+            exit(1);
+        }
+    }
+    files[file_count].path = strdup(path);
+    files[file_count].fpath = strdup(fpath);
+    files[file_count].gz_fpath = NULL;
+    files[file_count].skip = 0;
+    file_count++;
+}
+
+/*
+ * ディレクトリを再帰的に調べてファイルを追加します。
+ * '.' で始まるファイルとディレクトリは追加しません(check_file() と同じです)。
+ */
+static int scan_dir(const char* root, const char* dir)
+{
+    char dpath[MAX_PATH+1];
+    DIR* dp;
+    struct dirent* de;
+
+    snprintf(dpath, sizeof(dpath), "%s%s%s", root, (*dir)? "/" : "", dir);
+    dp = opendir(dpath);
+    if (dp == NULL) {
+        fprintf(stderr, "can't open directory (%s): %s\n", dpath, strerror(errno));
+        return -1;
+    }
+    while ((de = readdir(dp)) != NULL) {
+        char path[MAX_PATH+1];
+        char fpath[MAX_PATH*2+2];
+        struct stat st;
+
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s%s%s", dir, (*dir)? "/" : "", de->d_name);
+        snprintf(fpath, sizeof(fpath), "%s/%s", root, path);
+        if (stat(fpath, &st) < 0)
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            if (scan_dir(root, path) < 0) {
+                closedir(dp);
+                return -1;
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            if (st.st_size > INT_MAX) {
+                fprintf(stderr, "skip large file (%s)\n", path);
+                continue;
+            }
+            add_file(path, fpath);
+        }
+    }
+    closedir(dp);
+    return 0;
+}
+
+static int compare_path(const void* a, const void* b)
+{
+    return strcmp(((const struct pack_file_t*)a)->path, ((const struct pack_file_t*)b)->path);
+}
+
+static struct pack_file_t* find_file(const char* path)
+{
+    struct pack_file_t key;
+
+    key.path = (char*)path;
+    return (struct pack_file_t*)bsearch(&key, files, file_count,
+                                        sizeof(struct pack_file_t), compare_path);
+}
+
+/* 文字列テーブルに追加してそのオフセットを返します。*/
+static unsigned int add_string(const char* str)
+{
+    int len;
+    unsigned int offset;
+
+    len = strlen(str) + 1;
+    if (strings_size + len > strings_capacity) {
+        while (strings_size + len > strings_capacity)
+            strings_capacity = (strings_capacity == 0)? 4096 : strings_capacity * 2;
+        strings = (char*)realloc(strings, strings_capacity);
+        if (strings == NULL) {
+            fprintf(stderr, "no memory.\n");
+            exit(1);
+        }
+    }
+    offset = (unsigned int)strings_size;
+    memcpy(strings + strings_size, str, len);
+    strings_size += len;
+    return offset;
+}
+
+static char* read_all(const char* fpath, int* size)
+{
+    FILE* fp;
+    struct stat st;
+    char* data;
+
+    fp = fopen(fpath, "rb");
+    if (fp == NULL)
+        return NULL;
+    if (fstat(fileno(fp), &st) < 0) {
+        fclose(fp);
+        return NULL;
+    }
+    data = (char*)malloc((size_t)st.st_size + 1);
+    if (data != NULL) {
+        if (fread(data, 1, (size_t)st.st_size, fp) != (size_t)st.st_size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(fp);
+    *size = (int)st.st_size;
+    return data;
+}
+
+/* ボディを境界に合わせて書き込み、そのオフセットを返します。*/
+static int64 write_body(FILE* fp, const char* data, int size)
+{
+    static const char zero[BUNDLE_ALIGN] = {0};
+    long pos;
+    int pad;
+
+    pos = ftell(fp);
+    pad = (int)((BUNDLE_ALIGN - (pos % BUNDLE_ALIGN)) % BUNDLE_ALIGN);
+    if (pad > 0 && fwrite(zero, 1, pad, fp) != (size_t)pad)
+        return -1;
+    if (size > 0 && fwrite(data, 1, size, fp) != (size_t)size)
+        return -1;
+    return (int64)pos + pad;
+}
+
+/* サーバーと同じ規則で MIME/type を決定します(build_doc_header)。*/
+static void file_type(const char* path, char* buf, int bufsize)
+{
+    const char* ext;
+    const char* type = NULL;
+
+    ext = strrchr(path, '.');
+    if (ext != NULL && strchr(ext, '/') == NULL && ext != path)
+        type = mime_type(ext + 1);
+    if (type != NULL)
+        snprintf(buf, bufsize, "%s", type);
+    else
+        snprintf(buf, bufsize, "application/%s", (ext != NULL && strchr(ext, '/') == NULL)? ext + 1 : "");
+}
+
+static int is_compressible(const char* type)
+{
+    if (strncmp(type, "text/", 5) == 0)
+        return 1;
+    if (strstr(type, "javascript") || strstr(type, "json") || strstr(type, "xml"))
+        return 1;
+    return 0;
+}
+
+#ifdef HAVE_LIBZ
+static char* gzip_data(const char* data, int size, int* out_size)
+{
+    z_stream z;
+    char* out;
+    uLong bound;
+
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+    bound = deflateBound(&z, size) + 32;
+    out = (char*)malloc(bound);
+    if (out == NULL) {
+        deflateEnd(&z);
+        return NULL;
+    }
+    z.next_in = (Bytef*)data;
+    z.avail_in = size;
+    z.next_out = (Bytef*)out;
+    z.avail_out = bound;
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&z);
+        free(out);
+        return NULL;
+    }
+    *out_size = (int)z.total_out;
+    deflateEnd(&z);
+    return out;
+}
+#endif
+
+/* 内容(FNV-1a)とサイズから強い ETag を作成します。*/
+static void make_etag(char* buf, int bufsize, const char* data, int size)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    int i;
+
+    for (i = 0; i < size; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    snprintf(buf, bufsize, "\"%llx-%x\"", h, size);
+}
+
+static int pack(const char* out_fname)
+{
+    char tmp_fname[MAX_PATH+8];
+    struct bundle_header_t header;
+    struct bundle_entry_t* entries;
+    FILE* fp;
+    int count = 0;
+    int64 gz_total = 0;
+    int i;
+
+    entries = (struct bundle_entry_t*)calloc(file_count + 1, sizeof(struct bundle_entry_t));
+    if (entries == NULL) {
+        fprintf(stderr, "no memory.\n");
+        return -1;
+    }
+    snprintf(tmp_fname, sizeof(tmp_fname), "%s.tmp", out_fname);
+    fp = fopen(tmp_fname, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "can't open (%s): %s\n", tmp_fname, strerror(errno));
+        free(entries);
+        return -1;
+    }
+
+    /* ヘッダーは最後に書き直します。*/
+    memset(&header, 0, sizeof(header));
+    if (fwrite(&header, sizeof(header), 1, fp) != 1)
+        goto write_error;
+
+    for (i = 0; i < file_count; i++) {
+        struct pack_file_t* pf = &files[i];
+        struct bundle_entry_t* e;
+        struct stat st;
+        char type[256];
+        char etag[64];
+        char* data;
+        int size;
+
+        if (pf->skip)
+            continue;
+        if (stat(pf->fpath, &st) < 0 || (data = read_all(pf->fpath, &size)) == NULL) {
+            fprintf(stderr, "can't read (%s): %s\n", pf->fpath, strerror(errno));
+            goto error;
+        }
+        file_type(pf->path, type, sizeof(type));
+        make_etag(etag, sizeof(etag), data, size);
+
+        e = &entries[count++];
+        e->path = add_string(pf->path);
+        e->type = add_string(type);
+        e->etag = add_string(etag);
+        e->mtime = (int64)st.st_mtime;
+        e->size = size;
+        e->offset = write_body(fp, data, size);
+        if (e->offset < 0) {
+            free(data);
+            goto write_error;
+        }
+
+        /* 圧縮したボディは元のボディの直後に置きます。*/
+        if (pf->gz_fpath != NULL) {
+            char* gz_data;
+            int gz_size;
+
+            gz_data = read_all(pf->gz_fpath, &gz_size);
+            if (gz_data != NULL) {
+                e->gz_offset = write_body(fp, gz_data, gz_size);
+                e->gz_size = gz_size;
+                free(gz_data);
+            }
+#ifdef HAVE_LIBZ
+        } else if (gzip_flag && size >= GZIP_MIN_SIZE && is_compressible(type)) {
+            char* gz_data;
+            int gz_size;
+
+            gz_data = gzip_data(data, size, &gz_size);
+            if (gz_data != NULL) {
+                /* 圧縮しても小さくならないものは格納しません。*/
+                if (gz_size < size) {
+                    e->gz_offset = write_body(fp, gz_data, gz_size);
+                    e->gz_size = gz_size;
+                }
+                free(gz_data);
+            }
+#endif
+        }
+        free(data);
+        if (e->gz_offset < 0)
+            goto write_error;
+        gz_total += e->gz_size;
+    }
+
+    /* エントリテーブルと文字列テーブル */
+    header.index_offset = write_body(fp, (const char*)entries, (int)(sizeof(struct bundle_entry_t) * count));
+    header.strings_offset = write_body(fp, strings, strings_size);
+    if (header.index_offset < 0 || header.strings_offset < 0)
+        goto write_error;
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.version = BUNDLE_VERSION;
+    header.count = (unsigned int)count;
+    header.strings_size = strings_size;
+    header.file_size = (int64)ftell(fp);
+    header.build_time = (int64)time(NULL);
+    if (fseek(fp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, fp) != 1)
+        goto write_error;
+    if (fclose(fp) != 0) {
+        fp = NULL;
+        goto write_error;
+    }
+    if (rename(tmp_fname, out_fname) < 0) {
+        fprintf(stderr, "can't rename (%s): %s\n", out_fname, strerror(errno));
+        unlink(tmp_fname);
+        free(entries);
+        return -1;
+    }
+    fprintf(stdout, "%s: %d files, %lld bytes (gzip %lld bytes)\n",
+            out_fname, count, header.file_size, gz_total);
+    free(entries);
+    return 0;
+
+write_error:
+    fprintf(stderr, "write error (%s): %s\n", tmp_fname, strerror(errno));
+error:
+    if (fp != NULL)
+        fclose(fp);
+    unlink(tmp_fname);
+    free(entries);
+    return -1;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* mime_file = "";
+    char root[MAX_PATH+1];
+    const char* out_fname;
+    int i;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-z") == 0) {
+#ifdef HAVE_LIBZ
+            gzip_flag = 1;
+#else
+            fprintf(stderr, "-z is not supported (zlib).\n");
+#endif
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            mime_file = argv[++i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (argc - i != 2) {
+        usage();
+        return 1;
+    }
+    snprintf(root, sizeof(root), "%s", argv[i]);
+    out_fname = argv[i + 1];
+    while (strlen(root) > 1 && root[strlen(root)-1] == '/')
+        root[strlen(root)-1] = '\0';
+
+    if (mime_initialize(mime_file) < 0)
+        return 1;
+    if (scan_dir(root, "") < 0)
+        return 1;
+    qsort(files, file_count, sizeof(struct pack_file_t), compare_path);
+
+    /* xxx.gz は xxx がある場合はその圧縮済みボディとして格納します。*/
+    for (i = 0; i < file_count; i++) {
+        int len;
+
+        len = strlen(files[i].path);
+        if (len > 3 && strcmp(files[i].path + len - 3, ".gz") == 0) {
+            char base[MAX_PATH+1];
+            struct pack_file_t* pf;
+
+            snprintf(base, sizeof(base), "%.*s", len - 3, files[i].path);
+            pf = find_file(base);
+            if (pf != NULL) {
+                pf->gz_fpath = files[i].fpath;
+                files[i].skip = 1;
+            }
+        }
+    }
+
+    if (pack(out_fname) < 0)
+        return 1;
+    mime_finalize();
+    return 0;
+}